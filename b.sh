@@ -26,7 +26,7 @@ cmake --build "$BUILD_DIR" --config Release --parallel $(nproc)
 
 if [ -d "$SHADER_DIR" ]; then
     echo "Verifying shader files..."
-    ls -la "$BUILD_DIR"/*.spv 2>/dev/null || echo "Warning: No .spv files found in build directory"
+    ls -la "$BUILD_DIR"/shaders/*.spv 2>/dev/null || echo "Warning: No .spv files found in build directory"
 fi
 
 echo -e "\n\033[1;32mBuild successful!\033[0m"
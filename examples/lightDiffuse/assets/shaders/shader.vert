@@ -5,9 +5,16 @@ layout(binding = 0) uniform CameraUBO {
     mat4 proj;
 } camera;
 
-layout(push_constant) uniform PushConstants {
+struct InstanceData {
     mat4 model;
-} push;
+    uint texture; // into the texture table in bindless mode
+};
+
+// One entry per drawn entity, gl_InstanceIndex includes the draw's
+// firstInstance
+layout(std430, binding = 3) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
@@ -16,12 +23,15 @@ layout(location = 2) in vec2 inTexCoord;
 layout(location = 0) out vec3 fragWorldPos;
 layout(location = 1) out vec3 fragNormal;
 layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) flat out uint fragTexture;
 
 void main() {
-    vec4 worldPos = push.model * vec4(inPosition, 1.0);
+    mat4 model = instances[gl_InstanceIndex].model;
+    fragTexture = instances[gl_InstanceIndex].texture;
+    vec4 worldPos = model * vec4(inPosition, 1.0);
     fragWorldPos = worldPos.xyz;
     
-    mat3 normalMatrix = transpose(inverse(mat3(push.model)));
+    mat3 normalMatrix = transpose(inverse(mat3(model)));
     fragNormal = normalMatrix * inNormal;
     
     fragTexCoord = inTexCoord;
@@ -3,10 +3,30 @@
 #include "types.h"
 #include <cglm/cglm.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
-int main(void) {
+// The renderer paths that are off by default, so each can be run and compared
+// with the default one: --gpu-driven, --occlusion (implies --gpu-driven) and
+// --bindless
+static void parse_arguments(int argc, char **argv, Settings *settings) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--gpu-driven") == 0) {
+      settings->gpu_driven = true;
+    } else if (strcmp(argv[i], "--occlusion") == 0) {
+      settings->gpu_driven = true;
+      settings->occlusion_culling = true;
+    } else if (strcmp(argv[i], "--bindless") == 0) {
+      settings->bindless_textures = true;
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
   Settings settings = {
       .api_version = VK_API_VERSION_1_3,
       .application_name = "Kudo",
@@ -16,6 +36,7 @@ int main(void) {
       .window_height = 600,
       .window_title = "Hello, Kuta!",
   };
+  parse_arguments(argc, argv, &settings);
 
   kuta_init(&settings);
   renderer_init();
@@ -4,13 +4,91 @@
 
 void world_init(World *world);
 
+void world_init_with_capacity(World *world, uint32_t entity_capacity);
+
 void world_cleanup(World *world);
 
+bool world_save_snapshot(World *world, const char *path);
+
+KutaSnapshotSave *world_save_snapshot_async(World *world, const char *path);
+
+bool world_snapshot_wait(KutaSnapshotSave *save);
+
+bool world_load_snapshot(World *world, const char *path);
+
+ComponentType register_component(World *world, size_t size, size_t alignment);
+
 Entity create_entity(World *world);
 
+uint32_t spawn_entities(World *world, uint32_t count,
+                        ComponentSignature signature,
+                        const void *const *components, Entity *entities);
+
+uint32_t instantiate_entity(World *world, Entity prefab, uint32_t count,
+                            Entity *entities);
+
+void destroy_entity(World *world, Entity entity);
+
+bool entity_exists(World *world, Entity entity);
+
 void add_component(World *world, Entity entity, ComponentType type,
                    void *component);
 
+void add_components(World *world, const Entity *entities, uint32_t count,
+                    ComponentType type, const void *components);
+
+void remove_component(World *world, Entity entity, ComponentType type);
+
+void *get_component(World *world, Entity entity, ComponentType type);
+
+Entity defer_create_entity(World *world);
+
+void defer_destroy_entity(World *world, Entity entity);
+
+void defer_add_component(World *world, Entity entity, ComponentType type,
+                         const void *component);
+
+void defer_remove_component(World *world, Entity entity, ComponentType type);
+
+void world_reserve_deferred_entities(World *world, uint32_t count);
+
+void world_flush_commands(World *world);
+
+KutaQuery *kuta_query_create(World *world, ComponentSignature required,
+                             ComponentSignature excluded);
+
+void kuta_query_destroy(World *world, KutaQuery *query);
+
+uint32_t kuta_query_count(const KutaQuery *query);
+
+Entity kuta_query_entity(const KutaQuery *query, uint32_t index);
+
+void kuta_job_submit(KutaJobFn fn, void *data, KutaJobCounter *counter);
+
+void kuta_job_submit_after(KutaJobCounter *dependency, KutaJobFn fn,
+                           void *data, KutaJobCounter *counter);
+
+bool kuta_job_done(KutaJobCounter *counter);
+
+void kuta_job_wait(KutaJobCounter *counter);
+
+void kuta_job_parallel_for(uint32_t count, uint32_t range_size,
+                           KutaJobRangeFn fn, void *data);
+
+uint32_t kuta_job_worker_count(void);
+
+uint32_t kuta_job_worker_index(void);
+
+uint32_t kuta_system_register(World *world, const char *name, KutaSystemFn fn,
+                              void *data, ComponentSignature reads,
+                              ComponentSignature writes);
+
+void kuta_systems_run(World *world, float delta_time);
+
+uint32_t kuta_system_count(World *world);
+
+bool kuta_system_stats(World *world, uint32_t system, KutaSystemStats *stats);
+
 void set_entity_position(World *world, Entity entity, vec3 position);
 
 float get_time();
@@ -21,6 +99,16 @@ void set_entity_scale(World *world, Entity entity, vec3 scale);
 
 void move_entity(World *world, Entity entity, vec3 delta);
 
+void mark_transform_dirty(World *world, Entity entity);
+
+void mark_render_dirty(World *world, Entity entity);
+
+const Entity *get_changed_transforms(World *world, uint32_t *count);
+
+bool set_entity_parent(World *world, Entity child, Entity parent);
+
+Entity get_entity_parent(World *world, Entity entity);
+
 void camera_system_update_vectors(CameraComponent *camera);
 
 void set_active_camera(Entity *camera_entity);
@@ -31,6 +119,8 @@ void renderer_init(void);
 
 uint32_t load_geometry(const char *filepath);
 
+uint32_t load_geometry_lods(const char *filepath, uint32_t lod_count);
+
 uint32_t load_texture(const char *texture_file);
 
 void renderer_deinit(void);
@@ -38,6 +128,14 @@ void renderer_deinit(void);
 void begin_frame(World *world);
 void end_frame(World *world);
 
+void *kuta_frame_alloc(size_t size, size_t alignment);
+
+bool kuta_memory_stats(KutaMemoryTag tag, KutaMemoryStats *stats);
+
+const char *kuta_memory_tag_name(KutaMemoryTag tag);
+
+void kuta_memory_set_frame_guard(bool enabled);
+
 bool running();
 
 void kuta_deinit(void);
@@ -1,31 +1,101 @@
 #pragma once
 #include <cglm/cglm.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <vulkan/vulkan.h>
 
-#define MAX_ENTITIES 1024
-#define MAX_COMPONENT_TYPES 32
-#define COMPONENT_SIGNATURE(type) (1ULL << (type))
+#define KUTA_DEFAULT_ENTITY_CAPACITY 1024
+#define MAX_COMPONENT_TYPES 128
 
 typedef uint32_t Entity;
 
+// Entity handles pack a slot index with the slot's generation, so handles to
+// destroyed entities stop resolving once their slot is reused
+#define ENTITY_NULL 0
+#define ENTITY_INDEX_BITS 20
+#define ENTITY_INDEX_MASK ((1u << ENTITY_INDEX_BITS) - 1)
+#define ENTITY_GENERATION_MASK ((1u << (32 - ENTITY_INDEX_BITS)) - 1)
+#define ENTITY_INDEX(entity) ((entity) & ENTITY_INDEX_MASK)
+#define ENTITY_GENERATION(entity) ((entity) >> ENTITY_INDEX_BITS)
+#define ENTITY_MAKE(index, generation)                                         \
+  ((Entity)(((generation) << ENTITY_INDEX_BITS) | (index)))
+#define KUTA_MAX_ENTITIES (1u << ENTITY_INDEX_BITS)
+// entity_slots value of an index that was never used or is reserved by a
+// deferred create
+#define ENTITY_SLOT_PENDING UINT32_MAX
+
 typedef enum {
   COMPONENT_TRANSFORM = 0,
   COMPONENT_MESH_RENDERER,
   COMPONENT_CAMERA,
   COMPONENT_VISIBILITY,
   COMPONENT_LIGHT,
+  COMPONENT_HIERARCHY,
   COMPONENT_COUNT
 } ComponentType;
 
+// Types past COMPONENT_COUNT are handed out by register_component
+#define COMPONENT_TYPE_INVALID ((ComponentType)MAX_COMPONENT_TYPES)
+
+// One bit per component type, built with COMPONENT_SIGNATURE(a, b, ...)
+#define COMPONENT_SIGNATURE_WORDS (MAX_COMPONENT_TYPES / 64)
+
+typedef struct {
+  uint64_t bits[COMPONENT_SIGNATURE_WORDS];
+} ComponentSignature;
+
+static inline bool component_signature_has(ComponentSignature signature,
+                                           ComponentType type) {
+  return (signature.bits[type >> 6] >> (type & 63)) & 1;
+}
+
+static inline void component_signature_add(ComponentSignature *signature,
+                                           ComponentType type) {
+  signature->bits[type >> 6] |= 1ULL << (type & 63);
+}
+
+static inline void component_signature_remove(ComponentSignature *signature,
+                                              ComponentType type) {
+  signature->bits[type >> 6] &= ~(1ULL << (type & 63));
+}
+
+static inline ComponentSignature
+component_signature_make(const ComponentType *types, uint32_t count) {
+  ComponentSignature signature = {0};
+  for (uint32_t i = 0; i < count; i++) {
+    component_signature_add(&signature, types[i]);
+  }
+  return signature;
+}
+
+#define COMPONENT_SIGNATURE(...)                                               \
+  component_signature_make(                                                    \
+      (const ComponentType[]){__VA_ARGS__},                                    \
+      sizeof((const ComponentType[]){__VA_ARGS__}) / sizeof(ComponentType))
+#define COMPONENT_SIGNATURE_EMPTY ((ComponentSignature){0})
+
 typedef struct {
   vec3 position;
   vec3 rotation;
   vec3 scale;
   bool dirty;
-  mat4 matrix;
+  mat4 matrix;       // local TRS
+  mat4 world_matrix; // parent world_matrix * matrix, same as matrix for roots
 } TransformComponent;
 
+// Managed by set_entity_parent, don't add it by hand. Children form a
+// doubly linked sibling list and depth/subtree_size describe the entity's
+// place in the hierarchy pool, which is kept in preorder
+typedef struct {
+  Entity parent;
+  Entity first_child;
+  Entity next_sibling;
+  Entity prev_sibling;
+  uint32_t depth;
+  uint32_t subtree_size;
+  bool dirty;
+} HierarchyComponent;
+
 typedef struct {
   uint32_t model_id;
   uint32_t texture_id;
@@ -33,6 +103,10 @@ typedef struct {
 
 typedef struct {
   bool visible;
+  // Written by the renderer: whether the entity survived culling when it was
+  // last drawn, a few frames behind on the GPU-driven path. Call
+  // mark_render_dirty after changing visible or alpha by hand
+  bool on_screen;
   float alpha;
 } VisibilityComponent;
 
@@ -81,17 +155,150 @@ typedef struct {
   bool enabled;
 } LightComponent;
 
-typedef uint64_t ComponentSignature;
+// Sparse set: components are packed into fixed size chunks that are never
+// moved once allocated, so pointers stay valid while the pool grows. Each chunk
+// holds 1 << chunk_shift components followed by their owning entities.
+// `sparse_pages` maps an entity index to its packed slot, pages are only
+// allocated for index ranges that own the component
+#define COMPONENT_POOL_EMPTY UINT32_MAX
+#define COMPONENT_POOL_PAGE_SHIFT 10
+#define COMPONENT_POOL_PAGE_SIZE (1u << COMPONENT_POOL_PAGE_SHIFT)
+#define COMPONENT_POOL_PAGE_COUNT (KUTA_MAX_ENTITIES / COMPONENT_POOL_PAGE_SIZE)
+
+typedef struct {
+  void **chunks;
+  uint32_t **sparse_pages;
+  uint32_t count;
+  uint32_t chunk_count;
+  uint32_t chunk_shift;
+  size_t entities_offset;
+  size_t component_size;
+} ComponentPool;
+
+// Growable list of entity handles
+typedef struct {
+  Entity *items;
+  uint32_t count;
+  uint32_t capacity;
+} EntityList;
+
+// Cached list of the entities whose signature has every `required` bit and
+// none of the `excluded` ones, kept up to date as components change
+typedef struct KutaQuery KutaQuery;
 
+// Registered systems and the order they depend on each other in
+typedef struct KutaScheduler KutaScheduler;
+
+// Structural changes recorded by the defer_* functions, applied in order by
+// world_flush_commands. Each job worker records into its own buffer
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+} KutaCommandBuffer;
+
+// `entities` is the packed list of live handles. Everything else is indexed
+// by ENTITY_INDEX: a live slot stores its position in `entities`, a free slot
+// stores the next free index of the FIFO free list. These arrays grow with
+// the world, component data lives in the pools and never moves
 typedef struct {
-  Entity entities[MAX_ENTITIES];
-  ComponentSignature signatures[MAX_ENTITIES];
-  void *component_pools[COMPONENT_COUNT];
-  size_t component_sizes[COMPONENT_COUNT];
+  Entity *entities;
+  ComponentSignature *signatures;
+  uint16_t *generations;
+  uint32_t *entity_slots;
+  // Built-in types first, then the registered ones
+  ComponentPool component_pools[MAX_COMPONENT_TYPES];
+  uint32_t component_type_count;
   uint32_t entity_count;
+  uint32_t entity_capacity;
   uint32_t next_entity_id;
+  uint32_t free_head;
+  uint32_t free_tail;
+  uint32_t free_count;
+  // Next fresh index, ahead of next_entity_id while deferred creates wait
+  volatile uint32_t reserved_entity_id;
+  KutaQuery **queries;
+  uint32_t query_count;
+  KutaQuery *render_query;
+  KutaQuery *light_query;
+  Entity active_camera;
+  volatile uint32_t hierarchy_dirty;
+  bool hierarchy_order_dirty;
+  // Transforms flagged since the last update, and the ones whose
+  // world_matrix that update rewrote
+  EntityList dirty_transforms;
+  EntityList changed_transforms;
+  // Entities that joined or left render_query or were passed to
+  // mark_render_dirty, only collected while the GPU-driven renderer tracks
+  // them
+  bool track_render_changes;
+  EntityList render_changes;
+  // One per job worker plus a shared one for other threads, which is locked
+  KutaCommandBuffer *command_buffers;
+  uint32_t command_buffer_count;
+  volatile uint32_t shared_commands_lock;
+  KutaScheduler *scheduler;
 } World;
 
+// Jobs run on a pool of worker threads, see kuta_job_submit
+typedef void (*KutaJobFn)(void *data);
+typedef void (*KutaJobRangeFn)(void *data, uint32_t begin, uint32_t end);
+typedef struct KutaJobNode KutaJobNode;
+
+#define KUTA_JOB_NO_WORKER UINT32_MAX
+
+// Counts the unfinished jobs submitted with it, zero initialise before use.
+// Jobs submitted with kuta_job_submit_after it start once it reaches zero
+typedef struct {
+  volatile uint32_t pending;
+  volatile uint32_t lock;
+  KutaJobNode *waiting;
+} KutaJobCounter;
+
+// Systems run as jobs, so they must only change the world's structure through
+// the defer_* functions
+typedef void (*KutaSystemFn)(World *world, float delta_time, void *data);
+
+#define KUTA_SYSTEM_INVALID UINT32_MAX
+
+// Times are in milliseconds, the average is smoothed over recent frames
+typedef struct {
+  const char *name;
+  float last_ms;
+  float average_ms;
+  uint32_t worker; // worker the system last ran on
+} KutaSystemStats;
+
+// An asynchronous world_save_snapshot_async in flight
+typedef struct KutaSnapshotSave KutaSnapshotSave;
+
+// Subsystem an allocation is accounted to
+typedef enum {
+  KUTA_MEMORY_CORE, // job system, arenas and everything untagged
+  KUTA_MEMORY_ECS,
+  KUTA_MEMORY_RESOURCES,
+  KUTA_MEMORY_RENDERER,
+  KUTA_MEMORY_SWAPCHAIN,
+  KUTA_MEMORY_TAG_COUNT,
+} KutaMemoryTag;
+
+// Host bytes include the Vulkan driver's allocations made through the
+// engine's allocation callbacks, device bytes are VkDeviceMemory
+typedef struct {
+  uint64_t live_bytes;
+  uint64_t peak_bytes;
+  uint64_t device_live_bytes;
+  uint64_t device_peak_bytes;
+  uint64_t allocations;       // host and device, since kuta_init
+  uint64_t frame_allocations; // during the last finished frame
+} KutaMemoryStats;
+
+#define KUTA_DEFAULT_PARALLEL_TRANSFORM_THRESHOLD 4096
+#define KUTA_DEFAULT_FRAME_ARENA_SIZE (4u << 20)
+#define KUTA_DEFAULT_PARALLEL_RECORD_THRESHOLD 1024
+#define KUTA_DEFAULT_LOD_ERROR 0.001f
+#define KUTA_MAX_GEOMETRY_LODS 4
+
 typedef struct {
   const char *window_title;
   const char *application_name;
@@ -100,4 +307,36 @@ typedef struct {
   uint32_t window_width, window_height;
   uint32_t api_version;
   VkClearColorValue background_color;
+
+  // Worker threads besides the main one, 0 picks one per extra core
+  uint32_t worker_count;
+  // Transform counts below this are updated on the main thread, 0 picks
+  // KUTA_DEFAULT_PARALLEL_TRANSFORM_THRESHOLD
+  uint32_t parallel_transform_threshold;
+  // Frames with fewer draws than this are recorded on the main thread, more
+  // are split across the job workers. 0 picks
+  // KUTA_DEFAULT_PARALLEL_RECORD_THRESHOLD
+  uint32_t parallel_record_threshold;
+  // Bytes of transient memory per frame in flight, 0 picks
+  // KUTA_DEFAULT_FRAME_ARENA_SIZE
+  uint32_t frame_arena_size;
+  // Frustum cull, pick the levels of detail and build the draw commands in
+  // a compute pass, needs a Vulkan 1.2 api_version, drawIndirectCount and
+  // multiDrawIndirect, otherwise the CPU path stays in use
+  bool gpu_driven;
+  // Also skip entities hidden behind what the previous frame drew, tested
+  // against a depth pyramid. Only used on the GPU-driven path
+  bool occlusion_culling;
+  // Sample every texture from one descriptor array indexed per instance
+  // instead of binding a descriptor set per texture, needs a Vulkan 1.2
+  // api_version and descriptor indexing, otherwise the per texture sets stay
+  // in use
+  bool bindless_textures;
+  // Entities whose bounding sphere covers less than this fraction of the
+  // screen height aren't drawn, 0 draws them however small
+  float min_screen_size;
+  // Largest simplification error, as a fraction of the screen height, a
+  // geometry loaded with load_geometry_lods may show. 0 picks
+  // KUTA_DEFAULT_LOD_ERROR
+  float lod_error;
 } Settings;
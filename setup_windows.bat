@@ -52,6 +52,15 @@ if not exist "vcpkg.json" (
     exit /b 1
 )
 
+where glslc >nul 2>nul
+if errorlevel 1 (
+    if not exist "%VULKAN_SDK%\Bin\glslc.exe" (
+        echo.
+        echo WARNING: glslc not found, the shaders won't be compiled
+        echo Install the Vulkan SDK and set VULKAN_SDK to build them
+    )
+)
+
 echo.
 echo [3/3] Building project...
 echo Note: CMake will automatically install dependencies from vcpkg.json
@@ -84,6 +93,7 @@ echo Build Complete!
 echo ============================================
 echo.
 echo Library: %BUILD_DIR%\kuta.dll
+echo Shaders: %BUILD_DIR%\shaders\*.spv
 echo.
 echo To rebuild later, just run:
 echo   mingw32-make -C %BUILD_DIR% -j4
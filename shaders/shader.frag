@@ -1,10 +1,22 @@
 #version 450
 
+#ifdef BINDLESS
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
+
 layout(location = 0) in vec3 fragWorldPos;
 layout(location = 1) in vec3 fragNormal;
 layout(location = 2) in vec2 fragTexCoord;
 
+#ifdef BINDLESS
+// Every loaded texture at the index of its id. All instances of a draw share
+// theirs, so the index is dynamically uniform
+layout(set = 1, binding = 0) uniform sampler2D textures[];
+
+layout(location = 3) flat in uint fragTexture;
+#else
 layout(binding = 1) uniform sampler2D texSampler;
+#endif
 
 layout(binding = 2) uniform LightingUBO {
     vec3 lightPos;
@@ -21,7 +33,11 @@ layout(location = 0) out vec4 outColor;
 
 void main() {
     // Sample the texture
+#ifdef BINDLESS
+    vec4 texColor = texture(textures[fragTexture], fragTexCoord);
+#else
     vec4 texColor = texture(texSampler, fragTexCoord);
+#endif
     
     // Normalize the interpolated normal
     vec3 norm = normalize(fragNormal);
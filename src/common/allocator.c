@@ -0,0 +1,359 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "kuta.h"
+#include "allocator.h"
+#include "threads.h"
+#include "types.h"
+
+// Bytes in front of every allocation, keeps malloc's alignment
+#define ALLOCATION_HEADER_SIZE 16
+
+// Sits right in front of the pointer handed out
+typedef struct {
+  size_t size;
+  uint32_t offset; // from the start of the malloc block
+  uint16_t tag;
+  uint16_t alignment_shift; // log2, Vulkan may ask for 64 KiB and more
+} AllocationHeader;
+
+_Static_assert(sizeof(AllocationHeader) <= ALLOCATION_HEADER_SIZE,
+               "AllocationHeader doesn't fit in front of the allocation");
+
+typedef struct {
+  volatile int64_t live;
+  volatile int64_t peak;
+  volatile int64_t device_live;
+  volatile int64_t device_peak;
+  volatile int64_t allocations;
+  // allocations when the current frame began, and during the last one
+  int64_t frame_start;
+  int64_t last_frame;
+} MemoryCounters;
+
+static MemoryCounters counters[KUTA_MEMORY_TAG_COUNT];
+static volatile uint32_t frame_guard;
+static volatile uint32_t in_frame;
+
+static const char *const tag_names[KUTA_MEMORY_TAG_COUNT] = {
+    "core", "ecs", "resources", "renderer", "swapchain",
+};
+
+static void raise_peak(volatile int64_t *peak, int64_t live) {
+  int64_t current = kuta_atomic_load_i64(peak);
+  while (live > current && !kuta_atomic_cas_i64(peak, current, live)) {
+    current = kuta_atomic_load_i64(peak);
+  }
+}
+
+static void count_allocation(KutaMemoryTag tag, int64_t bytes) {
+  kuta_atomic_add_i64(&counters[tag].allocations, 1);
+
+  if (kuta_atomic_load_u32(&frame_guard) && kuta_atomic_load_u32(&in_frame)) {
+    printf("Error: %lld %s bytes allocated during a guarded frame!\n",
+           (long long)bytes, tag_names[tag]);
+    abort();
+  }
+}
+
+static void track_host(KutaMemoryTag tag, int64_t delta) {
+  int64_t live = kuta_atomic_add_i64(&counters[tag].live, delta) + delta;
+  raise_peak(&counters[tag].peak, live);
+}
+
+static AllocationHeader *header_of(void *ptr) {
+  return (AllocationHeader *)((unsigned char *)ptr - sizeof(AllocationHeader));
+}
+
+void *kuta_aligned_alloc(KutaMemoryTag tag, size_t size, size_t alignment) {
+  if ((uint32_t)tag >= KUTA_MEMORY_TAG_COUNT)
+    tag = KUTA_MEMORY_CORE;
+  if (alignment < _Alignof(max_align_t))
+    alignment = _Alignof(max_align_t);
+
+  size_t padding = alignment > _Alignof(max_align_t) ? alignment - 1 : 0;
+  unsigned char *block = malloc(size + ALLOCATION_HEADER_SIZE + padding);
+  if (!block)
+    return NULL;
+
+  uintptr_t address = (uintptr_t)(block + ALLOCATION_HEADER_SIZE);
+  address = (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  unsigned char *ptr = (unsigned char *)address;
+
+  AllocationHeader *header = header_of(ptr);
+  header->size = size;
+  header->offset = (uint32_t)(ptr - block);
+  header->tag = (uint16_t)tag;
+  header->alignment_shift = 0;
+  while (((size_t)1 << header->alignment_shift) < alignment)
+    header->alignment_shift++;
+
+  track_host(tag, (int64_t)size);
+  count_allocation(tag, (int64_t)size);
+  return ptr;
+}
+
+void *kuta_malloc(KutaMemoryTag tag, size_t size) {
+  return kuta_aligned_alloc(tag, size, _Alignof(max_align_t));
+}
+
+void *kuta_calloc(KutaMemoryTag tag, size_t count, size_t size) {
+  if (size && count > SIZE_MAX / size)
+    return NULL;
+
+  void *ptr = kuta_malloc(tag, count * size);
+  if (ptr)
+    memset(ptr, 0, count * size);
+  return ptr;
+}
+
+static void *reallocate(KutaMemoryTag tag, void *ptr, size_t size,
+                        size_t alignment) {
+  if (!ptr)
+    return kuta_aligned_alloc(tag, size, alignment);
+
+  AllocationHeader *header = header_of(ptr);
+  KutaMemoryTag owner = header->tag;
+  size_t old_size = header->size;
+
+  // Over-aligned blocks can't go through realloc, it may move them off
+  // their alignment
+  if (((size_t)1 << header->alignment_shift) > _Alignof(max_align_t) ||
+      alignment > _Alignof(max_align_t)) {
+    void *moved = kuta_aligned_alloc(owner, size, alignment);
+    if (!moved)
+      return NULL;
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+    kuta_free(ptr);
+    return moved;
+  }
+
+  unsigned char *block =
+      realloc((unsigned char *)ptr - header->offset,
+              size + ALLOCATION_HEADER_SIZE);
+  if (!block)
+    return NULL;
+
+  ptr = block + ALLOCATION_HEADER_SIZE;
+  header_of(ptr)->size = size;
+  track_host(owner, (int64_t)size - (int64_t)old_size);
+  count_allocation(owner, (int64_t)size);
+  return ptr;
+}
+
+// tag only applies when ptr is NULL, otherwise the block keeps its own
+void *kuta_realloc(KutaMemoryTag tag, void *ptr, size_t size) {
+  return reallocate(tag, ptr, size, _Alignof(max_align_t));
+}
+
+void kuta_free(void *ptr) {
+  if (!ptr)
+    return;
+
+  AllocationHeader *header = header_of(ptr);
+  track_host(header->tag, -(int64_t)header->size);
+  free((unsigned char *)ptr - header->offset);
+}
+
+// The driver's host allocations, the tag rides along in pUserData
+static void *VKAPI_PTR vk_allocation(void *user_data, size_t size,
+                                     size_t alignment,
+                                     VkSystemAllocationScope scope) {
+  (void)scope;
+  return kuta_aligned_alloc((KutaMemoryTag)(uintptr_t)user_data, size,
+                            alignment);
+}
+
+static void *VKAPI_PTR vk_reallocation(void *user_data, void *original,
+                                       size_t size, size_t alignment,
+                                       VkSystemAllocationScope scope) {
+  (void)scope;
+  if (size == 0) {
+    kuta_free(original);
+    return NULL;
+  }
+  return reallocate((KutaMemoryTag)(uintptr_t)user_data, original, size,
+                    alignment);
+}
+
+static void VKAPI_PTR vk_free(void *user_data, void *memory) {
+  (void)user_data;
+  kuta_free(memory);
+}
+
+// Memory the driver allocated on its own, e.g. executable code
+static void VKAPI_PTR vk_internal_allocation(
+    void *user_data, size_t size, VkInternalAllocationType type,
+    VkSystemAllocationScope scope) {
+  (void)type;
+  (void)scope;
+  track_host((KutaMemoryTag)(uintptr_t)user_data, (int64_t)size);
+}
+
+static void VKAPI_PTR vk_internal_free(void *user_data, size_t size,
+                                       VkInternalAllocationType type,
+                                       VkSystemAllocationScope scope) {
+  (void)type;
+  (void)scope;
+  track_host((KutaMemoryTag)(uintptr_t)user_data, -(int64_t)size);
+}
+
+static VkAllocationCallbacks vk_allocators[KUTA_MEMORY_TAG_COUNT];
+
+// Allocation callbacks that account the driver's memory to tag. Objects can
+// be destroyed with the callbacks of any tag, frees find the tag themselves
+VkAllocationCallbacks *kuta_vk_allocator(KutaMemoryTag tag) {
+  if ((uint32_t)tag >= KUTA_MEMORY_TAG_COUNT)
+    tag = KUTA_MEMORY_CORE;
+
+  VkAllocationCallbacks *allocator = &vk_allocators[tag];
+  if (!allocator->pfnAllocation) {
+    *allocator = (VkAllocationCallbacks){
+        .pUserData = (void *)(uintptr_t)tag,
+        .pfnAllocation = vk_allocation,
+        .pfnReallocation = vk_reallocation,
+        .pfnFree = vk_free,
+        .pfnInternalAllocation = vk_internal_allocation,
+        .pfnInternalFree = vk_internal_free,
+    };
+  }
+  return allocator;
+}
+
+// Live VkDeviceMemory, so frees know the size and tag
+typedef struct {
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  KutaMemoryTag tag;
+} DeviceAllocation;
+
+static DeviceAllocation *device_allocations;
+static uint32_t device_allocation_count;
+static uint32_t device_allocation_capacity;
+static volatile uint32_t device_allocations_lock;
+
+static void device_allocations_acquire(void) {
+  while (!kuta_atomic_cas_u32(&device_allocations_lock, 0, 1)) {
+    kuta_thread_yield();
+  }
+}
+
+static void device_allocations_release(void) {
+  kuta_atomic_store_u32(&device_allocations_lock, 0);
+}
+
+// vkAllocateMemory that accounts the allocation to tag, release it with
+// free_device_memory
+VkResult allocate_device_memory(VkDevice device,
+                                const VkMemoryAllocateInfo *info,
+                                KutaMemoryTag tag, VkDeviceMemory *memory) {
+  if ((uint32_t)tag >= KUTA_MEMORY_TAG_COUNT)
+    tag = KUTA_MEMORY_CORE;
+
+  VkResult result =
+      vkAllocateMemory(device, info, kuta_vk_allocator(tag), memory);
+  if (result != VK_SUCCESS)
+    return result;
+
+  device_allocations_acquire();
+  if (device_allocation_count == device_allocation_capacity) {
+    uint32_t capacity =
+        device_allocation_capacity ? device_allocation_capacity * 2 : 64;
+    DeviceAllocation *allocations =
+        realloc(device_allocations, sizeof(DeviceAllocation) * capacity);
+    if (!allocations) {
+      device_allocations_release();
+      printf("Error: Failed to track device memory!\n");
+      return VK_SUCCESS;
+    }
+    device_allocations = allocations;
+    device_allocation_capacity = capacity;
+  }
+  device_allocations[device_allocation_count++] =
+      (DeviceAllocation){*memory, info->allocationSize, tag};
+  device_allocations_release();
+
+  int64_t size = (int64_t)info->allocationSize;
+  int64_t live =
+      kuta_atomic_add_i64(&counters[tag].device_live, size) + size;
+  raise_peak(&counters[tag].device_peak, live);
+  count_allocation(tag, size);
+  return VK_SUCCESS;
+}
+
+void free_device_memory(VkDevice device, VkDeviceMemory memory) {
+  if (memory == VK_NULL_HANDLE)
+    return;
+
+  KutaMemoryTag tag = KUTA_MEMORY_CORE;
+  int64_t size = 0;
+
+  device_allocations_acquire();
+  for (uint32_t i = 0; i < device_allocation_count; i++) {
+    if (device_allocations[i].memory != memory)
+      continue;
+
+    tag = device_allocations[i].tag;
+    size = (int64_t)device_allocations[i].size;
+    device_allocations[i] = device_allocations[--device_allocation_count];
+    break;
+  }
+  if (device_allocation_count == 0) {
+    free(device_allocations);
+    device_allocations = NULL;
+    device_allocation_capacity = 0;
+  }
+  device_allocations_release();
+
+  kuta_atomic_add_i64(&counters[tag].device_live, -size);
+  vkFreeMemory(device, memory, kuta_vk_allocator(tag));
+}
+
+// begin_frame and end_frame bracket the frame for the per-frame counts and
+// the guard
+void kuta_memory_frame_begin(void) {
+  for (uint32_t i = 0; i < KUTA_MEMORY_TAG_COUNT; i++) {
+    counters[i].frame_start = kuta_atomic_load_i64(&counters[i].allocations);
+  }
+  kuta_atomic_store_u32(&in_frame, 1);
+}
+
+void kuta_memory_frame_end(void) {
+  kuta_atomic_store_u32(&in_frame, 0);
+  for (uint32_t i = 0; i < KUTA_MEMORY_TAG_COUNT; i++) {
+    int64_t allocations = kuta_atomic_load_i64(&counters[i].allocations);
+    counters[i].last_frame = allocations - counters[i].frame_start;
+  }
+}
+
+// Aborts on any tracked allocation between begin_frame and end_frame while
+// enabled. Turn it on once the game reached its steady state, a swapchain
+// rebuild after a resize allocates as well
+void kuta_memory_set_frame_guard(bool enabled) {
+  kuta_atomic_store_u32(&frame_guard, enabled ? 1 : 0);
+}
+
+bool kuta_memory_stats(KutaMemoryTag tag, KutaMemoryStats *stats) {
+  if ((uint32_t)tag >= KUTA_MEMORY_TAG_COUNT)
+    return false;
+
+  MemoryCounters *tagged = &counters[tag];
+  *stats = (KutaMemoryStats){
+      .live_bytes = (uint64_t)kuta_atomic_load_i64(&tagged->live),
+      .peak_bytes = (uint64_t)kuta_atomic_load_i64(&tagged->peak),
+      .device_live_bytes = (uint64_t)kuta_atomic_load_i64(&tagged->device_live),
+      .device_peak_bytes = (uint64_t)kuta_atomic_load_i64(&tagged->device_peak),
+      .allocations = (uint64_t)kuta_atomic_load_i64(&tagged->allocations),
+      .frame_allocations = (uint64_t)tagged->last_frame,
+  };
+  return true;
+}
+
+const char *kuta_memory_tag_name(KutaMemoryTag tag) {
+  return tag < KUTA_MEMORY_TAG_COUNT ? tag_names[tag] : "unknown";
+}
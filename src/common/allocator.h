@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "types.h"
+
+// Tracked replacements for the C allocator. Every pointer they return must be
+// released with kuta_free, which looks up the size and tag itself
+void *kuta_malloc(KutaMemoryTag tag, size_t size);
+
+void *kuta_calloc(KutaMemoryTag tag, size_t count, size_t size);
+
+void *kuta_realloc(KutaMemoryTag tag, void *ptr, size_t size);
+
+void *kuta_aligned_alloc(KutaMemoryTag tag, size_t size, size_t alignment);
+
+void kuta_free(void *ptr);
+
+VkAllocationCallbacks *kuta_vk_allocator(KutaMemoryTag tag);
+
+VkResult allocate_device_memory(VkDevice device,
+                                const VkMemoryAllocateInfo *info,
+                                KutaMemoryTag tag, VkDeviceMemory *memory);
+
+void free_device_memory(VkDevice device, VkDeviceMemory memory);
+
+void kuta_memory_frame_begin(void);
+
+void kuta_memory_frame_end(void);
@@ -0,0 +1,199 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "arena.h"
+#include "internal_types.h"
+#include "threads.h"
+
+#define ARENA_ALIGNMENT 64
+
+bool arena_init(KutaArena *arena, uint32_t capacity) {
+  memset(arena, 0, sizeof(KutaArena));
+  capacity =
+      (capacity + ARENA_ALIGNMENT - 1) & ~(uint32_t)(ARENA_ALIGNMENT - 1);
+
+  arena->data = kuta_aligned_alloc(KUTA_MEMORY_CORE, capacity, ARENA_ALIGNMENT);
+  if (!arena->data) {
+    printf("Error: Failed to allocate arena!\n");
+    return false;
+  }
+
+  arena->capacity = capacity;
+  return true;
+}
+
+void arena_free(KutaArena *arena) {
+  kuta_free(arena->data);
+  memset(arena, 0, sizeof(KutaArena));
+}
+
+// Returns size bytes aligned to alignment (a power of two up to 64), or NULL
+// once the arena is full
+void *arena_alloc(KutaArena *arena, size_t size, size_t alignment) {
+  if (!arena->data || size + alignment > arena->capacity)
+    return NULL;
+
+  // Claimed with a compare and swap so failed allocations don't move `used`
+  uint32_t padded = (uint32_t)(size + alignment - 1);
+  uint32_t offset;
+  do {
+    offset = kuta_atomic_load_u32(&arena->used);
+    if (padded > arena->capacity - offset)
+      return NULL;
+  } while (!kuta_atomic_cas_u32(&arena->used, offset, offset + padded));
+
+  uintptr_t address = (uintptr_t)(arena->data + offset);
+  address = (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  return (void *)address;
+}
+
+// Frees every allocation, no other thread may be allocating
+void arena_reset(KutaArena *arena) {
+  uint32_t used = kuta_atomic_load_u32(&arena->used);
+  if (used > arena->peak)
+    arena->peak = used;
+  kuta_atomic_store_u32(&arena->used, 0);
+}
+
+bool arena_owns(const KutaArena *arena, const void *ptr) {
+  const unsigned char *byte = ptr;
+  return arena->data && byte >= arena->data &&
+         byte < arena->data + arena->capacity;
+}
+
+void pool_init(KutaPool *pool, size_t object_size, uint32_t objects_per_block) {
+  memset(pool, 0, sizeof(KutaPool));
+  // Released objects store the free list link in place
+  pool->object_size =
+      object_size < sizeof(void *) ? sizeof(void *) : object_size;
+  pool->object_size = (pool->object_size + _Alignof(max_align_t) - 1) &
+                      ~(size_t)(_Alignof(max_align_t) - 1);
+  pool->objects_per_block = objects_per_block;
+}
+
+void pool_free(KutaPool *pool) {
+  for (uint32_t i = 0; i < pool->block_count; i++) {
+    kuta_free(pool->blocks[i]);
+  }
+  kuta_free(pool->blocks);
+  memset(pool, 0, sizeof(KutaPool));
+}
+
+static void pool_lock(KutaPool *pool) {
+  while (!kuta_atomic_cas_u32(&pool->lock, 0, 1)) {
+    kuta_thread_yield();
+  }
+}
+
+static void pool_unlock(KutaPool *pool) {
+  kuta_atomic_store_u32(&pool->lock, 0);
+}
+
+// Threads every object of a new block onto the free list, called locked
+static bool pool_grow(KutaPool *pool) {
+  void **blocks =
+      kuta_realloc(KUTA_MEMORY_CORE, pool->blocks,
+                   sizeof(void *) * (pool->block_count + 1));
+  if (!blocks)
+    return false;
+  pool->blocks = blocks;
+
+  unsigned char *block = kuta_malloc(
+      KUTA_MEMORY_CORE, pool->object_size * pool->objects_per_block);
+  if (!block)
+    return false;
+  pool->blocks[pool->block_count++] = block;
+
+  for (uint32_t i = pool->objects_per_block; i-- > 0;) {
+    void **object = (void **)(block + pool->object_size * i);
+    *object = pool->free_list;
+    pool->free_list = object;
+  }
+  return true;
+}
+
+// Returns an uninitialised object, only allocates when every block is in use
+void *pool_alloc(KutaPool *pool) {
+  pool_lock(pool);
+
+  if (!pool->free_list && !pool_grow(pool)) {
+    pool_unlock(pool);
+    printf("Error: Failed to grow pool!\n");
+    return NULL;
+  }
+
+  void **object = pool->free_list;
+  pool->free_list = *object;
+
+  pool_unlock(pool);
+  return object;
+}
+
+void pool_release(KutaPool *pool, void *object) {
+  if (!object)
+    return;
+
+  pool_lock(pool);
+  *(void **)object = pool->free_list;
+  pool->free_list = object;
+  pool_unlock(pool);
+}
+
+static KutaArena frame_arenas[MAX_FRAMES_IN_FLIGHT];
+static KutaArena *frame_arena;
+
+bool frame_arenas_init(uint32_t capacity) {
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    if (!arena_init(&frame_arenas[i], capacity)) {
+      frame_arenas_free();
+      return false;
+    }
+  }
+
+  frame_arena = &frame_arenas[0];
+  return true;
+}
+
+void frame_arenas_free(void) {
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    arena_free(&frame_arenas[i]);
+  }
+  frame_arena = NULL;
+}
+
+// Switches to the arena of the frame about to be recorded and resets it
+void frame_arena_begin(uint32_t frame) {
+  if (!frame_arena)
+    return;
+
+  frame_arena = &frame_arenas[frame % MAX_FRAMES_IN_FLIGHT];
+  arena_reset(frame_arena);
+}
+
+// Allocates from the current frame's arena, the memory stays valid until the
+// frame's arena is reset MAX_FRAMES_IN_FLIGHT frames later. Returns NULL if
+// the arena is full or wasn't created
+void *frame_alloc(size_t size, size_t alignment) {
+  return frame_arena ? arena_alloc(frame_arena, size, alignment) : NULL;
+}
+
+// Scratch memory for the current function, from the frame arena when there
+// is room and the heap otherwise. alignment can't exceed max_align_t. Pass
+// the result to temp_free
+void *temp_alloc(size_t size, size_t alignment) {
+  void *ptr = frame_alloc(size, alignment);
+  return ptr ? ptr : kuta_malloc(KUTA_MEMORY_CORE, size);
+}
+
+void temp_free(void *ptr) {
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    if (arena_owns(&frame_arenas[i], ptr))
+      return;
+  }
+  kuta_free(ptr);
+}
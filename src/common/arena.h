@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator over one fixed block. Allocating is a single compare and
+// swap, so any thread can use it, and everything is released at once by
+// arena_reset
+typedef struct {
+  unsigned char *data;
+  uint32_t capacity;
+  volatile uint32_t used;
+  uint32_t peak; // most bytes used before a reset, for sizing
+} KutaArena;
+
+bool arena_init(KutaArena *arena, uint32_t capacity);
+
+void arena_free(KutaArena *arena);
+
+void *arena_alloc(KutaArena *arena, size_t size, size_t alignment);
+
+void arena_reset(KutaArena *arena);
+
+bool arena_owns(const KutaArena *arena, const void *ptr);
+
+// Fixed size objects carved out of blocks that are kept until pool_free,
+// released objects are reused first. Guarded by a spinlock since the objects
+// are short lived and the critical sections a few instructions long
+typedef struct {
+  void **blocks;
+  uint32_t block_count;
+  uint32_t objects_per_block;
+  size_t object_size;
+  void *free_list;
+  volatile uint32_t lock;
+} KutaPool;
+
+void pool_init(KutaPool *pool, size_t object_size, uint32_t objects_per_block);
+
+void pool_free(KutaPool *pool);
+
+void *pool_alloc(KutaPool *pool);
+
+void pool_release(KutaPool *pool, void *object);
+
+// One arena per frame in flight, the current one is reset by begin_frame
+bool frame_arenas_init(uint32_t capacity);
+
+void frame_arenas_free(void);
+
+void frame_arena_begin(uint32_t frame);
+
+void *frame_alloc(size_t size, size_t alignment);
+
+void *temp_alloc(size_t size, size_t alignment);
+
+void temp_free(void *ptr);
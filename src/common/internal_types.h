@@ -9,6 +9,9 @@
 #include <vulkan/vulkan_core.h>
 
 #define MAX_FRAMES_IN_FLIGHT 2
+// Size of the bindless texture table, texture ids from this on can't be
+// drawn in that mode
+#define MAX_BINDLESS_TEXTURES 4096
 
 typedef struct {
   vec3 pos;
@@ -26,6 +29,8 @@ typedef struct {
   uint32_t graphics_queue_family;
   uint32_t api_version;
   VkAllocationCallbacks *allocator;
+  // drawIndirectCount and drawIndirectFirstInstance were enabled
+  bool draw_indirect_count;
 } VkCore;
 
 typedef struct {
@@ -39,11 +44,6 @@ typedef struct {
 } SwapchainData;
 
 typedef struct {
-  // Per-frame uniform buffers
-  VkBuffer uniform_buffers[MAX_FRAMES_IN_FLIGHT];
-  VkDeviceMemory uniform_buffers_memory[MAX_FRAMES_IN_FLIGHT];
-  void *uniform_buffers_mapped[MAX_FRAMES_IN_FLIGHT];
-
   // Staging for uploads
   VkBuffer staging_buffer;
   VkDeviceMemory staging_buffer_memory;
@@ -68,16 +68,47 @@ typedef struct {
   bool fullscreen;
 } WindowData;
 
+// A level of detail's triangles in the geometry's index buffer, error is
+// how far in model space its surface strays from the full one
+typedef struct {
+  uint32_t first_index;
+  uint32_t index_count;
+  float error;
+} GeometryLod;
+
 typedef struct {
   Vertex *vertices;
-  uint32_t *indices;
+  uint32_t *indices; // every level of detail, the full one first
   size_t vertex_count;
   size_t index_count;
+  // Where its vertices and indices start in the GeometryBuffer, the levels
+  // of detail's first_index is relative to first_index
+  int32_t vertex_offset;
+  uint32_t first_index;
+  GeometryLod lods[KUTA_MAX_GEOMETRY_LODS];
+  uint32_t lod_count;
+  // Model space bounds of every vertex, the sphere is centred on the box
+  vec3 aabb_min;
+  vec3 aabb_max;
+  vec3 bounds_center;
+  float bounds_radius;
 } GeometryData;
 
+// Vertices and indices of every loaded geometry, drawn with the offsets in
+// its GeometryData. Bound once per command buffer, see bind_geometry_buffer
+typedef struct {
+  VkBuffer vertices;
+  VkDeviceMemory vertex_memory;
+  VkBuffer indices;
+  VkDeviceMemory index_memory;
+  uint32_t vertex_count, vertex_capacity;
+  uint32_t index_count, index_capacity;
+} GeometryBuffer;
+
 typedef struct {
-  int arr[MAX_ENTITIES];
+  uint32_t *arr;
   int top;
+  int capacity;
 } Stack;
 
 typedef struct {
@@ -103,12 +134,241 @@ typedef struct {
   mat4 proj;
 } CameraUBO;
 
+// One entry of the per-frame instance storage buffer, read by the vertex
+// shader at gl_InstanceIndex. Plain floats in this and the cull structs
+// below, AVX aligns a mat4 to 32 bytes which would pad them
+typedef struct {
+  float model[4][4];
+  uint32_t texture_id; // sampled from the texture table in bindless mode
+  uint32_t _pad[3];
+} InstanceData;
+
+#define CULL_GROUP_NONE UINT32_MAX
+// Bits of CullObject.state, the rest holds the level of detail
+#define CULL_STATE_LOD_MASK 0xFFu
+#define CULL_STATE_ON_SCREEN 0x100u
+
+// An entity of the GPU-driven path, resident at its ENTITY_INDEX and laid
+// out like CullObject in cull.comp
+typedef struct {
+  float model[4][4];
+  uint32_t group; // CULL_GROUP_NONE while it isn't drawn
+  Entity entity;
+  uint32_t state; // written by the cull pass, reset when it's uploaded
+  uint32_t _pad;
+} CullObject;
+
+// Entities drawn with the same geometry and texture, laid out like CullGroup
+// in cull.comp. Its levels of detail are the draws from first_draw on
+typedef struct {
+  float bounds[4]; // model space bounding sphere, radius in w
+  float aabb_min[3];
+  uint32_t first_draw;
+  float aabb_max[3];
+  uint32_t lod_count;
+  float lod_errors[KUTA_MAX_GEOMETRY_LODS];
+} CullGroup;
+
+// A level of detail of a group, laid out like CullDraw in cull.comp
+typedef struct {
+  uint32_t index_count;
+  uint32_t first_index;
+  int32_t vertex_offset;
+  uint32_t range;
+  uint32_t texture_id;
+} CullDraw;
+
+// Draws recorded with one multi-draw, laid out like CullRange in cull.comp
+typedef struct {
+  uint32_t first_draw;
+  uint32_t end_draw;
+} CullRange;
+
+// An entity whose on_screen flipped, reported back by the cull pass
+typedef struct {
+  Entity entity;
+  uint32_t on_screen;
+} CullVisibilityChange;
+
+typedef struct {
+  uint32_t count;
+  uint32_t _pad;
+  CullVisibilityChange changes[];
+} CullVisibilityList;
+
+// The cull shader's uniform buffer, laid out like CullUniforms in cull.comp
+typedef struct {
+  mat4 view_projection;
+  mat4 prev_view_projection; // the camera the depth pyramid was built with
+  vec4 planes[6];            // world space, inside where dot(xyz, p) + w >= 0
+  vec4 camera_position;      // w is the near plane
+  // w is how much of the screen height a length covers at unit depth, 0
+  // without a camera
+  vec4 camera_front;
+  vec2 pyramid_size;
+  uint32_t pyramid_levels;
+  uint32_t object_count;
+  uint32_t draw_count;
+  uint32_t range_count;
+  uint32_t instance_stride; // late phase instances start here
+  uint32_t occlusion;       // 0 while the pyramid holds nothing to test against
+  float min_screen_size;
+  float lod_error;
+} CullUniforms;
+
+typedef enum {
+  CULL_PHASE_EARLY, // tests against last frame's depth pyramid
+  CULL_PHASE_LATE,  // re-tests what the early phase occluded, against this
+                    // frame's pyramid
+} CullPhase;
+
+#define DEPTH_PYRAMID_MAX_LEVELS 16
+
+// Farthest depth of the scene at every mip, the first level is the largest
+// power of two that fits in the depth attachment. Lives in the general
+// layout, rebuilt from the early phase's depth every frame
+typedef struct {
+  VkImage image;
+  VkDeviceMemory memory;
+  VkImageView view; // every level, sampled by the cull shader
+  VkImageView level_views[DEPTH_PYRAMID_MAX_LEVELS];
+  VkDescriptorSet level_sets[DEPTH_PYRAMID_MAX_LEVELS];
+  uint32_t width, height;
+  uint32_t level_count;
+  VkSampler sampler;
+  VkImageAspectFlags depth_aspect; // of the depth attachment's barriers
+
+  VkPipeline copy_pipeline;
+  VkPipeline reduce_pipeline;
+  VkPipelineLayout pipeline_layout;
+  VkDescriptorSetLayout descriptor_set_layout;
+  VkDescriptorPool descriptor_pool;
+
+  // Camera the pyramid was last built with, valid once it was built
+  mat4 view_projection;
+  bool valid;
+} DepthPyramid;
+
+typedef struct {
+  VkBuffer buffer;
+  VkDeviceMemory memory;
+} CullBuffer;
+
+// A frame's buffers of the GPU-driven path, see gpu_culling.c. Draw counts,
+// prefixes, commands, counts and instances hold a run per phase
+typedef struct {
+  CullBuffer scratch;   // per object, the draw and slot it went to
+  CullBuffer instances; // read by the vertex shader like the CPU path's
+  CullBuffer visibility;
+  CullVisibilityList *visibility_mapped;
+  CullBuffer draw_counts; // instances per draw, cleared every frame
+  CullBuffer prefixes;
+  CullBuffer commands;
+  CullBuffer counts; // draws per range
+  CullBuffer uniforms;
+  CullUniforms *uniforms_mapped;
+  VkDescriptorSet descriptor_set;
+  uint32_t frame_number; // of the last upload, see CullSlot.upload_frame
+} CullFrame;
+
+typedef enum {
+  CULL_UPLOAD_NONE,
+  CULL_UPLOAD_MODEL, // only the matrix changed
+  CULL_UPLOAD_FULL,
+} CullUpload;
+
+// What an entity index's CullObject holds, as far as the CPU needs to know
+typedef struct {
+  Entity entity;
+  uint32_t group;
+  CullUpload upload; // queued for the next frame
+  // Frame number of its last full upload. Frames recorded before it culled
+  // an older version of the object, what they report about it is dropped
+  uint32_t upload_frame;
+} CullSlot;
+
+typedef struct {
+  uint32_t model_id;
+  uint32_t texture_id;
+} CullGroupKey;
+
+typedef struct {
+  VkPipeline pipeline;
+  VkPipelineLayout pipeline_layout;
+  VkDescriptorSetLayout descriptor_set_layout;
+  VkDescriptorPool descriptor_pool;
+  CullFrame frames[MAX_FRAMES_IN_FLIGHT];
+  DepthPyramid pyramid;
+
+  // Every entity index below object_count, kept on the device across frames
+  // and only uploaded where it changed
+  CullBuffer objects;
+  CullSlot *slots;
+  uint32_t object_count;
+  uint32_t object_capacity;
+  // Indices queued for upload and the copies staging them this frame
+  uint32_t *uploads;
+  VkBufferCopy *upload_regions;
+  uint32_t upload_count;
+  uint32_t upload_region_count;
+  uint32_t frame_number;
+  World *world; // the scene was last synced with
+
+  // Groups keep their index for good, the tables are rebuilt when one is
+  // added. Draws are ordered by range, ranges by texture
+  CullGroupKey *group_keys;
+  uint32_t group_count;
+  uint32_t group_capacity;
+  CullBuffer groups;
+  CullBuffer draws;
+  CullBuffer ranges;
+  CullRange *range_draws; // what's in ranges, for recording the multi-draws
+  uint32_t *range_textures;
+  uint32_t draw_count;
+  uint32_t range_count;
+  bool tables_dirty;
+  float min_screen_size;
+  float lod_error;
+} GpuCulling;
+
+// A job worker's command pool for one frame in flight. Its secondary command
+// buffers are handed out again once the pool was reset
+typedef struct {
+  VkCommandPool pool;
+  VkCommandBuffer *buffers;
+  uint32_t used;
+  uint32_t capacity;
+} WorkerCommandPool;
+
+// A frame's persistently mapped buffer, its uniform and instance data are
+// sub-allocated from it every frame, see uniform_ring_alloc
+typedef struct {
+  VkBuffer buffer;
+  VkDeviceMemory memory;
+  uint8_t *mapped;
+  VkDeviceSize capacity;
+  VkDeviceSize used;
+} UniformRing;
+
+// The scene set's dynamic uniform buffers, in binding order
+typedef enum {
+  SCENE_OFFSET_CAMERA,
+  SCENE_OFFSET_LIGHTING,
+  SCENE_OFFSET_COUNT,
+} SceneOffset;
+
 typedef struct {
   VkPipeline graphics_pipeline;
   VkPipelineLayout pipeline_layout;
   VkRenderPass render_pass;
+  // Same attachments loaded instead of cleared, draws the late cull phase
+  VkRenderPass render_pass_load;
   VkCommandPool command_pool;
   VkCommandBuffer *command_buffers;
+  // One per frame in flight and job worker, [frame * worker_count + worker].
+  // NULL without job workers
+  WorkerCommandPool *worker_pools;
+  uint32_t worker_count;
   VkSemaphore *acquired_image_semaphore;
   VkSemaphore *finished_render_semaphore;
   VkFence *in_flight_fence;
@@ -117,12 +377,35 @@ typedef struct {
   VkDescriptorSetLayout descriptor_set_layout;
   VkDescriptorSet *descriptor_sets;
   uint32_t descriptor_set_count;
+  // Bindless mode: set 1 of the scene pipeline, every loaded texture at the
+  // index of its id. Written as textures load, also while it's bound
+  VkDescriptorSetLayout texture_table_layout;
+  VkDescriptorPool texture_table_pool;
+  VkDescriptorSet texture_table;
   uint32_t current_frame;
   VkImage depth_image;
   VkDeviceMemory depth_image_memory;
   VkImageView depth_image_view;
-  VkBuffer lighting_buffers[MAX_FRAMES_IN_FLIGHT];
-  VkDeviceMemory lighting_memory[MAX_FRAMES_IN_FLIGHT];
+  // Camera, lighting and the InstanceData of every drawn entity. The
+  // instances are always a frame's first allocation, descriptor binding 3
+  // starts there. The GPU-driven path stages its cull uploads there instead
+  UniformRing uniform_rings[MAX_FRAMES_IN_FLIGHT];
+  VkDeviceSize uniform_alignment;
+  // Where the current frame's camera and lighting are in its ring, bound as
+  // the dynamic offsets of bindings 0 and 2
+  uint32_t scene_offsets[SCENE_OFFSET_COUNT];
+  // Frustum culling and draw commands come from a compute pass, see
+  // gpu_culling.c. Settings.gpu_driven asks for it, create_device clears it
+  // when the device can't
+  bool gpu_driven;
+  // Occlusion culling of the GPU-driven path, cleared when the device can't
+  // sample the depth attachment or the pyramid shaders are missing
+  bool occlusion_culling;
+  // Textures come from texture_table and the instances' texture_id instead of
+  // a set per texture. Settings.bindless_textures asks for it, create_device
+  // clears it when the device can't
+  bool bindless;
+  GpuCulling culling;
   VkSampleCountFlagBits msaa_samples;
 } Renderer;
 
@@ -165,10 +448,7 @@ typedef struct {
   GeometryData *geometries;
   TextureData *textures;
 
-  VkBuffer *vertex_buffers;
-  VkDeviceMemory *vertex_memory;
-  VkBuffer *index_buffers;
-  VkDeviceMemory *index_memory;
+  GeometryBuffer geometry_buffer;
   VkDeviceMemory *texture_memory;
 
   uint32_t geometry_count;
@@ -180,9 +460,62 @@ typedef struct {
   Stack free_texture_ids;
 } ResourceManager;
 
+// A visible entity's draw, see render_queue_build
+typedef struct {
+  uint32_t model_id;
+  uint32_t texture_id;
+  uint32_t pipeline;
+  uint32_t lod;
+  Entity entity;
+} DrawPacket;
+
+// Sorted packets sharing their state, recorded as one instanced draw
+typedef struct {
+  uint32_t first; // into order, also the draw's firstInstance
+  uint32_t count;
+} DrawBatch;
+
+// World space boxes and spheres of the render queue's candidates, as
+// structures of arrays padded to a multiple of four so frustum_cull can test
+// four entities at once
+typedef struct {
+  float *center_x, *center_y, *center_z;
+  float *extent_x, *extent_y, *extent_z;
+  float *radius;
+  uint8_t *visible;
+  void *block; // every array above lives in this allocation
+  uint32_t count;
+  uint32_t capacity;
+} CullBounds;
+
+// The frame's draws sorted by state, the arrays only ever grow
+typedef struct {
+  DrawPacket *packets;
+  uint64_t *keys;
+  uint32_t *order; // packet indices in key order
+  uint64_t *scratch_keys;
+  uint32_t *scratch_order;
+  DrawBatch *batches;
+  uint32_t count;
+  uint32_t batch_count;
+  uint32_t capacity;
+  CullBounds bounds;
+  float min_screen_size;
+  float lod_error;
+  // Level of detail each entity index was drawn with, kept across frames
+  uint8_t *lods;
+  uint32_t lod_capacity;
+  // Batch counts from this on are recorded by the job workers
+  uint32_t parallel_threshold;
+  // The secondary command buffers of a parallel recording, in batch order
+  VkCommandBuffer *slices;
+  uint32_t slice_capacity;
+} RenderQueue;
+
 typedef struct {
   State state;
   BufferData buffer_data;
   Settings settings;
   TextureData texture_data;
+  RenderQueue render_queue;
 } KutaContext;
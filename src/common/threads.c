@@ -0,0 +1,148 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "threads.h"
+
+#ifndef _WIN32
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+  KutaThreadFn fn;
+  void *arg;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_entry(LPVOID param) {
+#else
+static void *thread_entry(void *param) {
+#endif
+  ThreadStart start = *(ThreadStart *)param;
+  kuta_free(param);
+  start.fn(start.arg);
+#ifdef _WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+bool kuta_thread_create(KutaThread *thread, KutaThreadFn fn, void *arg) {
+  ThreadStart *start = kuta_malloc(KUTA_MEMORY_CORE, sizeof(ThreadStart));
+  if (!start) {
+    printf("Error: Failed to allocate thread!\n");
+    return false;
+  }
+  start->fn = fn;
+  start->arg = arg;
+
+#ifdef _WIN32
+  *thread = CreateThread(NULL, 0, thread_entry, start, 0, NULL);
+  bool created = *thread != NULL;
+#else
+  bool created = pthread_create(thread, NULL, thread_entry, start) == 0;
+#endif
+
+  if (!created) {
+    printf("Error: Failed to create thread!\n");
+    kuta_free(start);
+  }
+  return created;
+}
+
+void kuta_thread_join(KutaThread thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+void kuta_thread_yield(void) {
+#ifdef _WIN32
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+// Returns the number of logical cores, at least 1
+uint32_t kuta_cpu_count(void) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (uint32_t)count : 1;
+#endif
+}
+
+// Returns a monotonic timestamp in nanoseconds, only useful for differences
+uint64_t kuta_time_ns(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency(&frequency);
+
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ull +
+         (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ull /
+             (uint64_t)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+#ifdef _WIN32
+void kuta_mutex_init(KutaMutex *mutex) { InitializeCriticalSection(mutex); }
+
+void kuta_mutex_destroy(KutaMutex *mutex) { DeleteCriticalSection(mutex); }
+
+void kuta_mutex_lock(KutaMutex *mutex) { EnterCriticalSection(mutex); }
+
+void kuta_mutex_unlock(KutaMutex *mutex) { LeaveCriticalSection(mutex); }
+
+void kuta_cond_init(KutaCond *cond) { InitializeConditionVariable(cond); }
+
+void kuta_cond_destroy(KutaCond *cond) { (void)cond; }
+
+void kuta_cond_wait(KutaCond *cond, KutaMutex *mutex) {
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+void kuta_cond_signal(KutaCond *cond) { WakeConditionVariable(cond); }
+
+void kuta_cond_broadcast(KutaCond *cond) { WakeAllConditionVariable(cond); }
+#else
+void kuta_mutex_init(KutaMutex *mutex) { pthread_mutex_init(mutex, NULL); }
+
+void kuta_mutex_destroy(KutaMutex *mutex) { pthread_mutex_destroy(mutex); }
+
+void kuta_mutex_lock(KutaMutex *mutex) { pthread_mutex_lock(mutex); }
+
+void kuta_mutex_unlock(KutaMutex *mutex) { pthread_mutex_unlock(mutex); }
+
+void kuta_cond_init(KutaCond *cond) { pthread_cond_init(cond, NULL); }
+
+void kuta_cond_destroy(KutaCond *cond) { pthread_cond_destroy(cond); }
+
+void kuta_cond_wait(KutaCond *cond, KutaMutex *mutex) {
+  pthread_cond_wait(cond, mutex);
+}
+
+void kuta_cond_signal(KutaCond *cond) { pthread_cond_signal(cond); }
+
+void kuta_cond_broadcast(KutaCond *cond) { pthread_cond_broadcast(cond); }
+#endif
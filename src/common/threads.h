@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+
+typedef HANDLE KutaThread;
+typedef CRITICAL_SECTION KutaMutex;
+typedef CONDITION_VARIABLE KutaCond;
+#else
+#include <pthread.h>
+
+typedef pthread_t KutaThread;
+typedef pthread_mutex_t KutaMutex;
+typedef pthread_cond_t KutaCond;
+#endif
+
+#define KUTA_CACHE_LINE_SIZE 64
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define KUTA_THREAD_LOCAL __declspec(thread)
+#else
+#define KUTA_THREAD_LOCAL _Thread_local
+#endif
+
+typedef void (*KutaThreadFn)(void *arg);
+
+bool kuta_thread_create(KutaThread *thread, KutaThreadFn fn, void *arg);
+
+void kuta_thread_join(KutaThread thread);
+
+void kuta_thread_yield(void);
+
+uint32_t kuta_cpu_count(void);
+
+uint64_t kuta_time_ns(void);
+
+void kuta_mutex_init(KutaMutex *mutex);
+
+void kuta_mutex_destroy(KutaMutex *mutex);
+
+void kuta_mutex_lock(KutaMutex *mutex);
+
+void kuta_mutex_unlock(KutaMutex *mutex);
+
+void kuta_cond_init(KutaCond *cond);
+
+void kuta_cond_destroy(KutaCond *cond);
+
+void kuta_cond_wait(KutaCond *cond, KutaMutex *mutex);
+
+void kuta_cond_signal(KutaCond *cond);
+
+void kuta_cond_broadcast(KutaCond *cond);
+
+// Atomics, acquire on loads, release on stores and full barriers on
+// read-modify-write. Kept as compiler intrinsics since MSVC has no usable
+// <stdatomic.h> in C mode
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+
+static inline uint32_t kuta_atomic_load_u32(volatile uint32_t *ptr) {
+  uint32_t value = *ptr;
+  _ReadWriteBarrier();
+  return value;
+}
+
+static inline void kuta_atomic_store_u32(volatile uint32_t *ptr,
+                                         uint32_t value) {
+  _ReadWriteBarrier();
+  *ptr = value;
+}
+
+// Returns the value before the addition
+static inline uint32_t kuta_atomic_add_u32(volatile uint32_t *ptr,
+                                           uint32_t value) {
+  return (uint32_t)_InterlockedExchangeAdd((volatile long *)ptr, (long)value);
+}
+
+static inline bool kuta_atomic_cas_u32(volatile uint32_t *ptr,
+                                       uint32_t expected, uint32_t desired) {
+  return (uint32_t)_InterlockedCompareExchange(
+             (volatile long *)ptr, (long)desired, (long)expected) == expected;
+}
+
+static inline int64_t kuta_atomic_load_i64(volatile int64_t *ptr) {
+  int64_t value = *ptr;
+  _ReadWriteBarrier();
+  return value;
+}
+
+static inline void kuta_atomic_store_i64(volatile int64_t *ptr,
+                                         int64_t value) {
+  _ReadWriteBarrier();
+  *ptr = value;
+}
+
+static inline bool kuta_atomic_cas_i64(volatile int64_t *ptr,
+                                       int64_t expected, int64_t desired) {
+  return _InterlockedCompareExchange64(ptr, desired, expected) == expected;
+}
+
+// Returns the value before the addition
+static inline int64_t kuta_atomic_add_i64(volatile int64_t *ptr,
+                                          int64_t value) {
+  return _InterlockedExchangeAdd64(ptr, value);
+}
+
+static inline void kuta_atomic_fence(void) { MemoryBarrier(); }
+#else
+static inline uint32_t kuta_atomic_load_u32(volatile uint32_t *ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void kuta_atomic_store_u32(volatile uint32_t *ptr,
+                                         uint32_t value) {
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+// Returns the value before the addition
+static inline uint32_t kuta_atomic_add_u32(volatile uint32_t *ptr,
+                                           uint32_t value) {
+  return __atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+static inline bool kuta_atomic_cas_u32(volatile uint32_t *ptr,
+                                       uint32_t expected, uint32_t desired) {
+  return __atomic_compare_exchange_n(ptr, &expected, desired, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline int64_t kuta_atomic_load_i64(volatile int64_t *ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void kuta_atomic_store_i64(volatile int64_t *ptr,
+                                         int64_t value) {
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+static inline bool kuta_atomic_cas_i64(volatile int64_t *ptr,
+                                       int64_t expected, int64_t desired) {
+  return __atomic_compare_exchange_n(ptr, &expected, desired, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// Returns the value before the addition
+static inline int64_t kuta_atomic_add_i64(volatile int64_t *ptr,
+                                          int64_t value) {
+  return __atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+static inline void kuta_atomic_fence(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#endif
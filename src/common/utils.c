@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <vulkan/vulkan.h>
 
+#include "allocator.h"
+#include "arena.h"
 #include "internal_types.h"
 
 #include "utils.h"
@@ -19,16 +21,31 @@ uint32_t clamp(uint32_t value, uint32_t min, uint32_t max) {
 }
 
 // STACK FUNCTIONS
-void initialize(Stack *stack) { stack->top = -1; }
+#define STACK_INITIAL_CAPACITY 16
+
+void initialize(Stack *stack) {
+  stack->arr = NULL;
+  stack->top = -1;
+  stack->capacity = 0;
+}
 
 bool isEmpty(Stack *stack) { return stack->top == -1; }
 
-bool isFull(Stack *stack) { return stack->top == MAX_ENTITIES - 1; }
+bool isFull(Stack *stack) { return stack->top == stack->capacity - 1; }
 
+// Pushes the value, the storage doubles whenever it runs out
 void push(Stack *stack, uint32_t value) {
   if (isFull(stack)) {
-    printf("Stack Overflow\n");
-    return;
+    int new_capacity =
+        stack->capacity ? stack->capacity * 2 : STACK_INITIAL_CAPACITY;
+    uint32_t *arr = kuta_realloc(KUTA_MEMORY_CORE, stack->arr,
+                                 sizeof(uint32_t) * new_capacity);
+    if (!arr) {
+      printf("Stack Overflow\n");
+      return;
+    }
+    stack->arr = arr;
+    stack->capacity = new_capacity;
   }
   stack->arr[++stack->top] = value;
 }
@@ -120,7 +137,7 @@ const uint32_t *read_file(const char *filename, size_t *size) {
     return NULL;
   }
 
-  uint32_t *buffer = malloc(file_size);
+  uint32_t *buffer = temp_alloc(file_size, _Alignof(uint32_t));
   if (!buffer) {
     fprintf(stderr, "Failed to allocate memory for shader\n");
     fclose(file);
@@ -132,7 +149,7 @@ const uint32_t *read_file(const char *filename, size_t *size) {
 
   if (read_size != (size_t)file_size) {
     fprintf(stderr, "Failed to read entire file: %s\n", filename);
-    free(buffer);
+    temp_free(buffer);
     return NULL;
   }
 
@@ -0,0 +1,240 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "commands.h"
+#include "ecs.h"
+#include "kuta.h"
+#include "threads.h"
+#include "types.h"
+
+#define COMMAND_BUFFER_INITIAL_CAPACITY 4096
+// Component data is padded so the next record starts aligned
+#define COMMAND_ALIGNMENT 8
+// Deferred creates a frame can make before the entity arrays need to grow,
+// raised to twice the creates of the last frame when that is more
+#define COMMAND_ENTITY_HEADROOM 1024
+
+typedef enum {
+  COMMAND_CREATE,
+  COMMAND_DESTROY,
+  COMMAND_ADD,
+  COMMAND_REMOVE,
+} CommandOp;
+
+// Followed by `size` bytes of component data for COMMAND_ADD
+typedef struct {
+  uint32_t op;
+  Entity entity;
+  uint32_t type;
+  uint32_t size;
+} Command;
+
+static size_t command_padded_size(uint32_t size) {
+  return (size + COMMAND_ALIGNMENT - 1) & ~(size_t)(COMMAND_ALIGNMENT - 1);
+}
+
+// Allocates a buffer per job worker and the shared one, call again when the
+// number of workers changed
+bool command_buffers_init(World *world) {
+  uint32_t count = kuta_job_worker_count() + 1;
+  if (count <= world->command_buffer_count)
+    return true;
+
+  KutaCommandBuffer *buffers =
+      kuta_realloc(KUTA_MEMORY_ECS, world->command_buffers,
+                   sizeof(KutaCommandBuffer) * count);
+  if (!buffers) {
+    printf("Error: Failed to allocate command buffers!\n");
+    return false;
+  }
+
+  uint32_t old_count = world->command_buffer_count;
+  for (uint32_t i = old_count; i < count; i++) {
+    memset(&buffers[i], 0, sizeof(KutaCommandBuffer));
+  }
+
+  // The shared buffer moves to the new last slot
+  if (old_count > 0) {
+    KutaCommandBuffer shared = buffers[old_count - 1];
+    buffers[old_count - 1] = buffers[count - 1];
+    buffers[count - 1] = shared;
+  }
+
+  world->command_buffers = buffers;
+  world->command_buffer_count = count;
+  return true;
+}
+
+void command_buffers_free(World *world) {
+  for (uint32_t i = 0; i < world->command_buffer_count; i++) {
+    kuta_free(world->command_buffers[i].data);
+  }
+  kuta_free(world->command_buffers);
+  world->command_buffers = NULL;
+  world->command_buffer_count = 0;
+}
+
+// Workers record into their own buffer without locking, threads outside the
+// job system share the last one
+static KutaCommandBuffer *acquire_buffer(World *world) {
+  uint32_t worker = kuta_job_worker_index();
+  if (worker < world->command_buffer_count - 1)
+    return &world->command_buffers[worker];
+
+  while (!kuta_atomic_cas_u32(&world->shared_commands_lock, 0, 1)) {
+    kuta_thread_yield();
+  }
+  return &world->command_buffers[world->command_buffer_count - 1];
+}
+
+static void release_buffer(World *world, KutaCommandBuffer *buffer) {
+  if (buffer == &world->command_buffers[world->command_buffer_count - 1])
+    kuta_atomic_store_u32(&world->shared_commands_lock, 0);
+}
+
+static void record(World *world, CommandOp op, Entity entity, uint32_t type,
+                   const void *component, uint32_t size) {
+  if (world->command_buffer_count == 0)
+    return;
+
+  size_t needed = sizeof(Command) + command_padded_size(size);
+
+  KutaCommandBuffer *buffer = acquire_buffer(world);
+
+  if (buffer->size + needed > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2
+                                       : COMMAND_BUFFER_INITIAL_CAPACITY;
+    while (capacity < buffer->size + needed) {
+      capacity *= 2;
+    }
+
+    unsigned char *data = kuta_realloc(KUTA_MEMORY_ECS, buffer->data, capacity);
+    if (!data) {
+      printf("Error: Failed to grow command buffer!\n");
+      release_buffer(world, buffer);
+      return;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+
+  Command command = {op, entity, type, size};
+  memcpy(buffer->data + buffer->size, &command, sizeof(Command));
+  if (size)
+    memcpy(buffer->data + buffer->size + sizeof(Command), component, size);
+  buffer->size += needed;
+
+  release_buffer(world, buffer);
+}
+
+// Creates an entity at the next world_flush_commands. The handle can be used
+// with the other defer_* functions right away, on any worker, and with
+// everything else after the flush. Returns ENTITY_NULL when too many entities
+// were created this frame, see COMMAND_ENTITY_HEADROOM
+Entity defer_create_entity(World *world) {
+  Entity entity = world_reserve_entity(world);
+  if (entity == ENTITY_NULL) {
+    printf("Error: Too many deferred entities this frame!\n");
+    return ENTITY_NULL;
+  }
+
+  record(world, COMMAND_CREATE, entity, 0, NULL, 0);
+  return entity;
+}
+
+// Makes sure count entities can be created with defer_create_entity before
+// the next flush. Only needed ahead of a frame that creates far more than the
+// frames before it, call it from the main thread outside of systems
+void world_reserve_deferred_entities(World *world, uint32_t count) {
+  world_reserve_headroom(world, count);
+}
+
+void defer_destroy_entity(World *world, Entity entity) {
+  record(world, COMMAND_DESTROY, entity, 0, NULL, 0);
+}
+
+// Copies the component now and adds it at the next world_flush_commands
+void defer_add_component(World *world, Entity entity, ComponentType type,
+                         const void *component) {
+  if (type >= world->component_type_count)
+    return;
+
+  uint32_t size = (uint32_t)world->component_pools[type].component_size;
+  record(world, COMMAND_ADD, entity, type, component, size);
+}
+
+void defer_remove_component(World *world, Entity entity, ComponentType type) {
+  record(world, COMMAND_REMOVE, entity, type, NULL, 0);
+}
+
+// Reads the command at offset and returns the offset of the next one
+static size_t read_command(const KutaCommandBuffer *buffer, size_t offset,
+                           Command *command) {
+  memcpy(command, buffer->data + offset, sizeof(Command));
+  return offset + sizeof(Command) + command_padded_size(command->size);
+}
+
+// Commits the buffer's deferred creates and returns how many there were
+static uint32_t commit_creates(World *world, const KutaCommandBuffer *buffer) {
+  uint32_t created = 0;
+
+  for (size_t offset = 0; offset < buffer->size;) {
+    Command command;
+    offset = read_command(buffer, offset, &command);
+    if (command.op == COMMAND_CREATE) {
+      world_commit_entity(world, command.entity);
+      created++;
+    }
+  }
+  return created;
+}
+
+static void apply_commands(World *world, const KutaCommandBuffer *buffer) {
+  for (size_t offset = 0; offset < buffer->size;) {
+    Command command;
+    void *component = buffer->data + offset + sizeof(Command);
+    offset = read_command(buffer, offset, &command);
+
+    switch (command.op) {
+    case COMMAND_CREATE:
+      break;
+    case COMMAND_DESTROY:
+      destroy_entity(world, command.entity);
+      break;
+    case COMMAND_ADD:
+      add_component(world, command.entity, command.type, component);
+      break;
+    case COMMAND_REMOVE:
+      remove_component(world, command.entity, command.type);
+      break;
+    }
+  }
+}
+
+// Applies every recorded command, one worker's buffer after another and each
+// in the order it was recorded. Creates are committed first, since a handle
+// may be used by other workers than the one that created it. Must run on the
+// main thread while no system is running, end_frame calls it before updating
+// transforms
+void world_flush_commands(World *world) {
+  uint32_t created = 0;
+
+  for (uint32_t i = 0; i < world->command_buffer_count; i++) {
+    created += commit_creates(world, &world->command_buffers[i]);
+  }
+
+  for (uint32_t i = 0; i < world->command_buffer_count; i++) {
+    apply_commands(world, &world->command_buffers[i]);
+    world->command_buffers[i].size = 0;
+  }
+
+  world_reserve_headroom(world, created * 2 > COMMAND_ENTITY_HEADROOM
+                                    ? created * 2
+                                    : COMMAND_ENTITY_HEADROOM);
+  command_buffers_init(world);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+bool command_buffers_init(World *world);
+
+void command_buffers_free(World *world);
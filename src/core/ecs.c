@@ -0,0 +1,884 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "arena.h"
+#include "commands.h"
+#include "ecs.h"
+#include "hierarchy.h"
+#include "kuta.h"
+#include "scheduler.h"
+#include "threads.h"
+#include "types.h"
+
+// Chunks are sized to roughly this many bytes and aligned to a cache line
+#define COMPONENT_POOL_CHUNK_BYTES 16384
+#define COMPONENT_POOL_CHUNK_ALIGNMENT 64
+#define ENTITY_MIN_FREE_SLOTS 64
+#define INSTANTIATE_BATCH_SIZE 256
+
+static void *chunk_alloc(size_t size) {
+  return kuta_aligned_alloc(KUTA_MEMORY_ECS, size,
+                            COMPONENT_POOL_CHUNK_ALIGNMENT);
+}
+
+// Picks the chunk layout for the component size, nothing is allocated until
+// the first component gets inserted
+void component_pool_init(ComponentPool *pool, size_t component_size) {
+  memset(pool, 0, sizeof(ComponentPool));
+  pool->component_size = component_size;
+
+  size_t slot_size = component_size + sizeof(Entity);
+  pool->chunk_shift = 4;
+  while (((size_t)2 << pool->chunk_shift) * slot_size <=
+             COMPONENT_POOL_CHUNK_BYTES &&
+         pool->chunk_shift < ENTITY_INDEX_BITS) {
+    pool->chunk_shift++;
+  }
+
+  size_t components_size = component_size << pool->chunk_shift;
+  pool->entities_offset = (components_size + _Alignof(Entity) - 1) &
+                          ~(size_t)(_Alignof(Entity) - 1);
+
+  pool->sparse_pages = kuta_calloc(KUTA_MEMORY_ECS, COMPONENT_POOL_PAGE_COUNT,
+                                   sizeof(uint32_t *));
+  if (!pool->sparse_pages) {
+    printf("Error: Failed to allocate component pool!\n");
+  }
+}
+
+void component_pool_free(ComponentPool *pool) {
+  for (uint32_t i = 0; i < pool->chunk_count; i++) {
+    kuta_free(pool->chunks[i]);
+  }
+  kuta_free(pool->chunks);
+
+  if (pool->sparse_pages) {
+    for (uint32_t i = 0; i < COMPONENT_POOL_PAGE_COUNT; i++) {
+      kuta_free(pool->sparse_pages[i]);
+    }
+  }
+  kuta_free(pool->sparse_pages);
+  memset(pool, 0, sizeof(ComponentPool));
+}
+
+// Appends one chunk, only the chunk table is reallocated so live components
+// keep their address
+static bool component_pool_grow(ComponentPool *pool) {
+  void **chunks =
+      kuta_realloc(KUTA_MEMORY_ECS, pool->chunks,
+                   sizeof(void *) * (pool->chunk_count + 1));
+  if (!chunks)
+    return false;
+  pool->chunks = chunks;
+
+  size_t chunk_size = pool->entities_offset +
+                      sizeof(Entity) * component_pool_chunk_size(pool);
+  void *chunk = chunk_alloc(chunk_size);
+  if (!chunk)
+    return false;
+
+  pool->chunks[pool->chunk_count++] = chunk;
+  return true;
+}
+
+// Returns the sparse entry for the entity, allocating its page if needed
+static uint32_t *component_pool_sparse_entry(ComponentPool *pool,
+                                             Entity entity) {
+  uint32_t index = ENTITY_INDEX(entity);
+  uint32_t **page = &pool->sparse_pages[index >> COMPONENT_POOL_PAGE_SHIFT];
+
+  if (!*page) {
+    *page = kuta_malloc(KUTA_MEMORY_ECS,
+                        sizeof(uint32_t) * COMPONENT_POOL_PAGE_SIZE);
+    if (!*page)
+      return NULL;
+    for (uint32_t i = 0; i < COMPONENT_POOL_PAGE_SIZE; i++) {
+      (*page)[i] = COMPONENT_POOL_EMPTY;
+    }
+  }
+
+  return &(*page)[index & (COMPONENT_POOL_PAGE_SIZE - 1)];
+}
+
+static void component_pool_set_entity(ComponentPool *pool, uint32_t index,
+                                      Entity entity) {
+  char *chunk = pool->chunks[index >> pool->chunk_shift];
+  Entity *entities = (Entity *)(chunk + pool->entities_offset);
+  entities[index & (component_pool_chunk_size(pool) - 1)] = entity;
+}
+
+// Copies the component into the pool, overwriting the existing one if the
+// entity already owns it. Returned pointers stay valid until the component
+// is removed or another one is swapped into its slot
+void *component_pool_insert(ComponentPool *pool, Entity entity,
+                            const void *component) {
+  if (!pool->sparse_pages)
+    return NULL;
+
+  void *destination = component_pool_get(pool, entity);
+
+  if (!destination) {
+    uint32_t *sparse = component_pool_sparse_entry(pool, entity);
+    bool full = pool->count >= pool->chunk_count << pool->chunk_shift;
+    if (!sparse || (full && !component_pool_grow(pool))) {
+      printf("Error: Failed to grow component pool!\n");
+      return NULL;
+    }
+
+    uint32_t index = pool->count++;
+    *sparse = index;
+    component_pool_set_entity(pool, index, entity);
+    destination = component_pool_at(pool, index);
+  }
+
+  if (pool->component_size)
+    memcpy(destination, component, pool->component_size);
+  return destination;
+}
+
+// Removes the entity's component by moving the last one into its slot
+void component_pool_remove(ComponentPool *pool, Entity entity) {
+  uint32_t index = component_pool_slot(pool, entity);
+  if (index == COMPONENT_POOL_EMPTY)
+    return;
+
+  uint32_t last = pool->count - 1;
+  if (index != last) {
+    Entity moved = component_pool_entity(pool, last);
+    memcpy(component_pool_at(pool, index), component_pool_at(pool, last),
+           pool->component_size);
+    component_pool_set_entity(pool, index, moved);
+    *component_pool_sparse_entry(pool, moved) = index;
+  }
+
+  *component_pool_sparse_entry(pool, entity) = COMPONENT_POOL_EMPTY;
+  pool->count--;
+}
+
+// Appends count components and their owners to the end of the pool, copying
+// a chunk's worth at a time. None of the entities may own a component of the
+// pool yet, NULL components are zero filled. Returns false if it ran out of
+// memory, the entities appended so far stay in the pool
+bool component_pool_append(ComponentPool *pool, const void *components,
+                           const Entity *entities, uint32_t count) {
+  if (!pool->sparse_pages)
+    return false;
+
+  uint32_t chunk_size = component_pool_chunk_size(pool);
+
+  for (uint32_t first = 0; first < count;) {
+    uint32_t index = pool->count;
+    if (index >= pool->chunk_count << pool->chunk_shift &&
+        !component_pool_grow(pool)) {
+      printf("Error: Failed to grow component pool!\n");
+      return false;
+    }
+
+    uint32_t offset = index & (chunk_size - 1);
+    uint32_t copied = chunk_size - offset;
+    if (copied > count - first)
+      copied = count - first;
+
+    char *chunk = pool->chunks[index >> pool->chunk_shift];
+    if (components) {
+      memcpy(chunk + pool->component_size * offset,
+             (const char *)components + pool->component_size * first,
+             pool->component_size * copied);
+    } else {
+      memset(chunk + pool->component_size * offset, 0,
+             pool->component_size * copied);
+    }
+    memcpy((Entity *)(chunk + pool->entities_offset) + offset, entities + first,
+           sizeof(Entity) * copied);
+
+    for (uint32_t i = 0; i < copied; i++) {
+      uint32_t *sparse = component_pool_sparse_entry(pool, entities[first + i]);
+      if (!sparse) {
+        printf("Error: Failed to allocate component pool!\n");
+        return false;
+      }
+      *sparse = index + i;
+      pool->count++;
+    }
+    first += copied;
+  }
+
+  return true;
+}
+
+// Moves the components of the given entities into slots [0, count) in that
+// order. Every entity in order must own a component of the pool
+void component_pool_reorder(ComponentPool *pool, const Entity *order,
+                            uint32_t count) {
+  char *components = temp_alloc(pool->component_size * count + 1,
+                                _Alignof(max_align_t));
+  if (!components) {
+    printf("Error: Failed to reorder component pool!\n");
+    return;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy(components + pool->component_size * i,
+           component_pool_get(pool, order[i]), pool->component_size);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy(component_pool_at(pool, i), components + pool->component_size * i,
+           pool->component_size);
+    component_pool_set_entity(pool, i, order[i]);
+    *component_pool_sparse_entry(pool, order[i]) = i;
+  }
+
+  temp_free(components);
+}
+
+// Grows the per entity arrays so that indices below capacity are usable. New
+// slots start out pending, see world_reserve_entity
+static bool world_reserve(World *world, uint32_t capacity) {
+  if (capacity > KUTA_MAX_ENTITIES)
+    capacity = KUTA_MAX_ENTITIES;
+  if (capacity <= world->entity_capacity)
+    return true;
+
+  Entity *entities =
+      kuta_realloc(KUTA_MEMORY_ECS, world->entities, sizeof(Entity) * capacity);
+  if (!entities)
+    return false;
+  world->entities = entities;
+
+  ComponentSignature *signatures =
+      kuta_realloc(KUTA_MEMORY_ECS, world->signatures,
+                   sizeof(ComponentSignature) * capacity);
+  if (!signatures)
+    return false;
+  world->signatures = signatures;
+
+  uint16_t *generations =
+      kuta_realloc(KUTA_MEMORY_ECS, world->generations,
+                   sizeof(uint16_t) * capacity);
+  if (!generations)
+    return false;
+  world->generations = generations;
+
+  uint32_t *entity_slots =
+      kuta_realloc(KUTA_MEMORY_ECS, world->entity_slots,
+                   sizeof(uint32_t) * capacity);
+  if (!entity_slots)
+    return false;
+  world->entity_slots = entity_slots;
+
+  for (uint32_t i = world->entity_capacity; i < capacity; i++) {
+    world->entity_slots[i] = ENTITY_SLOT_PENDING;
+    world->generations[i] = 0;
+    world->signatures[i] = COMPONENT_SIGNATURE_EMPTY;
+  }
+
+  world->entity_capacity = capacity;
+  return true;
+}
+
+// Adds or removes the entity from every query depending on its new signature
+static void world_refresh_queries(World *world, Entity entity,
+                                  ComponentSignature signature, bool alive) {
+  for (uint32_t i = 0; i < world->query_count; i++) {
+    KutaQuery *query = world->queries[i];
+    bool listed =
+        component_pool_slot(&query->matches, entity) != COMPONENT_POOL_EMPTY;
+    bool matches = alive && query_matches(query, signature);
+
+    if (matches == listed)
+      continue;
+
+    if (matches) {
+      component_pool_insert(&query->matches, entity, NULL);
+    } else {
+      component_pool_remove(&query->matches, entity);
+    }
+    if (query == world->render_query && world->track_render_changes)
+      entity_list_push(&world->render_changes, entity);
+  }
+}
+
+// Inits the component pools and entitys
+void world_init(World *world) {
+  world_init_with_capacity(world, KUTA_DEFAULT_ENTITY_CAPACITY);
+}
+
+// Same as world_init but reserves room for entity_capacity entities up front,
+// the world still grows past it on demand up to KUTA_MAX_ENTITIES - 1
+void world_init_with_capacity(World *world, uint32_t entity_capacity) {
+  memset(world, 0, sizeof(World));
+
+  size_t component_sizes[COMPONENT_COUNT] = {
+      [COMPONENT_TRANSFORM] = sizeof(TransformComponent),
+      [COMPONENT_MESH_RENDERER] = sizeof(MeshRendererComponent),
+      [COMPONENT_CAMERA] = sizeof(CameraComponent),
+      [COMPONENT_VISIBILITY] = sizeof(VisibilityComponent),
+      [COMPONENT_LIGHT] = sizeof(LightComponent),
+      [COMPONENT_HIERARCHY] = sizeof(HierarchyComponent),
+  };
+
+  for (int i = 0; i < COMPONENT_COUNT; i++) {
+    component_pool_init(&world->component_pools[i], component_sizes[i]);
+  }
+  world->component_type_count = COMPONENT_COUNT;
+
+  // Index 0 is reserved for ENTITY_NULL
+  if (!world_reserve(world, entity_capacity + 1)) {
+    printf("Error: Failed to allocate world!\n");
+  }
+
+  world->entity_count = 0;
+  world->next_entity_id = 1;
+  world->reserved_entity_id = 1;
+
+  world->render_query = kuta_query_create(
+      world,
+      COMPONENT_SIGNATURE(COMPONENT_TRANSFORM, COMPONENT_MESH_RENDERER,
+                          COMPONENT_VISIBILITY),
+      COMPONENT_SIGNATURE_EMPTY);
+  world->light_query = kuta_query_create(
+      world, COMPONENT_SIGNATURE(COMPONENT_TRANSFORM, COMPONENT_LIGHT),
+      COMPONENT_SIGNATURE_EMPTY);
+  command_buffers_init(world);
+}
+
+// Cleanup componoents pools
+void world_cleanup(World *world) {
+  for (uint32_t i = 0; i < world->component_type_count; i++) {
+    component_pool_free(&world->component_pools[i]);
+  }
+  while (world->query_count > 0) {
+    kuta_query_destroy(world, world->queries[world->query_count - 1]);
+  }
+  kuta_free(world->queries);
+
+  kuta_free(world->dirty_transforms.items);
+  kuta_free(world->changed_transforms.items);
+  kuta_free(world->render_changes.items);
+  command_buffers_free(world);
+  scheduler_free(world);
+
+  kuta_free(world->entities);
+  kuta_free(world->signatures);
+  kuta_free(world->generations);
+  kuta_free(world->entity_slots);
+  memset(world, 0, sizeof(World));
+}
+
+// Registers a component type with its own pool and returns its id, which
+// works with every function taking a ComponentType. size must be a multiple
+// of alignment, as sizeof is, and alignment a power of two up to 64. Ids are
+// handed out in registration order, so register types in the same order on
+// every world that shares them. Returns COMPONENT_TYPE_INVALID on failure
+ComponentType register_component(World *world, size_t size, size_t alignment) {
+  if (world->component_type_count >= MAX_COMPONENT_TYPES) {
+    printf("Error: Too many component types!\n");
+    return COMPONENT_TYPE_INVALID;
+  }
+
+  if (size == 0 || alignment == 0 || (alignment & (alignment - 1)) ||
+      alignment > COMPONENT_POOL_CHUNK_ALIGNMENT || size % alignment) {
+    printf("Error: Invalid component size %zu or alignment %zu!\n", size,
+           alignment);
+    return COMPONENT_TYPE_INVALID;
+  }
+
+  // Chunks start on a cache line, so a stride that is a multiple of the
+  // alignment keeps every component aligned
+  ComponentType type = (ComponentType)world->component_type_count;
+  component_pool_init(&world->component_pools[type], size);
+  if (!world->component_pools[type].sparse_pages)
+    return COMPONENT_TYPE_INVALID;
+
+  world->component_type_count++;
+  return type;
+}
+
+// Takes a free slot and makes it a live entity without any components, query
+// membership is left to the caller. Freed slots are reused in FIFO order, and
+// only once enough of them piled up, so a slot's generation advances slowly
+// and stale handles stay invalid for as long as possible
+static Entity world_alloc_entity(World *world) {
+  uint32_t index;
+
+  if (world->free_count <= ENTITY_MIN_FREE_SLOTS)
+    world_reserve_headroom(world, 1);
+  uint32_t fresh = kuta_atomic_load_u32(&world->reserved_entity_id);
+
+  if (world->free_count > ENTITY_MIN_FREE_SLOTS ||
+      (world->free_count > 0 && fresh >= world->entity_capacity)) {
+    index = world->free_head;
+    world->free_head = world->entity_slots[index];
+    world->free_count--;
+  } else if (fresh < world->entity_capacity) {
+    // Fresh indices are shared with world_reserve_entity, skipped ones stay
+    // pending until their deferred create is flushed
+    index = kuta_atomic_add_u32(&world->reserved_entity_id, 1);
+    world->next_entity_id = index + 1;
+  } else {
+    return ENTITY_NULL;
+  }
+
+  Entity new_entity = ENTITY_MAKE(index, world->generations[index]);
+
+  world->entity_slots[index] = world->entity_count;
+  world->entities[world->entity_count] = new_entity;
+  world->entity_count++;
+
+  world->signatures[index] = COMPONENT_SIGNATURE_EMPTY;
+  return new_entity;
+}
+
+// Hands out a fresh index for an entity that is created later by
+// world_commit_entity. Safe to call from several threads while nothing else
+// changes the world. Returns ENTITY_NULL once the entity arrays are full,
+// they only grow on the main thread
+Entity world_reserve_entity(World *world) {
+  uint32_t index = kuta_atomic_add_u32(&world->reserved_entity_id, 1);
+  if (index >= world->entity_capacity)
+    return ENTITY_NULL;
+  return ENTITY_MAKE(index, 0);
+}
+
+// Makes an entity returned by world_reserve_entity live, without components
+void world_commit_entity(World *world, Entity entity) {
+  uint32_t index = ENTITY_INDEX(entity);
+  if (index >= world->entity_capacity ||
+      world->entity_slots[index] != ENTITY_SLOT_PENDING) {
+    return;
+  }
+
+  world->entity_slots[index] = world->entity_count;
+  world->entities[world->entity_count++] = entity;
+  world->signatures[index] = COMPONENT_SIGNATURE_EMPTY;
+  if (index >= world->next_entity_id)
+    world->next_entity_id = index + 1;
+
+  world_refresh_queries(world, entity, COMPONENT_SIGNATURE_EMPTY, true);
+}
+
+// Called between frames, drops failed reservations and makes sure at least
+// count more entities can be reserved
+void world_reserve_headroom(World *world, uint32_t count) {
+  if (world->reserved_entity_id > world->entity_capacity)
+    world->reserved_entity_id = world->entity_capacity;
+
+  uint64_t needed = (uint64_t)world->reserved_entity_id + count;
+  if (needed > world->entity_capacity) {
+    uint64_t doubled = (uint64_t)world->entity_capacity * 2;
+    uint64_t capacity = needed > doubled ? needed : doubled;
+    world_reserve(world, (uint32_t)(capacity < KUTA_MAX_ENTITIES
+                                        ? capacity
+                                        : KUTA_MAX_ENTITIES));
+  }
+}
+
+// Creates an entity and returns its handle
+Entity create_entity(World *world) {
+  Entity new_entity = world_alloc_entity(world);
+  if (new_entity != ENTITY_NULL)
+    world_refresh_queries(world, new_entity, COMPONENT_SIGNATURE_EMPTY, true);
+  return new_entity;
+}
+
+// Creates count entities that own the components in signature and writes
+// their handles to entities. components[type] points to count packed
+// components of that type, a NULL array or entry zero fills them. Hierarchy
+// components can't be spawned, use set_entity_parent. Returns the number of
+// entities created, which is either count or 0
+uint32_t spawn_entities(World *world, uint32_t count,
+                        ComponentSignature signature,
+                        const void *const *components, Entity *entities) {
+  if (component_signature_has(signature, COMPONENT_HIERARCHY)) {
+    printf("Error: Can't spawn entities with a HierarchyComponent!\n");
+    return 0;
+  }
+
+  // Grow once up front instead of doubling repeatedly inside the loop
+  world_reserve_headroom(world, count);
+
+  uint32_t created = 0;
+  for (; created < count; created++) {
+    entities[created] = world_alloc_entity(world);
+    if (entities[created] == ENTITY_NULL)
+      break;
+    world->signatures[ENTITY_INDEX(entities[created])] = signature;
+  }
+
+  bool spawned = created == count;
+  for (uint32_t type = 0; type < world->component_type_count && spawned;
+       type++) {
+    if (component_signature_has(signature, type)) {
+      spawned = component_pool_append(&world->component_pools[type],
+                                      components ? components[type] : NULL,
+                                      entities, count);
+    }
+  }
+
+  if (!spawned) {
+    printf("Error: Failed to spawn %u entities!\n", count);
+    for (uint32_t i = 0; i < created; i++) {
+      destroy_entity(world, entities[i]);
+    }
+    return 0;
+  }
+
+  const TransformComponent *transforms =
+      components ? components[COMPONENT_TRANSFORM] : NULL;
+  for (uint32_t i = 0; i < count; i++) {
+    if (transforms &&
+        component_signature_has(signature, COMPONENT_TRANSFORM) &&
+        transforms[i].dirty) {
+      entity_list_push(&world->dirty_transforms, entities[i]);
+    }
+    world_refresh_queries(world, entities[i], signature, true);
+  }
+
+  return count;
+}
+
+// Creates count copies of the prefab entity with all of its components and
+// writes their handles to entities. The copies are roots, the prefab's
+// parent and children aren't copied. Returns the number of entities created
+uint32_t instantiate_entity(World *world, Entity prefab, uint32_t count,
+                            Entity *entities) {
+  if (!entity_exists(world, prefab))
+    return 0;
+
+  ComponentSignature signature = world->signatures[ENTITY_INDEX(prefab)];
+  component_signature_remove(&signature, COMPONENT_HIERARCHY);
+  uint32_t batch = count < INSTANTIATE_BATCH_SIZE ? count
+                                                  : INSTANTIATE_BATCH_SIZE;
+
+  // Repeat the prefab's components batch times so every spawn call copies
+  // whole arrays
+  void *components[MAX_COMPONENT_TYPES] = {0};
+  bool allocated = true;
+  for (uint32_t type = 0; type < world->component_type_count; type++) {
+    if (!component_signature_has(signature, type))
+      continue;
+
+    size_t size = world->component_pools[type].component_size;
+    const void *source = get_component(world, prefab, type);
+    components[type] = temp_alloc(size * batch + 1, _Alignof(max_align_t));
+    if (!components[type]) {
+      allocated = false;
+      break;
+    }
+    for (uint32_t i = 0; i < batch; i++) {
+      memcpy((char *)components[type] + size * i, source, size);
+    }
+  }
+
+  // The prefab's world matrix may include a parent the copies don't have
+  if (components[COMPONENT_TRANSFORM]) {
+    TransformComponent *transforms = components[COMPONENT_TRANSFORM];
+    for (uint32_t i = 0; i < batch; i++) {
+      transforms[i].dirty = true;
+    }
+  }
+
+  uint32_t created = 0;
+  while (allocated && created < count) {
+    uint32_t spawned = count - created < batch ? count - created : batch;
+    if (!spawn_entities(world, spawned, signature,
+                        (const void *const *)components, entities + created)) {
+      break;
+    }
+    created += spawned;
+  }
+
+  if (!allocated)
+    printf("Error: Failed to allocate prefab components!\n");
+  for (uint32_t type = 0; type < world->component_type_count; type++) {
+    temp_free(components[type]);
+  }
+  return created;
+}
+
+// Destroys the entity and its components, its handle stops being valid
+void destroy_entity(World *world, Entity entity) {
+  if (!entity_exists(world, entity))
+    return;
+
+  uint32_t index = ENTITY_INDEX(entity);
+
+  world_refresh_queries(world, entity, COMPONENT_SIGNATURE_EMPTY, false);
+
+  ComponentSignature signature = world->signatures[index];
+  if (component_signature_has(signature, COMPONENT_HIERARCHY))
+    hierarchy_unlink(world, entity);
+
+  for (uint32_t type = 0; type < world->component_type_count; type++) {
+    if (component_signature_has(signature, type)) {
+      component_pool_remove(&world->component_pools[type], entity);
+    }
+  }
+  world->signatures[index] = COMPONENT_SIGNATURE_EMPTY;
+
+  // Keep the live list packed by moving the last entity into the hole
+  uint32_t slot = world->entity_slots[index];
+  Entity last = world->entities[world->entity_count - 1];
+  world->entities[slot] = last;
+  world->entity_slots[ENTITY_INDEX(last)] = slot;
+  world->entity_count--;
+
+  world->generations[index] =
+      (world->generations[index] + 1) & ENTITY_GENERATION_MASK;
+
+  if (world->free_count == 0) {
+    world->free_head = index;
+  } else {
+    world->entity_slots[world->free_tail] = index;
+  }
+  world->free_tail = index;
+  world->free_count++;
+}
+
+// Returns true if the entity exists
+bool entity_exists(World *world, Entity entity) {
+  uint32_t index = ENTITY_INDEX(entity);
+  if (index == 0 || index >= world->next_entity_id) {
+    return false;
+  }
+
+  uint32_t slot = world->entity_slots[index];
+  return slot < world->entity_count && world->entities[slot] == entity;
+}
+
+// Adds a desired component to an entity
+void add_component(World *world, Entity entity, ComponentType type,
+                   void *component) {
+  if (type >= world->component_type_count || !entity_exists(world, entity))
+    return;
+
+  void *stored =
+      component_pool_insert(&world->component_pools[type], entity, component);
+  if (!stored)
+    return;
+
+  if (type == COMPONENT_TRANSFORM && ((TransformComponent *)stored)->dirty)
+    entity_list_push(&world->dirty_transforms, entity);
+
+  ComponentSignature *signature = &world->signatures[ENTITY_INDEX(entity)];
+  if (component_signature_has(*signature, type)) {
+    if (type == COMPONENT_MESH_RENDERER || type == COMPONENT_VISIBILITY)
+      mark_render_dirty(world, entity);
+    return;
+  }
+
+  component_signature_add(signature, type);
+  world_refresh_queries(world, entity, *signature, true);
+}
+
+// Adds count packed components of one type to the given entities, like
+// calling add_component for each but new components are copied a chunk at a
+// time. Entities that already own the component get it overwritten, the
+// list must not contain the same entity twice
+void add_components(World *world, const Entity *entities, uint32_t count,
+                    ComponentType type, const void *components) {
+  if (type >= world->component_type_count)
+    return;
+
+  ComponentPool *pool = &world->component_pools[type];
+  const char *source = components;
+  uint32_t run = 0;
+
+  // Runs of entities that don't own the component yet are appended together
+  for (uint32_t i = 0; i <= count; i++) {
+    bool appendable =
+        i < count && entity_exists(world, entities[i]) &&
+        !component_signature_has(world->signatures[ENTITY_INDEX(entities[i])],
+                                 type);
+    if (appendable) {
+      run++;
+      continue;
+    }
+
+    if (run > 0) {
+      uint32_t first = i - run;
+      if (!component_pool_append(pool, source + pool->component_size * first,
+                                 entities + first, run)) {
+        return;
+      }
+
+      for (uint32_t j = first; j < i; j++) {
+        ComponentSignature *signature =
+            &world->signatures[ENTITY_INDEX(entities[j])];
+        component_signature_add(signature, type);
+        world_refresh_queries(world, entities[j], *signature, true);
+
+        if (type == COMPONENT_TRANSFORM &&
+            ((const TransformComponent *)components)[j].dirty) {
+          entity_list_push(&world->dirty_transforms, entities[j]);
+        }
+      }
+      run = 0;
+    }
+
+    if (i < count) {
+      add_component(world, entities[i], type,
+                    (void *)(source + pool->component_size * i));
+    }
+  }
+}
+
+// Removes a component from an entity if it has it
+void remove_component(World *world, Entity entity, ComponentType type) {
+  if (type >= world->component_type_count || !entity_exists(world, entity))
+    return;
+
+  uint32_t index = ENTITY_INDEX(entity);
+  if (!component_signature_has(world->signatures[index], type))
+    return;
+
+  if (type == COMPONENT_HIERARCHY)
+    hierarchy_unlink(world, entity);
+
+  component_pool_remove(&world->component_pools[type], entity);
+  component_signature_remove(&world->signatures[index], type);
+  world_refresh_queries(world, entity, world->signatures[index], true);
+}
+
+// Returns the entity's component of the given type or NULL if it has none
+void *get_component(World *world, Entity entity, ComponentType type) {
+  if (type >= world->component_type_count || !entity_exists(world, entity) ||
+      !component_signature_has(world->signatures[ENTITY_INDEX(entity)],
+                               type)) {
+    return NULL;
+  }
+
+  return component_pool_get(&world->component_pools[type], entity);
+}
+
+// Refills every query from scratch, used after entities were restored
+// without going through add_component
+void world_rebuild_queries(World *world) {
+  for (uint32_t i = 0; i < world->entity_count; i++) {
+    Entity entity = world->entities[i];
+    world_refresh_queries(world, entity,
+                          world->signatures[ENTITY_INDEX(entity)], true);
+  }
+}
+
+// Creates a query and fills it with the entities that already match, after
+// that it is kept up to date by add_component, remove_component and
+// destroy_entity. Queries are owned by the world and freed by world_cleanup
+KutaQuery *kuta_query_create(World *world, ComponentSignature required,
+                             ComponentSignature excluded) {
+  KutaQuery **queries =
+      kuta_realloc(KUTA_MEMORY_ECS, world->queries,
+                   sizeof(KutaQuery *) * (world->query_count + 1));
+  if (!queries) {
+    printf("Error: Failed to allocate query!\n");
+    return NULL;
+  }
+  world->queries = queries;
+
+  KutaQuery *query = kuta_malloc(KUTA_MEMORY_ECS, sizeof(KutaQuery));
+  if (!query) {
+    printf("Error: Failed to allocate query!\n");
+    return NULL;
+  }
+
+  query->required = required;
+  query->excluded = excluded;
+  component_pool_init(&query->matches, 0);
+  if (!query->matches.sparse_pages) {
+    kuta_free(query);
+    return NULL;
+  }
+
+  for (uint32_t i = 0; i < world->entity_count; i++) {
+    Entity entity = world->entities[i];
+    if (query_matches(query, world->signatures[ENTITY_INDEX(entity)])) {
+      component_pool_insert(&query->matches, entity, NULL);
+    }
+  }
+
+  world->queries[world->query_count++] = query;
+  return query;
+}
+
+void kuta_query_destroy(World *world, KutaQuery *query) {
+  if (!query)
+    return;
+
+  for (uint32_t i = 0; i < world->query_count; i++) {
+    if (world->queries[i] == query) {
+      world->queries[i] = world->queries[--world->query_count];
+      break;
+    }
+  }
+
+  if (world->render_query == query)
+    world->render_query = NULL;
+  if (world->light_query == query)
+    world->light_query = NULL;
+
+  component_pool_free(&query->matches);
+  kuta_free(query);
+}
+
+// Returns the number of entities currently matching the query
+uint32_t kuta_query_count(const KutaQuery *query) {
+  return query ? query->matches.count : 0;
+}
+
+// Returns the matching entity at index, the order changes as entities stop
+// matching so don't hold on to indices across component changes
+Entity kuta_query_entity(const KutaQuery *query, uint32_t index) {
+  if (!query || index >= query->matches.count)
+    return ENTITY_NULL;
+  return component_pool_entity(&query->matches, index);
+}
+
+void entity_list_push(EntityList *list, Entity entity) {
+  if (list->count == list->capacity) {
+    uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+    Entity *items =
+        kuta_realloc(KUTA_MEMORY_ECS, list->items, sizeof(Entity) * capacity);
+    if (!items) {
+      printf("Error: Failed to grow entity list!\n");
+      return;
+    }
+    list->items = items;
+    list->capacity = capacity;
+  }
+
+  list->items[list->count++] = entity;
+}
+
+// Flags the transform so the next transform_system_update rebuilds it. Use
+// this after changing a TransformComponent by hand, the setters call it
+void mark_transform_dirty(World *world, Entity entity) {
+  TransformComponent *transform =
+      get_component(world, entity, COMPONENT_TRANSFORM);
+  if (!transform || transform->dirty)
+    return;
+
+  transform->dirty = true;
+  entity_list_push(&world->dirty_transforms, entity);
+}
+
+// Tells the GPU-driven renderer to pick up the entity's mesh renderer and
+// visibility again. Use this after changing either by hand, add_component
+// calls it
+void mark_render_dirty(World *world, Entity entity) {
+  if (world->track_render_changes && entity_exists(world, entity))
+    entity_list_push(&world->render_changes, entity);
+}
+
+// Returns the entities whose world_matrix was rebuilt by the last
+// transform_system_update, valid until the next one. Entities may have been
+// destroyed since
+const Entity *get_changed_transforms(World *world, uint32_t *count) {
+  *count = world->changed_transforms.count;
+  return world->changed_transforms.items;
+}
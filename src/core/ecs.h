@@ -0,0 +1,90 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Matching entities are stored as a component pool with empty components,
+// which gives packed iteration and O(1) insert and remove for free
+struct KutaQuery {
+  ComponentSignature required;
+  ComponentSignature excluded;
+  ComponentPool matches;
+};
+
+void component_pool_init(ComponentPool *pool, size_t component_size);
+
+void component_pool_free(ComponentPool *pool);
+
+void *component_pool_insert(ComponentPool *pool, Entity entity,
+                            const void *component);
+
+void component_pool_remove(ComponentPool *pool, Entity entity);
+
+bool component_pool_append(ComponentPool *pool, const void *components,
+                           const Entity *entities, uint32_t count);
+
+void world_rebuild_queries(World *world);
+
+Entity world_reserve_entity(World *world);
+
+void world_commit_entity(World *world, Entity entity);
+
+void world_reserve_headroom(World *world, uint32_t count);
+
+void component_pool_reorder(ComponentPool *pool, const Entity *order,
+                            uint32_t count);
+
+void entity_list_push(EntityList *list, Entity entity);
+
+// Returns the number of packed slots stored in one chunk
+static inline uint32_t component_pool_chunk_size(const ComponentPool *pool) {
+  return 1u << pool->chunk_shift;
+}
+
+// Returns the component stored in the given packed slot
+static inline void *component_pool_at(ComponentPool *pool, uint32_t index) {
+  char *chunk = pool->chunks[index >> pool->chunk_shift];
+  uint32_t offset = index & (component_pool_chunk_size(pool) - 1);
+  return chunk + (size_t)offset * pool->component_size;
+}
+
+// Returns the entity owning the given packed slot
+static inline Entity component_pool_entity(const ComponentPool *pool,
+                                           uint32_t index) {
+  char *chunk = pool->chunks[index >> pool->chunk_shift];
+  Entity *entities = (Entity *)(chunk + pool->entities_offset);
+  return entities[index & (component_pool_chunk_size(pool) - 1)];
+}
+
+// Returns the packed slot of the entity or COMPONENT_POOL_EMPTY
+static inline uint32_t component_pool_slot(const ComponentPool *pool,
+                                           Entity entity) {
+  uint32_t index = ENTITY_INDEX(entity);
+  uint32_t *page = pool->sparse_pages[index >> COMPONENT_POOL_PAGE_SHIFT];
+  if (!page)
+    return COMPONENT_POOL_EMPTY;
+  return page[index & (COMPONENT_POOL_PAGE_SIZE - 1)];
+}
+
+// Returns the component owned by entity or NULL if it has none
+static inline void *component_pool_get(ComponentPool *pool, Entity entity) {
+  uint32_t index = component_pool_slot(pool, entity);
+  if (index == COMPONENT_POOL_EMPTY)
+    return NULL;
+  return component_pool_at(pool, index);
+}
+
+// Returns true if an entity with the given signature belongs to the query
+static inline bool query_matches(const KutaQuery *query,
+                                 ComponentSignature signature) {
+  for (uint32_t i = 0; i < COMPONENT_SIGNATURE_WORDS; i++) {
+    if ((signature.bits[i] & query->required.bits[i]) !=
+            query->required.bits[i] ||
+        (signature.bits[i] & query->excluded.bits[i])) {
+      return false;
+    }
+  }
+  return true;
+}
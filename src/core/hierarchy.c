@@ -0,0 +1,256 @@
+#include <cglm/cglm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "ecs.h"
+#include "hierarchy.h"
+#include "kuta.h"
+#include "threads.h"
+#include "types.h"
+
+static HierarchyComponent *get_hierarchy(World *world, Entity entity) {
+  return component_pool_get(&world->component_pools[COMPONENT_HIERARCHY],
+                            entity);
+}
+
+static void mark_dirty(World *world, HierarchyComponent *hierarchy) {
+  hierarchy->dirty = true;
+  kuta_atomic_store_u32(&world->hierarchy_dirty, 1);
+}
+
+// Takes the entity out of its parent's child list
+static void unlink_from_parent(World *world, Entity entity,
+                               HierarchyComponent *hierarchy) {
+  if (hierarchy->parent == ENTITY_NULL)
+    return;
+
+  if (hierarchy->prev_sibling != ENTITY_NULL) {
+    get_hierarchy(world, hierarchy->prev_sibling)->next_sibling =
+        hierarchy->next_sibling;
+  } else {
+    get_hierarchy(world, hierarchy->parent)->first_child =
+        hierarchy->next_sibling;
+  }
+
+  if (hierarchy->next_sibling != ENTITY_NULL) {
+    get_hierarchy(world, hierarchy->next_sibling)->prev_sibling =
+        hierarchy->prev_sibling;
+  }
+
+  hierarchy->parent = ENTITY_NULL;
+  hierarchy->prev_sibling = ENTITY_NULL;
+  hierarchy->next_sibling = ENTITY_NULL;
+}
+
+// Parents child to parent, ENTITY_NULL makes child a root again. Both need a
+// TransformComponent, the child's matrix becomes relative to the parent
+bool set_entity_parent(World *world, Entity child, Entity parent) {
+  if (!get_component(world, child, COMPONENT_TRANSFORM) ||
+      (parent != ENTITY_NULL &&
+       !get_component(world, parent, COMPONENT_TRANSFORM))) {
+    printf("Error: Parent and child need a TransformComponent!\n");
+    return false;
+  }
+
+  for (Entity ancestor = parent; ancestor != ENTITY_NULL;
+       ancestor = get_entity_parent(world, ancestor)) {
+    if (ancestor == child) {
+      printf("Error: Can't parent an entity to its own descendant!\n");
+      return false;
+    }
+  }
+
+  HierarchyComponent empty = {.subtree_size = 1};
+  HierarchyComponent *hierarchy = get_hierarchy(world, child);
+  if (!hierarchy) {
+    add_component(world, child, COMPONENT_HIERARCHY, &empty);
+    hierarchy = get_hierarchy(world, child);
+  }
+
+  HierarchyComponent *parent_hierarchy = NULL;
+  if (parent != ENTITY_NULL) {
+    parent_hierarchy = get_hierarchy(world, parent);
+    if (!parent_hierarchy) {
+      add_component(world, parent, COMPONENT_HIERARCHY, &empty);
+      parent_hierarchy = get_hierarchy(world, parent);
+    }
+  }
+
+  if (!hierarchy || (parent != ENTITY_NULL && !parent_hierarchy))
+    return false;
+
+  unlink_from_parent(world, child, hierarchy);
+
+  if (parent_hierarchy) {
+    hierarchy->parent = parent;
+    hierarchy->next_sibling = parent_hierarchy->first_child;
+    if (parent_hierarchy->first_child != ENTITY_NULL) {
+      get_hierarchy(world, parent_hierarchy->first_child)->prev_sibling =
+          child;
+    }
+    parent_hierarchy->first_child = child;
+  }
+
+  world->hierarchy_order_dirty = true;
+  mark_dirty(world, hierarchy);
+  return true;
+}
+
+// Returns the parent of the entity or ENTITY_NULL for roots
+Entity get_entity_parent(World *world, Entity entity) {
+  HierarchyComponent *hierarchy =
+      get_component(world, entity, COMPONENT_HIERARCHY);
+  return hierarchy ? hierarchy->parent : ENTITY_NULL;
+}
+
+// Called before the entity loses its HierarchyComponent, its children become
+// roots and keep their local matrix
+void hierarchy_unlink(World *world, Entity entity) {
+  HierarchyComponent *hierarchy = get_hierarchy(world, entity);
+  if (!hierarchy)
+    return;
+
+  unlink_from_parent(world, entity, hierarchy);
+
+  TransformComponent *transform =
+      get_component(world, entity, COMPONENT_TRANSFORM);
+  if (transform)
+    glm_mat4_copy(transform->matrix, transform->world_matrix);
+
+  Entity child = hierarchy->first_child;
+  while (child != ENTITY_NULL) {
+    HierarchyComponent *child_hierarchy = get_hierarchy(world, child);
+    Entity next = child_hierarchy->next_sibling;
+
+    child_hierarchy->parent = ENTITY_NULL;
+    child_hierarchy->prev_sibling = ENTITY_NULL;
+    child_hierarchy->next_sibling = ENTITY_NULL;
+    mark_dirty(world, child_hierarchy);
+
+    child = next;
+  }
+  hierarchy->first_child = ENTITY_NULL;
+
+  world->hierarchy_order_dirty = true;
+  kuta_atomic_store_u32(&world->hierarchy_dirty, 1);
+}
+
+// Lays the hierarchy pool out in preorder, so every parent comes before its
+// children and each subtree occupies [slot, slot + subtree_size). Only runs
+// after the hierarchy changed shape
+static void rebuild_order(World *world) {
+  ComponentPool *pool = &world->component_pools[COMPONENT_HIERARCHY];
+  uint32_t count = pool->count;
+  if (count == 0)
+    return;
+
+  Entity *order = temp_alloc(sizeof(Entity) * count, _Alignof(Entity));
+  if (!order) {
+    printf("Error: Failed to allocate hierarchy order!\n");
+    return;
+  }
+
+  uint32_t written = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    Entity root = component_pool_entity(pool, i);
+    if (get_hierarchy(world, root)->parent != ENTITY_NULL)
+      continue;
+
+    Entity node = root;
+    uint32_t depth = 0;
+    for (;;) {
+      HierarchyComponent *hierarchy = get_hierarchy(world, node);
+      hierarchy->depth = depth;
+      hierarchy->subtree_size = 1;
+      order[written++] = node;
+
+      if (hierarchy->first_child != ENTITY_NULL) {
+        node = hierarchy->first_child;
+        depth++;
+        continue;
+      }
+
+      while (node != root &&
+             get_hierarchy(world, node)->next_sibling == ENTITY_NULL) {
+        node = get_hierarchy(world, node)->parent;
+        depth--;
+      }
+      if (node == root)
+        break;
+      node = get_hierarchy(world, node)->next_sibling;
+    }
+  }
+
+  // Children come after their parent, so walking backwards sums up subtrees
+  for (uint32_t i = written; i-- > 0;) {
+    HierarchyComponent *hierarchy = get_hierarchy(world, order[i]);
+    hierarchy->dirty = true;
+    if (hierarchy->parent != ENTITY_NULL) {
+      get_hierarchy(world, hierarchy->parent)->subtree_size +=
+          hierarchy->subtree_size;
+    }
+  }
+
+  component_pool_reorder(pool, order, written);
+  temp_free(order);
+  world->hierarchy_order_dirty = false;
+}
+
+// Propagates world matrices down the subtrees of dirty entities and adds
+// every entity it touched to changed_transforms. Clean subtrees are skipped
+// as a whole and the pass returns right away when no entity in a hierarchy
+// changed since the last frame
+void hierarchy_system_update(World *world) {
+  if (!kuta_atomic_load_u32(&world->hierarchy_dirty))
+    return;
+  kuta_atomic_store_u32(&world->hierarchy_dirty, 0);
+
+  if (world->hierarchy_order_dirty)
+    rebuild_order(world);
+
+  ComponentPool *pool = &world->component_pools[COMPONENT_HIERARCHY];
+  ComponentPool *transforms = &world->component_pools[COMPONENT_TRANSFORM];
+
+  for (uint32_t i = 0; i < pool->count;) {
+    HierarchyComponent *hierarchy = component_pool_at(pool, i);
+    if (!hierarchy->dirty) {
+      i++;
+      continue;
+    }
+
+    uint32_t end = i + hierarchy->subtree_size;
+    for (; i < end; i++) {
+      HierarchyComponent *node = component_pool_at(pool, i);
+      Entity entity = component_pool_entity(pool, i);
+      TransformComponent *transform = component_pool_get(transforms, entity);
+      node->dirty = false;
+      if (!transform)
+        continue;
+
+      entity_list_push(&world->changed_transforms, entity);
+
+      TransformComponent *parent =
+          node->parent != ENTITY_NULL
+              ? component_pool_get(transforms, node->parent)
+              : NULL;
+      if (!parent) {
+        glm_mat4_copy(transform->matrix, transform->world_matrix);
+        continue;
+      }
+
+      glm_mat4_mul(parent->world_matrix, transform->matrix,
+                   transform->world_matrix);
+    }
+  }
+}
+
+// Flags the hierarchy of an entity whose local matrix was just rebuilt, safe
+// to call from several workers for different entities
+void hierarchy_mark_dirty(World *world, Entity entity) {
+  HierarchyComponent *hierarchy = get_hierarchy(world, entity);
+  if (hierarchy)
+    mark_dirty(world, hierarchy);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "types.h"
+
+void hierarchy_unlink(World *world, Entity entity);
+
+void hierarchy_mark_dirty(World *world, Entity entity);
+
+void hierarchy_system_update(World *world);
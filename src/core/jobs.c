@@ -0,0 +1,465 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "arena.h"
+#include "jobs.h"
+#include "kuta.h"
+#include "threads.h"
+#include "types.h"
+
+// Must be a power of two, pushing to a full deque runs the job inline
+#define JOB_DEQUE_CAPACITY 4096
+#define JOB_DEQUE_MASK (JOB_DEQUE_CAPACITY - 1)
+// Failed attempts to find work before an idle worker goes to sleep
+#define JOB_IDLE_SPINS 64
+// Nodes for injected and waiting jobs are allocated this many at a time
+#define JOB_NODES_PER_BLOCK 256
+
+typedef struct {
+  KutaJobFn fn;
+  void *data;
+  KutaJobCounter *counter;
+} Job;
+
+// Jobs waiting on a counter, or submitted from a thread that isn't a worker
+struct KutaJobNode {
+  Job job;
+  KutaJobNode *next;
+};
+
+// Chase-Lev deque: the owner pushes and pops at the bottom, other workers
+// steal from the top. top and bottom live on their own cache lines
+typedef struct {
+  volatile int64_t top;
+  char _pad1[KUTA_CACHE_LINE_SIZE - sizeof(int64_t)];
+  volatile int64_t bottom;
+  char _pad2[KUTA_CACHE_LINE_SIZE - sizeof(int64_t)];
+  Job slots[JOB_DEQUE_CAPACITY];
+} JobDeque;
+
+typedef struct {
+  JobDeque *deques;
+  uint32_t worker_count;
+  KutaThread *threads;
+  uint32_t thread_count;
+
+  // Jobs submitted from threads outside the pool
+  KutaMutex injected_mutex;
+  KutaJobNode *injected_head;
+  KutaJobNode *injected_tail;
+  volatile uint32_t injected_count;
+
+  volatile uint32_t queued;
+  volatile uint32_t sleeping;
+  KutaMutex sleep_mutex;
+  KutaCond wake;
+  bool quit;
+
+  // Every KutaJobNode, so submitting doesn't hit malloc once warmed up
+  KutaPool nodes;
+} JobSystem;
+
+static JobSystem *job_system = NULL;
+// Worker 0 is the thread that called kuta_init, threads outside the pool
+// have no deque
+static KUTA_THREAD_LOCAL uint32_t worker_index = KUTA_JOB_NO_WORKER;
+
+static bool deque_push(JobDeque *deque, Job job) {
+  int64_t bottom = deque->bottom;
+  int64_t top = kuta_atomic_load_i64(&deque->top);
+  if (bottom - top >= JOB_DEQUE_CAPACITY)
+    return false;
+
+  deque->slots[bottom & JOB_DEQUE_MASK] = job;
+  kuta_atomic_store_i64(&deque->bottom, bottom + 1);
+  return true;
+}
+
+static bool deque_pop(JobDeque *deque, Job *job) {
+  int64_t bottom = deque->bottom - 1;
+  kuta_atomic_store_i64(&deque->bottom, bottom);
+  kuta_atomic_fence();
+  int64_t top = kuta_atomic_load_i64(&deque->top);
+
+  if (top > bottom) {
+    kuta_atomic_store_i64(&deque->bottom, bottom + 1);
+    return false;
+  }
+
+  *job = deque->slots[bottom & JOB_DEQUE_MASK];
+  if (top == bottom) {
+    // Last job, race the thieves for it
+    bool won = kuta_atomic_cas_i64(&deque->top, top, top + 1);
+    kuta_atomic_store_i64(&deque->bottom, bottom + 1);
+    return won;
+  }
+  return true;
+}
+
+static bool deque_steal(JobDeque *deque, Job *job) {
+  int64_t top = kuta_atomic_load_i64(&deque->top);
+  kuta_atomic_fence();
+  int64_t bottom = kuta_atomic_load_i64(&deque->bottom);
+  if (top >= bottom)
+    return false;
+
+  *job = deque->slots[top & JOB_DEQUE_MASK];
+  return kuta_atomic_cas_i64(&deque->top, top, top + 1);
+}
+
+static void counter_lock(KutaJobCounter *counter) {
+  while (!kuta_atomic_cas_u32(&counter->lock, 0, 1)) {
+    kuta_thread_yield();
+  }
+}
+
+static void counter_unlock(KutaJobCounter *counter) {
+  kuta_atomic_store_u32(&counter->lock, 0);
+}
+
+static void wake_workers(void) {
+  if (kuta_atomic_load_u32(&job_system->sleeping) == 0)
+    return;
+
+  kuta_mutex_lock(&job_system->sleep_mutex);
+  kuta_cond_broadcast(&job_system->wake);
+  kuta_mutex_unlock(&job_system->sleep_mutex);
+}
+
+static void run_job(Job job);
+
+// Queues a job whose dependencies are met. `queued` is raised before the job
+// becomes visible so it never drops below the number of queued jobs
+static void push_job(Job job) {
+  kuta_atomic_add_u32(&job_system->queued, 1);
+
+  if (worker_index != KUTA_JOB_NO_WORKER) {
+    if (!deque_push(&job_system->deques[worker_index], job)) {
+      kuta_atomic_add_u32(&job_system->queued, (uint32_t)-1);
+      run_job(job);
+      return;
+    }
+  } else {
+    KutaJobNode *node = pool_alloc(&job_system->nodes);
+    if (!node) {
+      printf("Error: Failed to allocate job!\n");
+      kuta_atomic_add_u32(&job_system->queued, (uint32_t)-1);
+      run_job(job);
+      return;
+    }
+    node->job = job;
+    node->next = NULL;
+
+    kuta_mutex_lock(&job_system->injected_mutex);
+    if (job_system->injected_tail) {
+      job_system->injected_tail->next = node;
+    } else {
+      job_system->injected_head = node;
+    }
+    job_system->injected_tail = node;
+    kuta_atomic_add_u32(&job_system->injected_count, 1);
+    kuta_mutex_unlock(&job_system->injected_mutex);
+  }
+
+  wake_workers();
+}
+
+// Marks one job of the counter as finished and starts the jobs waiting on it
+// once none are left. The unlock is the last access, see kuta_job_done
+static void counter_finish(KutaJobCounter *counter) {
+  counter_lock(counter);
+  KutaJobNode *waiting = NULL;
+  if (kuta_atomic_add_u32(&counter->pending, (uint32_t)-1) == 1) {
+    waiting = counter->waiting;
+    counter->waiting = NULL;
+  }
+  counter_unlock(counter);
+
+  while (waiting) {
+    KutaJobNode *next = waiting->next;
+    push_job(waiting->job);
+    pool_release(&job_system->nodes, waiting);
+    waiting = next;
+  }
+}
+
+static void run_job(Job job) {
+  job.fn(job.data);
+  if (job.counter)
+    counter_finish(job.counter);
+}
+
+static bool take_job(Job *job) {
+  uint32_t self = worker_index;
+
+  if (self != KUTA_JOB_NO_WORKER && deque_pop(&job_system->deques[self], job))
+    goto found;
+
+  if (kuta_atomic_load_u32(&job_system->injected_count) > 0) {
+    kuta_mutex_lock(&job_system->injected_mutex);
+    KutaJobNode *node = job_system->injected_head;
+    if (node) {
+      job_system->injected_head = node->next;
+      if (!node->next)
+        job_system->injected_tail = NULL;
+      kuta_atomic_add_u32(&job_system->injected_count, (uint32_t)-1);
+    }
+    kuta_mutex_unlock(&job_system->injected_mutex);
+
+    if (node) {
+      *job = node->job;
+      pool_release(&job_system->nodes, node);
+      goto found;
+    }
+  }
+
+  // Start stealing at the next worker so thieves spread out
+  uint32_t start = self != KUTA_JOB_NO_WORKER ? self + 1 : 0;
+  for (uint32_t i = 0; i < job_system->worker_count; i++) {
+    uint32_t victim = (start + i) % job_system->worker_count;
+    if (victim != self && deque_steal(&job_system->deques[victim], job))
+      goto found;
+  }
+  return false;
+
+found:
+  kuta_atomic_add_u32(&job_system->queued, (uint32_t)-1);
+  return true;
+}
+
+static void worker_main(void *arg) {
+  worker_index = (uint32_t)(uintptr_t)arg;
+  uint32_t idle = 0;
+
+  for (;;) {
+    Job job;
+    if (take_job(&job)) {
+      run_job(job);
+      idle = 0;
+      continue;
+    }
+
+    if (++idle < JOB_IDLE_SPINS) {
+      kuta_thread_yield();
+      continue;
+    }
+
+    kuta_mutex_lock(&job_system->sleep_mutex);
+    kuta_atomic_add_u32(&job_system->sleeping, 1);
+    while (!job_system->quit &&
+           kuta_atomic_load_u32(&job_system->queued) == 0) {
+      kuta_cond_wait(&job_system->wake, &job_system->sleep_mutex);
+    }
+    kuta_atomic_add_u32(&job_system->sleeping, (uint32_t)-1);
+    bool quit = job_system->quit;
+    kuta_mutex_unlock(&job_system->sleep_mutex);
+
+    if (quit)
+      break;
+    idle = 0;
+  }
+}
+
+// Starts worker_count threads, the calling thread becomes worker 0 and only
+// runs jobs while it waits on a counter
+bool job_system_init(uint32_t worker_count) {
+  if (job_system)
+    return false;
+
+  job_system = kuta_calloc(KUTA_MEMORY_CORE, 1, sizeof(JobSystem));
+  if (!job_system)
+    return false;
+
+  job_system->worker_count = worker_count + 1;
+  job_system->deques =
+      kuta_calloc(KUTA_MEMORY_CORE, job_system->worker_count, sizeof(JobDeque));
+  job_system->threads =
+      kuta_malloc(KUTA_MEMORY_CORE,
+                  sizeof(KutaThread) * job_system->worker_count);
+  if (!job_system->deques || !job_system->threads) {
+    printf("Error: Failed to allocate job system!\n");
+    kuta_free(job_system->deques);
+    kuta_free(job_system->threads);
+    kuta_free(job_system);
+    job_system = NULL;
+    return false;
+  }
+
+  kuta_mutex_init(&job_system->injected_mutex);
+  kuta_mutex_init(&job_system->sleep_mutex);
+  kuta_cond_init(&job_system->wake);
+  pool_init(&job_system->nodes, sizeof(KutaJobNode), JOB_NODES_PER_BLOCK);
+  worker_index = 0;
+
+  for (uint32_t i = 1; i <= worker_count; i++) {
+    if (!kuta_thread_create(&job_system->threads[job_system->thread_count],
+                            worker_main, (void *)(uintptr_t)i)) {
+      break;
+    }
+    job_system->thread_count++;
+  }
+
+  return true;
+}
+
+// Runs whatever is still queued and joins the workers
+void job_system_shutdown(void) {
+  if (!job_system)
+    return;
+
+  Job job;
+  while (take_job(&job)) {
+    run_job(job);
+  }
+
+  kuta_mutex_lock(&job_system->sleep_mutex);
+  job_system->quit = true;
+  kuta_cond_broadcast(&job_system->wake);
+  kuta_mutex_unlock(&job_system->sleep_mutex);
+
+  for (uint32_t i = 0; i < job_system->thread_count; i++) {
+    kuta_thread_join(job_system->threads[i]);
+  }
+
+  kuta_cond_destroy(&job_system->wake);
+  kuta_mutex_destroy(&job_system->sleep_mutex);
+  kuta_mutex_destroy(&job_system->injected_mutex);
+  pool_free(&job_system->nodes);
+  kuta_free(job_system->threads);
+  kuta_free(job_system->deques);
+  kuta_free(job_system);
+  job_system = NULL;
+  worker_index = KUTA_JOB_NO_WORKER;
+}
+
+// Submits a job, counter (may be NULL) stays above zero until it finished.
+// Without a job system the job runs right away
+void kuta_job_submit(KutaJobFn fn, void *data, KutaJobCounter *counter) {
+  kuta_job_submit_after(NULL, fn, data, counter);
+}
+
+// Same as kuta_job_submit but the job only starts once dependency reached
+// zero
+void kuta_job_submit_after(KutaJobCounter *dependency, KutaJobFn fn,
+                           void *data, KutaJobCounter *counter) {
+  Job job = {.fn = fn, .data = data, .counter = counter};
+
+  if (counter)
+    kuta_atomic_add_u32(&counter->pending, 1);
+
+  if (!job_system) {
+    if (dependency)
+      kuta_job_wait(dependency);
+    run_job(job);
+    return;
+  }
+
+  if (dependency) {
+    counter_lock(dependency);
+    if (dependency->pending > 0) {
+      KutaJobNode *node = pool_alloc(&job_system->nodes);
+      if (node) {
+        node->job = job;
+        node->next = dependency->waiting;
+        dependency->waiting = node;
+        counter_unlock(dependency);
+        return;
+      }
+      printf("Error: Failed to allocate job!\n");
+      counter_unlock(dependency);
+      kuta_job_wait(dependency);
+    } else {
+      counter_unlock(dependency);
+    }
+  }
+
+  push_job(job);
+}
+
+// Returns true once every job submitted with the counter finished
+bool kuta_job_done(KutaJobCounter *counter) {
+  return kuta_atomic_load_u32(&counter->pending) == 0 &&
+         kuta_atomic_load_u32(&counter->lock) == 0;
+}
+
+// Blocks until the counter reaches zero, running other jobs meanwhile
+void kuta_job_wait(KutaJobCounter *counter) {
+  while (!kuta_job_done(counter)) {
+    Job job;
+    if (job_system && take_job(&job)) {
+      run_job(job);
+    } else {
+      kuta_thread_yield();
+    }
+  }
+}
+
+typedef struct {
+  KutaJobRangeFn fn;
+  void *data;
+  uint32_t count;
+  uint32_t range_size;
+  uint32_t range_count;
+  volatile uint32_t next_range;
+} ParallelFor;
+
+// Each job keeps claiming ranges, so a slow worker never holds up the rest
+static void parallel_for_job(void *data) {
+  ParallelFor *work = data;
+
+  for (;;) {
+    uint32_t range = kuta_atomic_add_u32(&work->next_range, 1);
+    if (range >= work->range_count)
+      return;
+
+    uint32_t begin = range * work->range_size;
+    uint32_t end = begin + work->range_size;
+    if (end > work->count)
+      end = work->count;
+
+    work->fn(work->data, begin, end);
+  }
+}
+
+// Splits [0, count) into ranges of range_size and runs them on all workers,
+// returns once every range finished
+void kuta_job_parallel_for(uint32_t count, uint32_t range_size,
+                           KutaJobRangeFn fn, void *data) {
+  if (count == 0)
+    return;
+  if (range_size == 0)
+    range_size = 1;
+
+  ParallelFor work = {
+      .fn = fn,
+      .data = data,
+      .count = count,
+      .range_size = range_size,
+      .range_count = (count + range_size - 1) / range_size,
+  };
+
+  uint32_t job_count = kuta_job_worker_count();
+  if (job_count > work.range_count)
+    job_count = work.range_count;
+
+  KutaJobCounter counter = {0};
+  for (uint32_t i = 1; i < job_count; i++) {
+    kuta_job_submit(parallel_for_job, &work, &counter);
+  }
+  parallel_for_job(&work);
+  kuta_job_wait(&counter);
+}
+
+// Returns the number of threads running jobs, the main thread included
+uint32_t kuta_job_worker_count(void) {
+  return job_system ? job_system->thread_count + 1 : 1;
+}
+
+// Returns the index of the calling worker, 0 for the main thread and
+// KUTA_JOB_NO_WORKER for threads outside the pool
+uint32_t kuta_job_worker_index(void) { return worker_index; }
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool job_system_init(uint32_t worker_count);
+
+void job_system_shutdown(void);
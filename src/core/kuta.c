@@ -7,142 +7,105 @@
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
+#include "allocator.h"
+#include "arena.h"
 #include "buffer_data.h"
 #include "descriptors.h"
+#include "ecs.h"
+#include "gpu_culling.h"
+#include "hierarchy.h"
+#include "jobs.h"
 #include "internal_types.h"
 #include "kuta.h"
 #include "models.h"
+#include "render_queue.h"
 #include "renderer.h"
 #include "swapchain.h"
 #include "texture_data.h"
+#include "threads.h"
+#include "transform.h"
 #include "types.h"
 #include "utils.h"
 #include "vulkan_core.h"
 #include "window.h"
 
+#define TRANSFORM_BATCH_SIZE 256
+
 static KutaContext *kuta_context = NULL;
 
-// Inits the component pools and entitys
-void world_init(World *world) {
-  memset(world, 0, sizeof(World));
-
-  world->component_pools[COMPONENT_TRANSFORM] =
-      malloc(sizeof(TransformComponent) * MAX_ENTITIES);
-  world->component_pools[COMPONENT_MESH_RENDERER] =
-      malloc(sizeof(MeshRendererComponent) * MAX_ENTITIES);
-  world->component_pools[COMPONENT_VISIBILITY] =
-      malloc(sizeof(VisibilityComponent) * MAX_ENTITIES);
-  world->component_pools[COMPONENT_CAMERA] =
-      malloc(sizeof(CameraComponent) * MAX_ENTITIES); // ADD
-  world->component_pools[COMPONENT_LIGHT] =
-      malloc(sizeof(LightComponent) * MAX_ENTITIES); // ADD
-
-  world->component_sizes[COMPONENT_TRANSFORM] = sizeof(TransformComponent);
-  world->component_sizes[COMPONENT_MESH_RENDERER] =
-      sizeof(MeshRendererComponent);
-  world->component_sizes[COMPONENT_VISIBILITY] = sizeof(VisibilityComponent);
-  world->component_sizes[COMPONENT_CAMERA] = sizeof(CameraComponent); // ADD
-  world->component_sizes[COMPONENT_LIGHT] = sizeof(LightComponent);   // ADD
-
-  world->entity_count = 0;
-  world->next_entity_id = 1;
-}
-
-// Cleanup componoents pools
-void world_cleanup(World *world) {
-  for (int i = 0; i < COMPONENT_COUNT; i++) {
-    if (world->component_pools[i]) {
-      free(world->component_pools[i]);
-      world->component_pools[i] = NULL;
+typedef struct {
+  World *world;
+  const Entity *entities;
+} TransformUpdate;
+
+// Rebuilds the matrices of entities [begin, end) of the list. They are
+// collected into batches so they can be built with SIMD
+static void transform_update_range(void *context, uint32_t begin,
+                                   uint32_t end) {
+  TransformUpdate *update = context;
+  ComponentPool *pool = &update->world->component_pools[COMPONENT_TRANSFORM];
+  TransformComponent *batch[TRANSFORM_BATCH_SIZE];
+  uint32_t batch_count = 0;
+
+  for (uint32_t i = begin; i < end; i++) {
+    batch[batch_count++] = component_pool_get(pool, update->entities[i]);
+
+    if (batch_count == TRANSFORM_BATCH_SIZE) {
+      transform_compose_batch(batch, batch_count);
+      batch_count = 0;
     }
   }
-  memset(world, 0, sizeof(World));
-}
-
-// Creates an entity and returns its id
-Entity create_entity(World *world) {
-  if (world->entity_count >= MAX_ENTITIES) {
-    return 0;
-  }
-
-  Entity new_entity = world->next_entity_id++;
-
-  world->entities[world->entity_count] = new_entity;
-  world->entity_count++;
 
-  world->signatures[new_entity] = 0;
-
-  return new_entity;
+  transform_compose_batch(batch, batch_count);
 }
 
-// Returns true if the entity exists
-bool entity_exists(World *world, Entity entity) {
-  if (entity == 0 || entity >= world->next_entity_id) {
-    return false;
-  }
+static void transform_update_list(World *world, const Entity *entities,
+                                  uint32_t count) {
+  TransformUpdate update = {.world = world, .entities = entities};
 
-  for (uint32_t i = 0; i < world->entity_count; i++) {
-    if (world->entities[i] == entity) {
-      return true;
-    }
-  }
-  return false;
-}
-
-// Adds a desired component to an entity
-void add_component(World *world, Entity entity, ComponentType type,
-                   void *component) {
-  if (!entity_exists(world, entity))
+  if (!kuta_context || kuta_job_worker_count() == 1 ||
+      count < kuta_context->settings.parallel_transform_threshold) {
+    transform_update_range(&update, 0, count);
     return;
-
-  void *pool = world->component_pools[type];
-  size_t component_size = world->component_sizes[type];
-
-  void *destination = (char *)pool + (entity * component_size);
-
-  memcpy(destination, component, component_size);
-
-  world->signatures[entity] |= (1ULL << type);
-}
-
-void *get_component(World *world, Entity entity, ComponentType type) {
-  if (!(world->signatures[entity] & (1ULL << type))) {
-    return NULL;
   }
 
-  void *pool = world->component_pools[type];
-  size_t component_size = world->component_sizes[type];
-
-  return (char *)pool + (entity * component_size);
+  kuta_job_parallel_for(count, TRANSFORM_BATCH_SIZE, transform_update_range,
+                        &update);
 }
 
-// Updates the Transform data of entites that have it
+// Updates the Transform data of the entities flagged since the last call,
+// large updates are split across the job workers. The dirty list is sorted
+// out first: stale handles and duplicates are dropped, entities in a
+// hierarchy go to a separate list since their world matrix is propagated
+// afterwards. What ends up changed is published in changed_transforms
 void transform_system_update(World *world) {
-  for (uint32_t i = 0; i < world->entity_count; i++) {
-    Entity entity = world->entities[i];
-
-    if (!(world->signatures[entity] &
-          COMPONENT_SIGNATURE(COMPONENT_TRANSFORM))) {
-      continue;
-    }
+  EntityList *dirty = &world->dirty_transforms;
+  EntityList *changed = &world->changed_transforms;
+  uint32_t in_hierarchy = 0;
+  changed->count = 0;
 
+  for (uint32_t i = 0; i < dirty->count; i++) {
+    Entity entity = dirty->items[i];
     TransformComponent *transform =
         get_component(world, entity, COMPONENT_TRANSFORM);
-
-    if (transform->dirty) {
-      mat4 translation_matrix, rotation_matrix, scale_matrix;
-
-      glm_translate_make(translation_matrix, transform->position);
-      glm_euler_xyz(transform->rotation, rotation_matrix);
-      glm_scale_make(scale_matrix, transform->scale);
-
-      mat4 temp;
-      glm_mat4_mul(rotation_matrix, scale_matrix, temp);
-      glm_mat4_mul(translation_matrix, temp, transform->matrix);
-
-      transform->dirty = false;
+    if (!transform || !transform->dirty)
+      continue;
+    transform->dirty = false;
+
+    if (component_signature_has(world->signatures[ENTITY_INDEX(entity)],
+                                COMPONENT_HIERARCHY)) {
+      hierarchy_mark_dirty(world, entity);
+      dirty->items[in_hierarchy++] = entity;
+    } else {
+      entity_list_push(changed, entity);
     }
   }
+
+  transform_update_list(world, changed->items, changed->count);
+  transform_update_list(world, dirty->items, in_hierarchy);
+  dirty->count = 0;
+
+  hierarchy_system_update(world);
 }
 
 void set_entity_position(World *world, Entity entity, vec3 position) {
@@ -152,7 +115,7 @@ void set_entity_position(World *world, Entity entity, vec3 position) {
     return;
 
   glm_vec3_copy(position, transform->position); // cglm copy function
-  transform->dirty = true;
+  mark_transform_dirty(world, entity);
 }
 
 void set_entity_rotation(World *world, Entity entity, vec3 rotation) {
@@ -162,7 +125,7 @@ void set_entity_rotation(World *world, Entity entity, vec3 rotation) {
     return;
 
   glm_vec3_copy(rotation, transform->rotation);
-  transform->dirty = true;
+  mark_transform_dirty(world, entity);
 }
 
 void set_entity_scale(World *world, Entity entity, vec3 scale) {
@@ -172,7 +135,7 @@ void set_entity_scale(World *world, Entity entity, vec3 scale) {
     return;
 
   glm_vec3_copy(scale, transform->scale);
-  transform->dirty = true;
+  mark_transform_dirty(world, entity);
 }
 
 void move_entity(World *world, Entity entity, vec3 delta) {
@@ -182,7 +145,7 @@ void move_entity(World *world, Entity entity, vec3 delta) {
     return;
 
   glm_vec3_add(transform->position, delta, transform->position);
-  transform->dirty = true;
+  mark_transform_dirty(world, entity);
 }
 
 // Manages Resource allocation initialization
@@ -199,24 +162,17 @@ ResourceManager *get_resource_manager() {
     rm.geometry_capacity = 4;
     rm.geometry_count = 0;
 
-    rm.geometries = malloc(sizeof(GeometryData) * rm.geometry_capacity);
-    rm.vertex_buffers = malloc(sizeof(VkBuffer) * rm.geometry_capacity);
-    rm.vertex_memory = malloc(sizeof(VkDeviceMemory) * rm.geometry_capacity);
-    rm.index_buffers = malloc(sizeof(VkBuffer) * rm.geometry_capacity);
-    rm.index_memory = malloc(sizeof(VkDeviceMemory) * rm.geometry_capacity);
+    rm.geometries = kuta_malloc(KUTA_MEMORY_RESOURCES,
+                                sizeof(GeometryData) * rm.geometry_capacity);
 
     rm.texture_capacity = 4;
     rm.texture_count = 0;
 
-    rm.textures = malloc(sizeof(TextureData) * rm.texture_capacity);
-    rm.texture_memory = malloc(sizeof(VkDeviceMemory) * rm.texture_capacity);
-
-    for (uint32_t i = 0; i < rm.geometry_capacity; i++) {
-      rm.vertex_buffers[i] = VK_NULL_HANDLE;
-      rm.vertex_memory[i] = VK_NULL_HANDLE;
-      rm.index_buffers[i] = VK_NULL_HANDLE;
-      rm.index_memory[i] = VK_NULL_HANDLE;
-    }
+    rm.textures = kuta_malloc(KUTA_MEMORY_RESOURCES,
+                              sizeof(TextureData) * rm.texture_capacity);
+    rm.texture_memory =
+        kuta_malloc(KUTA_MEMORY_RESOURCES,
+                    sizeof(VkDeviceMemory) * rm.texture_capacity);
 
     for (uint32_t i = 0; i < rm.texture_capacity; i++) {
       rm.textures[i].texture_image = VK_NULL_HANDLE;
@@ -234,19 +190,9 @@ ResourceManager *get_resource_manager() {
   return &rm;
 }
 
-VkBuffer get_model_vertex_buffer(int model_id) {
-  ResourceManager *rm = get_resource_manager();
-  return rm->vertex_buffers[model_id];
-}
-
-VkBuffer get_model_index_buffer(int model_id) {
-  ResourceManager *rm = get_resource_manager();
-  return rm->index_buffers[model_id];
-}
-
 int get_model_index_count(int model_id) {
   ResourceManager *rm = get_resource_manager();
-  return rm->geometries[model_id].index_count;
+  return rm->geometries[model_id].lods[0].index_count;
 }
 
 VkDescriptorSet get_texture_descriptor_set(int texture_id) {
@@ -256,63 +202,61 @@ VkDescriptorSet get_texture_descriptor_set(int texture_id) {
   return kuta_context->state.renderer.descriptor_sets[set_index];
 }
 
-// Draws all the entites depending on if they are visible
-void render_system_draw(World *world, VkCommandBuffer cmd_buffer) {
-  ComponentSignature required = COMPONENT_SIGNATURE(COMPONENT_TRANSFORM) |
-                                COMPONENT_SIGNATURE(COMPONENT_MESH_RENDERER) |
-                                COMPONENT_SIGNATURE(COMPONENT_VISIBILITY);
-
-  for (uint32_t i = 0; i < world->entity_count; i++) {
-    Entity entity = world->entities[i];
-
-    if ((world->signatures[entity] & required) != required) {
-      continue;
-    }
-
-    TransformComponent *transform =
-        get_component(world, entity, COMPONENT_TRANSFORM);
-    MeshRendererComponent *renderer =
-        get_component(world, entity, COMPONENT_MESH_RENDERER);
-    VisibilityComponent *visibility =
-        get_component(world, entity, COMPONENT_VISIBILITY);
-
-    if (!visibility->visible || visibility->alpha <= 0.0f) {
-      continue;
-    }
-
-    VkBuffer vertex_buffers[] = {get_model_vertex_buffer(renderer->model_id)};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(cmd_buffer, 0, 1, vertex_buffers, offsets);
-    vkCmdBindIndexBuffer(cmd_buffer, get_model_index_buffer(renderer->model_id),
-                         0, VK_INDEX_TYPE_UINT32);
-
-    VkDescriptorSet descriptor_set =
-        get_texture_descriptor_set(renderer->texture_id);
-
-    vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                            kuta_context->state.renderer.pipeline_layout, 0, 1,
-                            &descriptor_set, 0, NULL);
+// Records the GPU-driven cull pass over the scene end_frame synced
+void render_system_cull(World *world, VkCommandBuffer cmd_buffer,
+                        CullPhase phase) {
+  gpu_culling_record(&kuta_context->state, world, cmd_buffer, phase);
+}
 
-    vkCmdPushConstants(cmd_buffer, kuta_context->state.renderer.pipeline_layout,
-                       VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(mat4),
-                       &transform->matrix);
+// Uniform ring bytes the next render_system_upload allocates
+VkDeviceSize render_system_upload_size(void) {
+  if (kuta_context->state.renderer.gpu_driven)
+    return gpu_culling_upload_size(&kuta_context->state);
+  return render_queue_upload_size(&kuta_context->render_queue,
+                                  &kuta_context->state);
+}
 
-    uint32_t index_count = get_model_index_count(renderer->model_id);
-    vkCmdDrawIndexed(cmd_buffer, index_count, 1, 0, 0, 0);
+// Writes the frame's instance data, or on the GPU-driven path stages what
+// changed in the scene, before anything else is allocated from the frame's
+// uniform ring
+void render_system_upload(World *world) {
+  if (kuta_context->state.renderer.gpu_driven) {
+    gpu_culling_upload(&kuta_context->state, world);
+    return;
   }
+  render_queue_upload(&kuta_context->render_queue, world,
+                      &kuta_context->state);
+}
+
+// Whether the next render_system_draw gets split across the job workers,
+// the render pass has to be begun for secondary command buffers then. The
+// GPU-driven path's few multi-draws are always recorded inline
+bool render_system_draw_parallel(void) {
+  return !kuta_context->state.renderer.gpu_driven &&
+         render_queue_parallel(&kuta_context->render_queue,
+                               &kuta_context->state);
+}
+
+// Records the draws of the render queue built by end_frame, in sort order.
+// The GPU-driven path records its multi-draws instead
+void render_system_draw(World *world, VkCommandBuffer cmd_buffer,
+                        CullPhase phase,
+                        const VkCommandBufferInheritanceInfo *inheritance) {
+  if (kuta_context->state.renderer.gpu_driven) {
+    gpu_culling_draw(&kuta_context->state, cmd_buffer, phase);
+    return;
+  }
+  render_queue_record(&kuta_context->render_queue, world, cmd_buffer,
+                      inheritance, &kuta_context->state);
 }
 
 // mark camera as dirty
 void camera_dirty(World *world) {
-  for (uint32_t i = 0; i < world->entity_count; i++) {
-    Entity entity = world->entities[i];
-
-    if ((world->signatures[entity] & COMPONENT_SIGNATURE(COMPONENT_CAMERA))) {
-      CameraComponent *camera = get_component(world, entity, COMPONENT_CAMERA);
-      if (camera) {
-        camera->dirty = true;
-      }
-    }
+  ComponentPool *cameras = &world->component_pools[COMPONENT_CAMERA];
+
+  for (uint32_t i = 0; i < cameras->count; i++) {
+    CameraComponent *camera = component_pool_at(cameras, i);
+    camera->dirty = true;
   }
 }
 
@@ -330,14 +274,10 @@ void camera_system_update_vectors(CameraComponent *camera) {
 
 // Update camera matrices
 void camera_system_update(World *world, State *state) {
-  for (uint32_t i = 0; i < world->entity_count; i++) {
-    Entity entity = world->entities[i];
-
-    if (!(world->signatures[entity] & COMPONENT_SIGNATURE(COMPONENT_CAMERA))) {
-      continue;
-    }
+  ComponentPool *cameras = &world->component_pools[COMPONENT_CAMERA];
 
-    CameraComponent *camera = get_component(world, entity, COMPONENT_CAMERA);
+  for (uint32_t i = 0; i < cameras->count; i++) {
+    CameraComponent *camera = component_pool_at(cameras, i);
 
     if (!camera->active) {
       continue;
@@ -361,17 +301,21 @@ void camera_system_update(World *world, State *state) {
   }
 }
 
-// return active camera
+// return active camera, the last one found is cached so the cameras are only
+// scanned again once it gets deactivated or destroyed
 CameraComponent *get_active_camera(World *world) {
-  for (uint32_t i = 0; i < world->entity_count; i++) {
-    Entity entity = world->entities[i];
+  CameraComponent *camera =
+      get_component(world, world->active_camera, COMPONENT_CAMERA);
+  if (camera && camera->active) {
+    return camera;
+  }
 
-    if (!(world->signatures[entity] & COMPONENT_SIGNATURE(COMPONENT_CAMERA))) {
-      continue;
-    }
+  ComponentPool *cameras = &world->component_pools[COMPONENT_CAMERA];
 
-    CameraComponent *camera = get_component(world, entity, COMPONENT_CAMERA);
+  for (uint32_t i = 0; i < cameras->count; i++) {
+    camera = component_pool_at(cameras, i);
     if (camera->active) {
+      world->active_camera = component_pool_entity(cameras, i);
       return camera;
     }
   }
@@ -530,26 +474,22 @@ void lighting_system_gather(World *world, LightingUBO *lighting_ubo) {
   // Find first light entity
   bool found_light = false;
 
-  for (uint32_t i = 0; i < world->entity_count; i++) {
-    Entity entity = world->entities[i];
+  ComponentPool *lights = &world->component_pools[COMPONENT_LIGHT];
+  ComponentPool *transforms = &world->component_pools[COMPONENT_TRANSFORM];
+  uint32_t count = kuta_query_count(world->light_query);
 
-    ComponentSignature required = COMPONENT_SIGNATURE(COMPONENT_LIGHT) |
-                                  COMPONENT_SIGNATURE(COMPONENT_TRANSFORM);
+  for (uint32_t i = 0; i < count; i++) {
+    Entity entity = kuta_query_entity(world->light_query, i);
 
-    if ((world->signatures[entity] & required) != required) {
-      continue;
-    }
-
-    LightComponent *light = get_component(world, entity, COMPONENT_LIGHT);
-    TransformComponent *transform =
-        get_component(world, entity, COMPONENT_TRANSFORM);
+    LightComponent *light = component_pool_get(lights, entity);
+    TransformComponent *transform = component_pool_get(transforms, entity);
 
     if (!light->enabled || found_light) {
       continue;
     }
 
-    // Use transform position for light
-    glm_vec3_copy(transform->position, lighting_ubo->lightPos);
+    // Use the world space translation so parented lights follow their parent
+    glm_vec3_copy(transform->world_matrix[3], lighting_ubo->lightPos);
     glm_vec3_copy(light->color, lighting_ubo->lightColor);
     lighting_ubo->intensity = light->intensity;
 
@@ -567,7 +507,9 @@ void lighting_system_gather(World *world, LightingUBO *lighting_ubo) {
 // This Inits the renderer all loading happens after this
 void renderer_init(void) {
   create_render_pass(&kuta_context->state);
+  check_bindless_shader(&kuta_context->state);
   create_descriptor_set_layout(&kuta_context->state);
+  create_texture_table(&kuta_context->state);
   create_graphics_pipeline(&kuta_context->state);
   create_command_pool(&kuta_context->state);
   create_color_resources(&kuta_context->state);
@@ -583,8 +525,17 @@ void renderer_deinit(void) {
   create_descriptor_pool(&kuta_context->state, rm);
 
   // CREATE UNIFORM BUFFERS (both camera and lighting!)
-  create_uniform_buffers(&kuta_context->state, &kuta_context->buffer_data);
-  create_lighting_buffers(&kuta_context->state);
+  create_uniform_rings(&kuta_context->state);
+  create_gpu_culling(&kuta_context->state);
+  kuta_context->state.renderer.culling.min_screen_size =
+      kuta_context->settings.min_screen_size;
+  kuta_context->state.renderer.culling.lod_error =
+      kuta_context->settings.lod_error;
+  kuta_context->render_queue.min_screen_size =
+      kuta_context->settings.min_screen_size;
+  kuta_context->render_queue.lod_error = kuta_context->settings.lod_error;
+  kuta_context->render_queue.parallel_threshold =
+      kuta_context->settings.parallel_record_threshold;
 
   create_descriptor_sets(&kuta_context->buffer_data, rm, &kuta_context->state);
   allocate_command_buffer(&kuta_context->state);
@@ -593,6 +544,13 @@ void renderer_deinit(void) {
 
 // Takes the path to a model returns its id
 uint32_t load_geometry(const char *filepath) {
+  return load_geometry_lods(filepath, 1);
+}
+
+// Like load_geometry but also simplifies the model into up to lod_count
+// levels of detail sharing its vertices, the renderer picks one per entity
+// from how large it is on screen
+uint32_t load_geometry_lods(const char *filepath, uint32_t lod_count) {
   ResourceManager *rm = get_resource_manager();
 
   if (rm->geometry_count >= rm->geometry_capacity &&
@@ -600,15 +558,8 @@ uint32_t load_geometry(const char *filepath) {
     uint32_t new_capacity = rm->geometry_capacity * 2;
 
     rm->geometries =
-        realloc(rm->geometries, sizeof(GeometryData) * new_capacity);
-    rm->vertex_buffers =
-        realloc(rm->vertex_buffers, sizeof(VkBuffer) * new_capacity);
-    rm->vertex_memory =
-        realloc(rm->vertex_memory, sizeof(VkDeviceMemory) * new_capacity);
-    rm->index_buffers =
-        realloc(rm->index_buffers, sizeof(VkBuffer) * new_capacity);
-    rm->index_memory =
-        realloc(rm->index_memory, sizeof(VkDeviceMemory) * new_capacity);
+        kuta_realloc(KUTA_MEMORY_RESOURCES, rm->geometries,
+                     sizeof(GeometryData) * new_capacity);
 
     rm->geometry_capacity = new_capacity;
   }
@@ -621,38 +572,12 @@ uint32_t load_geometry(const char *filepath) {
   }
 
   GeometryData geometry = load_models(filepath);
+  generate_lods(&geometry, lod_count);
+  upload_geometry(&kuta_context->state, &rm->geometry_buffer, &geometry);
   rm->geometries[id] = geometry;
-
-  create_vertex_buffer(&kuta_context->state, &kuta_context->buffer_data,
-                       geometry.vertices, geometry.vertex_count,
-                       &rm->vertex_buffers[id], &rm->vertex_memory[id]);
-
-  create_index_buffer(&kuta_context->state, &kuta_context->buffer_data,
-                      geometry.indices, geometry.index_count,
-                      &rm->index_buffers[id], &rm->index_memory[id]);
   return id;
 }
 
-void free_geometry_buffers(ResourceManager *rm, State *state, uint32_t id) {
-  if (rm->vertex_buffers[id] != VK_NULL_HANDLE)
-    vkDestroyBuffer(state->vk_core.device, rm->vertex_buffers[id],
-                    state->vk_core.allocator);
-
-  if (rm->vertex_memory[id] != VK_NULL_HANDLE)
-    vkFreeMemory(state->vk_core.device, rm->vertex_memory[id],
-                 state->vk_core.allocator);
-
-  if (rm->index_buffers[id] != VK_NULL_HANDLE)
-    vkDestroyBuffer(state->vk_core.device, rm->index_buffers[id],
-                    state->vk_core.allocator);
-
-  if (rm->index_memory[id] != VK_NULL_HANDLE)
-    vkFreeMemory(state->vk_core.device, rm->index_memory[id],
-                 state->vk_core.allocator);
-
-  push(&rm->free_geometry_ids, id);
-}
-
 // Takes a path to the texture returns its id
 uint32_t load_texture(const char *texture_file) {
   ResourceManager *rm = get_resource_manager();
@@ -661,7 +586,8 @@ uint32_t load_texture(const char *texture_file) {
       isEmpty(&rm->free_texture_ids)) {
     uint32_t new_capacity = rm->texture_capacity * 2;
 
-    rm->textures = realloc(rm->textures, sizeof(TextureData) * new_capacity);
+    rm->textures = kuta_realloc(KUTA_MEMORY_RESOURCES, rm->textures,
+                                sizeof(TextureData) * new_capacity);
     if (!rm->textures) {
       printf("Error: Failed to reallocate texture arrays!\n");
       return UINT32_MAX;
@@ -692,6 +618,9 @@ uint32_t load_texture(const char *texture_file) {
   rm->textures[id].texture_sampler =
       create_texture_sampler(&kuta_context->state);
 
+  if (kuta_context->state.renderer.bindless)
+    write_texture_table(&kuta_context->state, id, &rm->textures[id]);
+
   return id;
 }
 
@@ -700,7 +629,7 @@ bool kuta_init(Settings *settings) {
   if (kuta_context != NULL) {
     return false;
   }
-  kuta_context = calloc(1, sizeof(KutaContext));
+  kuta_context = kuta_calloc(KUTA_MEMORY_CORE, 1, sizeof(KutaContext));
   if (!kuta_context)
     return false;
 
@@ -713,6 +642,36 @@ bool kuta_init(Settings *settings) {
   kuta_context->state.window_data.title = settings->window_title;
   kuta_context->state.vk_core.api_version = settings->api_version;
   kuta_context->settings.background_color = settings->background_color;
+  kuta_context->settings.gpu_driven = settings->gpu_driven;
+  kuta_context->settings.min_screen_size = settings->min_screen_size;
+  kuta_context->settings.lod_error = settings->lod_error > 0.0f
+                                         ? settings->lod_error
+                                         : KUTA_DEFAULT_LOD_ERROR;
+  kuta_context->settings.occlusion_culling = settings->occlusion_culling;
+  kuta_context->settings.bindless_textures = settings->bindless_textures;
+  // create_device turns it off again if the device can't
+  kuta_context->state.renderer.gpu_driven = settings->gpu_driven;
+  kuta_context->state.renderer.occlusion_culling =
+      settings->gpu_driven && settings->occlusion_culling;
+  kuta_context->state.renderer.bindless = settings->bindless_textures;
+
+  kuta_context->settings.parallel_transform_threshold =
+      settings->parallel_transform_threshold
+          ? settings->parallel_transform_threshold
+          : KUTA_DEFAULT_PARALLEL_TRANSFORM_THRESHOLD;
+  kuta_context->settings.parallel_record_threshold =
+      settings->parallel_record_threshold
+          ? settings->parallel_record_threshold
+          : KUTA_DEFAULT_PARALLEL_RECORD_THRESHOLD;
+  kuta_context->settings.worker_count = settings->worker_count
+                                            ? settings->worker_count
+                                            : kuta_cpu_count() - 1;
+  job_system_init(kuta_context->settings.worker_count);
+
+  kuta_context->settings.frame_arena_size =
+      settings->frame_arena_size ? settings->frame_arena_size
+                                 : KUTA_DEFAULT_FRAME_ARENA_SIZE;
+  frame_arenas_init(kuta_context->settings.frame_arena_size);
 
   create_window(&kuta_context->state.window_data);
 
@@ -743,6 +702,10 @@ bool kuta_init(Settings *settings) {
 float lastFrame = 0.0f;
 // Begins the update loop
 void begin_frame(World *world) {
+  // Transient allocations of this frame's last use are done by now
+  frame_arena_begin(kuta_context->state.renderer.current_frame);
+  kuta_memory_frame_begin();
+
   float currentFrame = glfwGetTime();
   float deltaTime = currentFrame - lastFrame;
   lastFrame = currentFrame;
@@ -756,6 +719,9 @@ void begin_frame(World *world) {
   // Update camera matrices
   camera_system_update(world, &kuta_context->state);
 
+  // Registered gameplay systems, in parallel where their access allows
+  kuta_systems_run(world, deltaTime);
+
   uint32_t frame = kuta_context->state.renderer.current_frame;
   vkWaitForFences(kuta_context->state.vk_core.device, 1,
                   &kuta_context->state.renderer.in_flight_fence[frame], VK_TRUE,
@@ -767,9 +733,17 @@ void begin_frame(World *world) {
                                kuta_context->texture_data.mip_levels);
 }
 
-// Ends the loop submits the draw commands and updates the transform system
+// Ends the loop, applies deferred ECS commands, updates the transform system,
+// sorts the frame's draws or syncs the GPU-driven path's scene and submits
+// the draw commands
 void end_frame(World *world) {
+  world_flush_commands(world);
   transform_system_update(world);
+  if (kuta_context->state.renderer.gpu_driven) {
+    gpu_culling_sync(&kuta_context->state, world);
+  } else {
+    render_queue_build(&kuta_context->render_queue, world);
+  }
 
   record_command_buffer(&kuta_context->buffer_data, &kuta_context->settings,
                         &kuta_context->state, world);
@@ -782,6 +756,8 @@ void end_frame(World *world) {
 
   kuta_context->state.renderer.current_frame =
       (kuta_context->state.renderer.current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+
+  kuta_memory_frame_end();
 }
 
 // End of the program Cleanup
@@ -812,18 +788,17 @@ void kuta_deinit(void) {
                      kuta_context->state.vk_core.allocator);
     }
     if (rm->texture_memory[i] != VK_NULL_HANDLE) {
-      vkFreeMemory(kuta_context->state.vk_core.device, rm->texture_memory[i],
-                   kuta_context->state.vk_core.allocator);
+      free_device_memory(kuta_context->state.vk_core.device,
+                         rm->texture_memory[i]);
     }
   }
 
-  destroy_lighting_buffers(&kuta_context->state);
-  destroy_uniform_buffers(&kuta_context->buffer_data, &kuta_context->state);
+  destroy_uniform_rings(&kuta_context->state);
+  destroy_gpu_culling(&kuta_context->state);
+  render_queue_free(&kuta_context->render_queue);
   destroy_descriptor_sets(&kuta_context->state);
   destroy_descriptor_set_layout(&kuta_context->state);
-  for (uint32_t i = 0; i < rm->geometry_count; i++) {
-    free_geometry_buffers(rm, &kuta_context->state, i);
-  }
+  destroy_geometry_buffer(&kuta_context->state, &rm->geometry_buffer);
   if (kuta_context->state.vk_core.device != VK_NULL_HANDLE)
     vkDestroyDevice(kuta_context->state.vk_core.device,
                     kuta_context->state.vk_core.allocator);
@@ -839,6 +814,9 @@ void kuta_deinit(void) {
   if (kuta_context->state.vk_core.instance != VK_NULL_HANDLE)
     vkDestroyInstance(kuta_context->state.vk_core.instance,
                       kuta_context->state.vk_core.allocator);
+
+  job_system_shutdown();
+  frame_arenas_free();
 }
 
 // Checks if the program is still running DUH
@@ -847,3 +825,10 @@ bool running() {
 }
 
 float get_time() { return glfwGetTime(); }
+
+// Transient memory that stays valid until the same frame comes around again,
+// MAX_FRAMES_IN_FLIGHT frames later. Nothing has to be freed, returns NULL
+// once the frame's arena is full
+void *kuta_frame_alloc(size_t size, size_t alignment) {
+  return frame_alloc(size, alignment);
+}
@@ -1,13 +1,29 @@
 #pragma once
 
+#include "ecs.h"
 #include "vulkan_core.h"
 
-void render_system_draw(World *world, VkCommandBuffer cmd_buffer);
+void render_system_cull(World *world, VkCommandBuffer cmd_buffer,
+                        CullPhase phase);
+
+VkDeviceSize render_system_upload_size(void);
+
+void render_system_upload(World *world);
+
+bool render_system_draw_parallel(void);
+
+void render_system_draw(World *world, VkCommandBuffer cmd_buffer,
+                        CullPhase phase,
+                        const VkCommandBufferInheritanceInfo *inheritance);
+
+ResourceManager *get_resource_manager();
+
+int get_model_index_count(int model_id);
+
+VkDescriptorSet get_texture_descriptor_set(int texture_id);
 
 void lighting_system_gather(World *world, LightingUBO *lighting_ubo);
 
 CameraComponent *get_active_camera(World *world);
 
 void camera_dirty(World *world);
-
-void *get_component(World *world, Entity entity, ComponentType type);
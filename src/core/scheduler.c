@@ -0,0 +1,204 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "kuta.h"
+#include "scheduler.h"
+#include "threads.h"
+#include "types.h"
+
+// Weight of the newest frame in the smoothed system timings
+#define SYSTEM_TIMING_SMOOTHING 0.1f
+
+typedef struct {
+  KutaScheduler *scheduler;
+  char *name;
+  KutaSystemFn fn;
+  void *data;
+  ComponentSignature reads;
+  ComponentSignature writes;
+  // Later systems that have to wait for this one
+  uint32_t *dependents;
+  uint32_t dependent_count;
+  uint32_t dependency_count;
+  volatile uint32_t remaining;
+  KutaSystemStats stats;
+} ScheduledSystem;
+
+struct KutaScheduler {
+  ScheduledSystem *systems;
+  uint32_t system_count;
+  World *world;
+  float delta_time;
+  KutaJobCounter counter;
+};
+
+static bool signatures_overlap(ComponentSignature a, ComponentSignature b) {
+  for (uint32_t i = 0; i < COMPONENT_SIGNATURE_WORDS; i++) {
+    if (a.bits[i] & b.bits[i])
+      return true;
+  }
+  return false;
+}
+
+// Two systems conflict if either writes a component the other one touches
+static bool systems_conflict(const ScheduledSystem *a,
+                             const ScheduledSystem *b) {
+  return signatures_overlap(a->writes, b->reads) ||
+         signatures_overlap(a->writes, b->writes) ||
+         signatures_overlap(a->reads, b->writes);
+}
+
+static bool add_dependent(ScheduledSystem *system, uint32_t dependent) {
+  uint32_t *dependents =
+      kuta_realloc(KUTA_MEMORY_ECS, system->dependents,
+                   sizeof(uint32_t) * (system->dependent_count + 1));
+  if (!dependents)
+    return false;
+
+  system->dependents = dependents;
+  system->dependents[system->dependent_count++] = dependent;
+  return true;
+}
+
+// Registers a system that runs every frame from begin_frame. It may run on
+// any worker and at the same time as every earlier system it doesn't
+// conflict with, conflicting systems keep their registration order. reads
+// and writes list the component types the system accesses, a written type
+// doesn't have to be listed in reads. Returns the system's id or
+// KUTA_SYSTEM_INVALID
+uint32_t kuta_system_register(World *world, const char *name, KutaSystemFn fn,
+                              void *data, ComponentSignature reads,
+                              ComponentSignature writes) {
+  if (!world->scheduler) {
+    world->scheduler = kuta_calloc(KUTA_MEMORY_ECS, 1, sizeof(KutaScheduler));
+    if (!world->scheduler) {
+      printf("Error: Failed to allocate scheduler!\n");
+      return KUTA_SYSTEM_INVALID;
+    }
+  }
+
+  KutaScheduler *scheduler = world->scheduler;
+  ScheduledSystem *systems =
+      kuta_realloc(KUTA_MEMORY_ECS, scheduler->systems,
+                   sizeof(ScheduledSystem) * (scheduler->system_count + 1));
+  if (!systems) {
+    printf("Error: Failed to register system %s!\n", name);
+    return KUTA_SYSTEM_INVALID;
+  }
+  scheduler->systems = systems;
+
+  uint32_t id = scheduler->system_count;
+  ScheduledSystem *system = &systems[id];
+  memset(system, 0, sizeof(ScheduledSystem));
+  system->scheduler = scheduler;
+  system->fn = fn;
+  system->data = data;
+  system->reads = reads;
+  system->writes = writes;
+
+  system->name = kuta_malloc(KUTA_MEMORY_ECS, strlen(name) + 1);
+  if (!system->name) {
+    printf("Error: Failed to register system %s!\n", name);
+    return KUTA_SYSTEM_INVALID;
+  }
+  strcpy(system->name, name);
+  system->stats.name = system->name;
+  system->stats.worker = KUTA_JOB_NO_WORKER;
+
+  for (uint32_t i = 0; i < id; i++) {
+    if (!systems_conflict(&systems[i], system))
+      continue;
+
+    if (!add_dependent(&systems[i], id)) {
+      printf("Error: Failed to register system %s!\n", name);
+      kuta_free(system->name);
+      for (uint32_t j = 0; j < i; j++) {
+        if (systems[j].dependent_count > 0 &&
+            systems[j].dependents[systems[j].dependent_count - 1] == id) {
+          systems[j].dependent_count--;
+        }
+      }
+      return KUTA_SYSTEM_INVALID;
+    }
+    system->dependency_count++;
+  }
+
+  scheduler->system_count++;
+  return id;
+}
+
+static void system_job(void *data) {
+  ScheduledSystem *system = data;
+  KutaScheduler *scheduler = system->scheduler;
+
+  uint64_t start = kuta_time_ns();
+  system->fn(scheduler->world, scheduler->delta_time, system->data);
+  float elapsed = (float)(kuta_time_ns() - start) / 1000000.0f;
+
+  system->stats.last_ms = elapsed;
+  system->stats.average_ms +=
+      (elapsed - system->stats.average_ms) * SYSTEM_TIMING_SMOOTHING;
+  system->stats.worker = kuta_job_worker_index();
+
+  // The last dependency to finish starts the dependent system
+  for (uint32_t i = 0; i < system->dependent_count; i++) {
+    ScheduledSystem *dependent = &scheduler->systems[system->dependents[i]];
+    if (kuta_atomic_add_u32(&dependent->remaining, (uint32_t)-1) == 1)
+      kuta_job_submit(system_job, dependent, &scheduler->counter);
+  }
+}
+
+// Runs every registered system once and returns when all of them finished.
+// begin_frame calls it after updating the camera
+void kuta_systems_run(World *world, float delta_time) {
+  KutaScheduler *scheduler = world->scheduler;
+  if (!scheduler || scheduler->system_count == 0)
+    return;
+
+  scheduler->world = world;
+  scheduler->delta_time = delta_time;
+
+  for (uint32_t i = 0; i < scheduler->system_count; i++) {
+    scheduler->systems[i].remaining = scheduler->systems[i].dependency_count;
+  }
+
+  for (uint32_t i = 0; i < scheduler->system_count; i++) {
+    if (scheduler->systems[i].dependency_count == 0) {
+      kuta_job_submit(system_job, &scheduler->systems[i],
+                      &scheduler->counter);
+    }
+  }
+
+  kuta_job_wait(&scheduler->counter);
+}
+
+uint32_t kuta_system_count(World *world) {
+  return world->scheduler ? world->scheduler->system_count : 0;
+}
+
+// Returns the timings of the system, valid after the first kuta_systems_run
+bool kuta_system_stats(World *world, uint32_t system, KutaSystemStats *stats) {
+  if (system >= kuta_system_count(world))
+    return false;
+
+  *stats = world->scheduler->systems[system].stats;
+  return true;
+}
+
+void scheduler_free(World *world) {
+  KutaScheduler *scheduler = world->scheduler;
+  if (!scheduler)
+    return;
+
+  for (uint32_t i = 0; i < scheduler->system_count; i++) {
+    kuta_free(scheduler->systems[i].name);
+    kuta_free(scheduler->systems[i].dependents);
+  }
+  kuta_free(scheduler->systems);
+  kuta_free(scheduler);
+  world->scheduler = NULL;
+}
@@ -0,0 +1,572 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "ecs.h"
+#include "kuta.h"
+#include "types.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A snapshot is the raw world state: a header, one table entry per component
+// pool and then the arrays, each starting on a 64 byte boundary so a mapped
+// file can be copied straight into the pool chunks. Values are stored in host
+// byte order, snapshots are a cache and not an interchange format. Registered
+// component types are stored like the built-in ones and registered again, in
+// the same order, when the snapshot is loaded
+#define SNAPSHOT_MAGIC "KWS1"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGNMENT 64
+
+typedef struct {
+  uint32_t count;
+  uint32_t component_size;
+  uint64_t components_offset;
+  uint64_t entities_offset;
+} SnapshotPool;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t component_count;
+  uint32_t entity_count;
+  uint32_t next_entity_id;
+  uint32_t free_head;
+  uint32_t free_tail;
+  uint32_t free_count;
+  uint64_t entities_offset;
+  uint64_t signatures_offset;
+  uint64_t generations_offset;
+  uint64_t entity_slots_offset;
+  uint64_t size;
+} SnapshotHeader;
+
+struct KutaSnapshotSave {
+  KutaJobCounter counter;
+  char *path;
+  char *image;
+  size_t size;
+  bool written;
+};
+
+static uint64_t align_offset(uint64_t offset) {
+  return (offset + SNAPSHOT_ALIGNMENT - 1) &
+         ~(uint64_t)(SNAPSHOT_ALIGNMENT - 1);
+}
+
+// Reserves size bytes in the image and returns their offset
+static uint64_t layout_section(uint64_t *cursor, uint64_t size) {
+  uint64_t offset = align_offset(*cursor);
+  *cursor = offset + size;
+  return offset;
+}
+
+// Copies the world into one buffer laid out exactly like the file
+static char *build_image(World *world, size_t *size) {
+  SnapshotHeader header = {
+      .version = SNAPSHOT_VERSION,
+      .component_count = world->component_type_count,
+      .entity_count = world->entity_count,
+      .next_entity_id = world->next_entity_id,
+      .free_head = world->free_head,
+      .free_tail = world->free_tail,
+      .free_count = world->free_count,
+  };
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+  SnapshotPool pools[MAX_COMPONENT_TYPES];
+  uint32_t pool_count = world->component_type_count;
+  uint64_t cursor = sizeof(SnapshotHeader) + sizeof(SnapshotPool) * pool_count;
+  uint32_t slots = world->next_entity_id;
+
+  header.entities_offset =
+      layout_section(&cursor, sizeof(Entity) * (uint64_t)world->entity_count);
+  header.signatures_offset =
+      layout_section(&cursor, sizeof(ComponentSignature) * (uint64_t)slots);
+  header.generations_offset =
+      layout_section(&cursor, sizeof(uint16_t) * (uint64_t)slots);
+  header.entity_slots_offset =
+      layout_section(&cursor, sizeof(uint32_t) * (uint64_t)slots);
+
+  for (uint32_t type = 0; type < pool_count; type++) {
+    ComponentPool *pool = &world->component_pools[type];
+    pools[type].count = pool->count;
+    pools[type].component_size = (uint32_t)pool->component_size;
+    pools[type].components_offset =
+        layout_section(&cursor, pool->component_size * pool->count);
+    pools[type].entities_offset =
+        layout_section(&cursor, sizeof(Entity) * (uint64_t)pool->count);
+  }
+  header.size = cursor;
+
+  char *image = kuta_calloc(KUTA_MEMORY_ECS, 1, cursor);
+  if (!image) {
+    printf("Error: Failed to allocate snapshot!\n");
+    return NULL;
+  }
+
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + sizeof(header), pools, sizeof(SnapshotPool) * pool_count);
+  memcpy(image + header.entities_offset, world->entities,
+         sizeof(Entity) * world->entity_count);
+  memcpy(image + header.signatures_offset, world->signatures,
+         sizeof(ComponentSignature) * slots);
+  memcpy(image + header.generations_offset, world->generations,
+         sizeof(uint16_t) * slots);
+  memcpy(image + header.entity_slots_offset, world->entity_slots,
+         sizeof(uint32_t) * slots);
+
+  for (uint32_t type = 0; type < pool_count; type++) {
+    ComponentPool *pool = &world->component_pools[type];
+    char *components = image + pools[type].components_offset;
+    Entity *entities = (Entity *)(image + pools[type].entities_offset);
+    uint32_t chunk_size = component_pool_chunk_size(pool);
+
+    for (uint32_t first = 0; first < pool->count; first += chunk_size) {
+      uint32_t copied =
+          pool->count - first < chunk_size ? pool->count - first : chunk_size;
+      char *chunk = pool->chunks[first >> pool->chunk_shift];
+      memcpy(components + pool->component_size * first, chunk,
+             pool->component_size * copied);
+      memcpy(entities + first, chunk + pool->entities_offset,
+             sizeof(Entity) * copied);
+    }
+  }
+
+  *size = cursor;
+  return image;
+}
+
+static bool write_image(const char *path, const char *image, size_t size) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    printf("Error: Failed to open %s for writing!\n", path);
+    return false;
+  }
+
+  bool written = fwrite(image, 1, size, file) == size;
+  written = fclose(file) == 0 && written;
+  if (!written)
+    printf("Error: Failed to write snapshot %s!\n", path);
+  return written;
+}
+
+// Writes the world to path, blocking until the file is written
+bool world_save_snapshot(World *world, const char *path) {
+  size_t size;
+  char *image = build_image(world, &size);
+  if (!image)
+    return false;
+
+  bool written = write_image(path, image, size);
+  kuta_free(image);
+  return written;
+}
+
+static void save_job(void *data) {
+  KutaSnapshotSave *save = data;
+  save->written = write_image(save->path, save->image, save->size);
+}
+
+// Copies the world and writes the copy to path on a job, the world can be
+// modified again as soon as this returns. Pass the result to
+// world_snapshot_wait to find out whether writing succeeded
+KutaSnapshotSave *world_save_snapshot_async(World *world, const char *path) {
+  KutaSnapshotSave *save =
+      kuta_calloc(KUTA_MEMORY_ECS, 1, sizeof(KutaSnapshotSave));
+  if (!save)
+    return NULL;
+
+  save->path = kuta_malloc(KUTA_MEMORY_ECS, strlen(path) + 1);
+  save->image = build_image(world, &save->size);
+  if (!save->path || !save->image) {
+    kuta_free(save->path);
+    kuta_free(save->image);
+    kuta_free(save);
+    return NULL;
+  }
+  strcpy(save->path, path);
+
+  kuta_job_submit(save_job, save, &save->counter);
+  return save;
+}
+
+// Waits for an async save and frees it, returns true if the file was written
+bool world_snapshot_wait(KutaSnapshotSave *save) {
+  if (!save)
+    return false;
+
+  kuta_job_wait(&save->counter);
+  bool written = save->written;
+
+  kuta_free(save->image);
+  kuta_free(save->path);
+  kuta_free(save);
+  return written;
+}
+
+typedef struct {
+  const char *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+} MappedFile;
+
+static bool map_file(const char *path, MappedFile *mapped) {
+  memset(mapped, 0, sizeof(MappedFile));
+
+#ifdef _WIN32
+  mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (mapped->file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(mapped->file, &size) || size.QuadPart == 0) {
+    CloseHandle(mapped->file);
+    return false;
+  }
+  mapped->size = (size_t)size.QuadPart;
+
+  mapped->mapping =
+      CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapped->mapping) {
+    mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+  if (!mapped->data) {
+    if (mapped->mapping)
+      CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+    return false;
+  }
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  mapped->size = (size_t)info.st_size;
+
+  void *data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  mapped->data = data;
+#endif
+
+  return true;
+}
+
+static void unmap_file(MappedFile *mapped) {
+#ifdef _WIN32
+  UnmapViewOfFile(mapped->data);
+  CloseHandle(mapped->mapping);
+  CloseHandle(mapped->file);
+#else
+  munmap((void *)mapped->data, mapped->size);
+#endif
+}
+
+static bool section_fits(const MappedFile *mapped, uint64_t offset,
+                         uint64_t size) {
+  return offset <= mapped->size && size <= mapped->size - offset;
+}
+
+// The arrays are written on SNAPSHOT_ALIGNMENT boundaries, a file where one
+// isn't was not written by build_image
+static bool array_fits(const MappedFile *mapped, uint64_t offset,
+                       uint64_t size) {
+  return offset % SNAPSHOT_ALIGNMENT == 0 &&
+         section_fits(mapped, offset, size);
+}
+
+// Checks the header and that every section lies aligned inside the file, so
+// the arrays can be read
+static bool validate_layout(const MappedFile *mapped) {
+  if (mapped->size < sizeof(SnapshotHeader))
+    return false;
+
+  const SnapshotHeader *header = (const SnapshotHeader *)mapped->data;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->component_count < COMPONENT_COUNT ||
+      header->component_count > MAX_COMPONENT_TYPES ||
+      header->size != mapped->size || header->next_entity_id == 0 ||
+      header->next_entity_id > KUTA_MAX_ENTITIES ||
+      header->entity_count >= header->next_entity_id ||
+      header->free_count >= header->next_entity_id) {
+    return false;
+  }
+
+  uint64_t slots = header->next_entity_id;
+  if (!section_fits(mapped, sizeof(SnapshotHeader),
+                    sizeof(SnapshotPool) * header->component_count) ||
+      !array_fits(mapped, header->entities_offset,
+                  sizeof(Entity) * (uint64_t)header->entity_count) ||
+      !array_fits(mapped, header->signatures_offset,
+                  sizeof(ComponentSignature) * slots) ||
+      !array_fits(mapped, header->generations_offset,
+                  sizeof(uint16_t) * slots) ||
+      !array_fits(mapped, header->entity_slots_offset,
+                  sizeof(uint32_t) * slots)) {
+    return false;
+  }
+
+  const SnapshotPool *pools =
+      (const SnapshotPool *)(mapped->data + sizeof(SnapshotHeader));
+  for (uint32_t type = 0; type < header->component_count; type++) {
+    if (pools[type].count > header->entity_count ||
+        !array_fits(mapped, pools[type].components_offset,
+                    (uint64_t)pools[type].component_size *
+                        pools[type].count) ||
+        !array_fits(mapped, pools[type].entities_offset,
+                    sizeof(Entity) * (uint64_t)pools[type].count)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// The saved arrays of a valid layout, indexed like the world's
+typedef struct {
+  const SnapshotHeader *header;
+  const Entity *entities;
+  const ComponentSignature *signatures;
+  const uint16_t *generations;
+  const uint32_t *entity_slots;
+} SnapshotSlots;
+
+// entity_exists on the saved arrays
+static bool snapshot_entity_live(const SnapshotSlots *saved, Entity entity) {
+  uint32_t index = ENTITY_INDEX(entity);
+  if (index == 0 || index >= saved->header->next_entity_id)
+    return false;
+
+  uint32_t slot = saved->entity_slots[index];
+  return slot < saved->header->entity_count && saved->entities[slot] == entity;
+}
+
+// Every live handle has to map back to its own slot with the current
+// generation, which also rules out an index being listed twice. Free slots
+// hand their generation to the next handle, so it has to fit one too
+static bool validate_live(const SnapshotSlots *saved) {
+  for (uint32_t index = 0; index < saved->header->next_entity_id; index++) {
+    if (saved->generations[index] > ENTITY_GENERATION_MASK)
+      return false;
+  }
+
+  for (uint32_t i = 0; i < saved->header->entity_count; i++) {
+    Entity entity = saved->entities[i];
+    uint32_t index = ENTITY_INDEX(entity);
+    if (!snapshot_entity_live(saved, entity) ||
+        saved->entity_slots[index] != i ||
+        ENTITY_GENERATION(entity) != saved->generations[index]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Walks free_count links from free_head, which has to end on free_tail
+// without reaching a live or an already visited index.
+// world_alloc_entity and destroy_entity follow these links unchecked
+static bool validate_free_list(const SnapshotSlots *saved, bool *visited) {
+  const SnapshotHeader *header = saved->header;
+  uint32_t index = header->free_head;
+
+  for (uint32_t i = 0; i < header->free_count; i++) {
+    if (index == 0 || index >= header->next_entity_id || visited[index])
+      return false;
+
+    uint32_t slot = saved->entity_slots[index];
+    if (slot < header->entity_count &&
+        ENTITY_INDEX(saved->entities[slot]) == index) {
+      return false;
+    }
+
+    visited[index] = true;
+    if (i + 1 < header->free_count)
+      index = slot;
+  }
+
+  return header->free_count == 0 || index == header->free_tail;
+}
+
+// Every pool may only list live entities, each once, and the saved
+// signatures have to match the pools exactly. signatures is scratch space
+// for one signature per slot
+static bool validate_pools(const SnapshotSlots *saved, const char *data,
+                           ComponentSignature *signatures) {
+  const SnapshotHeader *header = saved->header;
+  const SnapshotPool *pools =
+      (const SnapshotPool *)(data + sizeof(SnapshotHeader));
+
+  for (uint32_t type = 0; type < header->component_count; type++) {
+    const Entity *entities =
+        (const Entity *)(data + pools[type].entities_offset);
+    for (uint32_t i = 0; i < pools[type].count; i++) {
+      if (!snapshot_entity_live(saved, entities[i]))
+        return false;
+
+      ComponentSignature *signature = &signatures[ENTITY_INDEX(entities[i])];
+      if (component_signature_has(*signature, (ComponentType)type))
+        return false;
+      component_signature_add(signature, (ComponentType)type);
+    }
+  }
+
+  return memcmp(signatures, saved->signatures,
+                sizeof(ComponentSignature) * header->next_entity_id) == 0;
+}
+
+// Checks the layout and then that the slot arrays, the free list and the
+// pools describe one consistent world, so the copies below can trust the
+// file
+static bool validate_snapshot(const MappedFile *mapped) {
+  if (!validate_layout(mapped))
+    return false;
+
+  const SnapshotHeader *header = (const SnapshotHeader *)mapped->data;
+  SnapshotSlots saved = {
+      .header = header,
+      .entities = (const Entity *)(mapped->data + header->entities_offset),
+      .signatures = (const ComponentSignature *)(mapped->data +
+                                                 header->signatures_offset),
+      .generations =
+          (const uint16_t *)(mapped->data + header->generations_offset),
+      .entity_slots =
+          (const uint32_t *)(mapped->data + header->entity_slots_offset),
+  };
+  if (!validate_live(&saved))
+    return false;
+
+  uint32_t slots = header->next_entity_id;
+  bool *visited = kuta_calloc(KUTA_MEMORY_ECS, slots, sizeof(bool));
+  ComponentSignature *signatures =
+      kuta_calloc(KUTA_MEMORY_ECS, slots, sizeof(ComponentSignature));
+  bool valid = visited && signatures &&
+               validate_free_list(&saved, visited) &&
+               validate_pools(&saved, mapped->data, signatures);
+
+  kuta_free(visited);
+  kuta_free(signatures);
+  return valid;
+}
+
+// Maps the snapshot at path and restores it into world, which must not be
+// initialised yet. Entity handles and registered component ids stay the same
+// as in the saved world. On failure the world is left empty but initialised
+bool world_load_snapshot(World *world, const char *path) {
+  MappedFile mapped;
+  if (!map_file(path, &mapped)) {
+    printf("Error: Failed to open snapshot %s!\n", path);
+    world_init(world);
+    return false;
+  }
+
+  if (!validate_snapshot(&mapped)) {
+    printf("Error: %s is not a valid snapshot!\n", path);
+    unmap_file(&mapped);
+    world_init(world);
+    return false;
+  }
+
+  const SnapshotHeader *header = (const SnapshotHeader *)mapped.data;
+  const SnapshotPool *pools =
+      (const SnapshotPool *)(mapped.data + sizeof(SnapshotHeader));
+
+  world_init_with_capacity(world, header->next_entity_id);
+
+  for (uint32_t type = 0; type < header->component_count; type++) {
+    // The alignment isn't saved, the largest power of two dividing the size
+    // (up to a cache line) is always a valid one
+    size_t size = pools[type].component_size;
+    size_t alignment = size & (~size + 1);
+    if (alignment > SNAPSHOT_ALIGNMENT)
+      alignment = SNAPSHOT_ALIGNMENT;
+
+    if (type >= COMPONENT_COUNT &&
+        register_component(world, size, alignment) == COMPONENT_TYPE_INVALID) {
+      unmap_file(&mapped);
+      world_cleanup(world);
+      world_init(world);
+      return false;
+    }
+
+    if (pools[type].component_size !=
+        world->component_pools[type].component_size) {
+      printf("Error: Snapshot %s has a different layout for component %u!\n",
+             path, type);
+      unmap_file(&mapped);
+      world_cleanup(world);
+      world_init(world);
+      return false;
+    }
+  }
+
+  uint32_t slots = header->next_entity_id;
+  memcpy(world->entities, mapped.data + header->entities_offset,
+         sizeof(Entity) * header->entity_count);
+  memcpy(world->signatures, mapped.data + header->signatures_offset,
+         sizeof(ComponentSignature) * slots);
+  memcpy(world->generations, mapped.data + header->generations_offset,
+         sizeof(uint16_t) * slots);
+  memcpy(world->entity_slots, mapped.data + header->entity_slots_offset,
+         sizeof(uint32_t) * slots);
+
+  world->entity_count = header->entity_count;
+  world->next_entity_id = header->next_entity_id;
+  world->reserved_entity_id = header->next_entity_id;
+  world->free_head = header->free_head;
+  world->free_tail = header->free_tail;
+  world->free_count = header->free_count;
+
+  for (uint32_t type = 0; type < header->component_count; type++) {
+    component_pool_append(
+        &world->component_pools[type],
+        mapped.data + pools[type].components_offset,
+        (const Entity *)(mapped.data + pools[type].entities_offset),
+        pools[type].count);
+  }
+
+  unmap_file(&mapped);
+
+  world_rebuild_queries(world);
+
+  // Matrices are saved as they were, only pending changes need a rebuild
+  ComponentPool *transforms = &world->component_pools[COMPONENT_TRANSFORM];
+  for (uint32_t i = 0; i < transforms->count; i++) {
+    TransformComponent *transform = component_pool_at(transforms, i);
+    if (transform->dirty) {
+      entity_list_push(&world->dirty_transforms,
+                       component_pool_entity(transforms, i));
+    }
+  }
+  if (world->component_pools[COMPONENT_HIERARCHY].count > 0) {
+    world->hierarchy_order_dirty = true;
+    world->hierarchy_dirty = 1;
+  }
+
+  return true;
+}
@@ -0,0 +1,236 @@
+#include <cglm/cglm.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "transform.h"
+#include "types.h"
+
+// Builds the TRS matrix of a single transform, M = T * R_xyz * S. The world
+// matrix is set to the same, the hierarchy pass fixes it up for children
+void transform_compose(TransformComponent *transform) {
+  mat4 *matrix = &transform->matrix;
+
+  glm_euler_xyz(transform->rotation, *matrix);
+  glm_vec4_scale((*matrix)[0], transform->scale[0], (*matrix)[0]);
+  glm_vec4_scale((*matrix)[1], transform->scale[1], (*matrix)[1]);
+  glm_vec4_scale((*matrix)[2], transform->scale[2], (*matrix)[2]);
+  glm_vec3_copy(transform->position, (*matrix)[3]);
+  glm_mat4_copy(*matrix, transform->world_matrix);
+}
+
+#if TRANSFORM_SIMD_WIDTH > 1
+
+// Thin lane abstraction so the composer is written once for SSE and AVX
+#if TRANSFORM_SIMD_WIDTH == 8
+#include <immintrin.h>
+
+typedef __m256 lanes;
+#define lanes_set1 _mm256_set1_ps
+#define lanes_load _mm256_load_ps
+#define lanes_store _mm256_store_ps
+#define lanes_add _mm256_add_ps
+#define lanes_sub _mm256_sub_ps
+#define lanes_mul _mm256_mul_ps
+#define lanes_and _mm256_and_ps
+#define lanes_andnot _mm256_andnot_ps
+#define lanes_or _mm256_or_ps
+#define lanes_xor _mm256_xor_ps
+#define lanes_eq(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define lanes_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define lanes_round(a)                                                         \
+  _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#else
+#include <emmintrin.h>
+
+typedef __m128 lanes;
+#define lanes_set1 _mm_set1_ps
+#define lanes_load _mm_load_ps
+#define lanes_store _mm_store_ps
+#define lanes_add _mm_add_ps
+#define lanes_sub _mm_sub_ps
+#define lanes_mul _mm_mul_ps
+#define lanes_and _mm_and_ps
+#define lanes_andnot _mm_andnot_ps
+#define lanes_or _mm_or_ps
+#define lanes_xor _mm_xor_ps
+#define lanes_eq _mm_cmpeq_ps
+#define lanes_gt _mm_cmpgt_ps
+#define lanes_round(a) _mm_cvtepi32_ps(_mm_cvtps_epi32(a))
+#endif
+
+// The three part pi/2 reduction below stays exact up to this angle, larger
+// angles fall back to libm
+#define TRANSFORM_SINCOS_LIMIT 8192.0f
+
+static inline lanes lanes_select(lanes mask, lanes a, lanes b) {
+  return lanes_or(lanes_and(mask, a), lanes_andnot(mask, b));
+}
+
+// Cephes style sincos: reduce to [-pi/4, pi/4] around the nearest multiple of
+// pi/2, evaluate both minimax polynomials and swap/negate per quadrant
+static inline void lanes_sincos(lanes x, lanes *sin_out, lanes *cos_out) {
+  lanes one = lanes_set1(1.0f);
+  lanes j = lanes_round(lanes_mul(x, lanes_set1(0.63661977236758134f)));
+
+  lanes r = lanes_sub(x, lanes_mul(j, lanes_set1(1.5703125f)));
+  r = lanes_sub(r, lanes_mul(j, lanes_set1(4.837512969970703125e-4f)));
+  r = lanes_sub(r, lanes_mul(j, lanes_set1(7.54978995489188216e-8f)));
+  lanes z = lanes_mul(r, r);
+
+  lanes sin_r = lanes_set1(-1.9515295891e-4f);
+  sin_r = lanes_add(lanes_mul(sin_r, z), lanes_set1(8.3321608736e-3f));
+  sin_r = lanes_add(lanes_mul(sin_r, z), lanes_set1(-1.6666654611e-1f));
+  sin_r = lanes_add(lanes_mul(lanes_mul(sin_r, z), r), r);
+
+  lanes cos_r = lanes_set1(2.443315711809948e-5f);
+  cos_r = lanes_add(lanes_mul(cos_r, z), lanes_set1(-1.388731625493765e-3f));
+  cos_r = lanes_add(lanes_mul(cos_r, z), lanes_set1(4.166664568298827e-2f));
+  cos_r = lanes_mul(lanes_mul(cos_r, z), z);
+  cos_r = lanes_add(lanes_sub(cos_r, lanes_mul(z, lanes_set1(0.5f))), one);
+
+  // quadrant = j mod 4, computed in float so AVX1 needs no integer ops
+  lanes quarter = lanes_mul(j, lanes_set1(0.25f));
+  lanes floored = lanes_round(quarter);
+  floored = lanes_sub(floored, lanes_and(lanes_gt(floored, quarter), one));
+  lanes quadrant = lanes_sub(j, lanes_mul(floored, lanes_set1(4.0f)));
+
+  lanes q1 = lanes_eq(quadrant, one);
+  lanes q2 = lanes_eq(quadrant, lanes_set1(2.0f));
+  lanes q3 = lanes_eq(quadrant, lanes_set1(3.0f));
+  lanes swap = lanes_or(q1, q3);
+  lanes sign = lanes_set1(-0.0f);
+
+  *sin_out = lanes_xor(lanes_select(swap, cos_r, sin_r),
+                       lanes_and(lanes_or(q2, q3), sign));
+  *cos_out = lanes_xor(lanes_select(swap, sin_r, cos_r),
+                       lanes_and(lanes_or(q1, q2), sign));
+}
+
+// Transposes one column of four matrices from SoA back into the transforms,
+// both the local and the world matrix get it
+static inline void store_column4(TransformComponent **transforms, int column,
+                                 __m128 x, __m128 y, __m128 z, __m128 w) {
+  _MM_TRANSPOSE4_PS(x, y, z, w);
+  __m128 rows[4] = {x, y, z, w};
+  for (int i = 0; i < 4; i++) {
+    _mm_storeu_ps(transforms[i]->matrix[column], rows[i]);
+    _mm_storeu_ps(transforms[i]->world_matrix[column], rows[i]);
+  }
+}
+
+static inline void store_column(TransformComponent **transforms, int column,
+                                lanes x, lanes y, lanes z, lanes w) {
+#if TRANSFORM_SIMD_WIDTH == 8
+  store_column4(transforms, column, _mm256_castps256_ps128(x),
+                _mm256_castps256_ps128(y), _mm256_castps256_ps128(z),
+                _mm256_castps256_ps128(w));
+  store_column4(transforms + 4, column, _mm256_extractf128_ps(x, 1),
+                _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1),
+                _mm256_extractf128_ps(w, 1));
+#else
+  store_column4(transforms, column, x, y, z, w);
+#endif
+}
+
+// Composes TRANSFORM_SIMD_WIDTH matrices at once. The inputs are gathered
+// into SoA streams, the rotation terms are the ones of glm_euler_xyz with the
+// scale folded into the columns and the translation written as column 3
+static void compose_lanes(TransformComponent **transforms) {
+  CGLM_ALIGN(32) float soa[9][TRANSFORM_SIMD_WIDTH];
+  float max_angle = 0.0f;
+
+  for (int lane = 0; lane < TRANSFORM_SIMD_WIDTH; lane++) {
+    TransformComponent *transform = transforms[lane];
+    for (int k = 0; k < 3; k++) {
+      soa[k][lane] = transform->position[k];
+      soa[3 + k][lane] = transform->rotation[k];
+      soa[6 + k][lane] = transform->scale[k];
+      max_angle = fmaxf(max_angle, fabsf(transform->rotation[k]));
+    }
+  }
+
+  lanes sx, cx, sy, cy, sz, cz;
+  lanes_sincos(lanes_load(soa[3]), &sx, &cx);
+  lanes_sincos(lanes_load(soa[4]), &sy, &cy);
+  lanes_sincos(lanes_load(soa[5]), &sz, &cz);
+
+  // Patch only the lanes that are out of range, so a transform gets the same
+  // matrix whatever it was batched with
+  if (max_angle > TRANSFORM_SINCOS_LIMIT) {
+    CGLM_ALIGN(32) float sines[3][TRANSFORM_SIMD_WIDTH];
+    CGLM_ALIGN(32) float cosines[3][TRANSFORM_SIMD_WIDTH];
+    lanes_store(sines[0], sx), lanes_store(cosines[0], cx);
+    lanes_store(sines[1], sy), lanes_store(cosines[1], cy);
+    lanes_store(sines[2], sz), lanes_store(cosines[2], cz);
+
+    for (int k = 0; k < 3; k++) {
+      for (int lane = 0; lane < TRANSFORM_SIMD_WIDTH; lane++) {
+        float angle = soa[3 + k][lane];
+        if (fabsf(angle) > TRANSFORM_SINCOS_LIMIT) {
+          sines[k][lane] = sinf(angle);
+          cosines[k][lane] = cosf(angle);
+        }
+      }
+    }
+
+    sx = lanes_load(sines[0]), cx = lanes_load(cosines[0]);
+    sy = lanes_load(sines[1]), cy = lanes_load(cosines[1]);
+    sz = lanes_load(sines[2]), cz = lanes_load(cosines[2]);
+  }
+
+  lanes czsx = lanes_mul(cz, sx);
+  lanes cxcz = lanes_mul(cx, cz);
+  lanes sysz = lanes_mul(sy, sz);
+
+  lanes scale_x = lanes_load(soa[6]);
+  lanes scale_y = lanes_load(soa[7]);
+  lanes scale_z = lanes_load(soa[8]);
+  lanes zero = lanes_set1(0.0f);
+
+  lanes m00 = lanes_mul(lanes_mul(cy, cz), scale_x);
+  lanes m01 = lanes_mul(lanes_add(lanes_mul(czsx, sy), lanes_mul(cx, sz)),
+                        scale_x);
+  lanes m02 = lanes_mul(lanes_sub(lanes_mul(sx, sz), lanes_mul(cxcz, sy)),
+                        scale_x);
+
+  lanes m10 = lanes_mul(lanes_sub(zero, lanes_mul(cy, sz)), scale_y);
+  lanes m11 = lanes_mul(lanes_sub(cxcz, lanes_mul(sx, sysz)), scale_y);
+  lanes m12 = lanes_mul(lanes_add(czsx, lanes_mul(cx, sysz)), scale_y);
+
+  lanes m20 = lanes_mul(sy, scale_z);
+  lanes m21 = lanes_mul(lanes_sub(zero, lanes_mul(cy, sx)), scale_z);
+  lanes m22 = lanes_mul(lanes_mul(cx, cy), scale_z);
+
+  store_column(transforms, 0, m00, m01, m02, zero);
+  store_column(transforms, 1, m10, m11, m12, zero);
+  store_column(transforms, 2, m20, m21, m22, zero);
+  store_column(transforms, 3, lanes_load(soa[0]), lanes_load(soa[1]),
+               lanes_load(soa[2]), lanes_set1(1.0f));
+}
+
+#endif
+
+// Builds the matrices of all given transforms, TRANSFORM_SIMD_WIDTH at a
+// time. The remainder is padded by repeating the last transform so every
+// matrix goes through the same math no matter how the input was split
+void transform_compose_batch(TransformComponent **transforms, uint32_t count) {
+#if TRANSFORM_SIMD_WIDTH > 1
+  uint32_t i = 0;
+  for (; i + TRANSFORM_SIMD_WIDTH <= count; i += TRANSFORM_SIMD_WIDTH) {
+    compose_lanes(transforms + i);
+  }
+
+  if (i < count) {
+    TransformComponent *tail[TRANSFORM_SIMD_WIDTH];
+    for (uint32_t lane = 0; lane < TRANSFORM_SIMD_WIDTH; lane++) {
+      tail[lane] = transforms[i + lane < count ? i + lane : count - 1];
+    }
+    compose_lanes(tail);
+  }
+#else
+  for (uint32_t i = 0; i < count; i++) {
+    transform_compose(transforms[i]);
+  }
+#endif
+}
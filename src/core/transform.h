@@ -0,0 +1,18 @@
+#pragma once
+
+#include "types.h"
+#include <stdint.h>
+
+// Number of transforms composed per SIMD step
+#if defined(__AVX__)
+#define TRANSFORM_SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) ||                                  \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRANSFORM_SIMD_WIDTH 4
+#else
+#define TRANSFORM_SIMD_WIDTH 1
+#endif
+
+void transform_compose(TransformComponent *transform);
+
+void transform_compose_batch(TransformComponent **transforms, uint32_t count);
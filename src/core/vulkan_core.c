@@ -1,3 +1,4 @@
+#include "allocator.h"
 #include "texture_data.h"
 #define GLFW_INCLUDE_VULKAN
 #include "internal_types.h"
@@ -7,9 +8,36 @@
 #include <cglm/cglm.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
+#ifdef DEBUG
+#define VALIDATION_LAYER "VK_LAYER_KHRONOS_validation"
+
+static bool validation_layer_available(void) {
+  uint32_t count = 0;
+  if (vkEnumerateInstanceLayerProperties(&count, NULL) != VK_SUCCESS ||
+      count == 0)
+    return false;
+
+  VkLayerProperties *layers =
+      kuta_malloc(KUTA_MEMORY_RENDERER, sizeof(VkLayerProperties) * count);
+  if (!layers)
+    return false;
+
+  bool found = false;
+  if (vkEnumerateInstanceLayerProperties(&count, layers) == VK_SUCCESS) {
+    for (uint32_t i = 0; i < count && !found; i++) {
+      found = strcmp(layers[i].layerName, VALIDATION_LAYER) == 0;
+    }
+  }
+  kuta_free(layers);
+  return found;
+}
+#endif
+
 void create_instance(State *state, Settings *settings) {
   uint32_t required_extensions_count;
   const char **required_extensions =
@@ -26,9 +54,51 @@ void create_instance(State *state, Settings *settings) {
       .enabledExtensionCount = required_extensions_count,
       .ppEnabledExtensionNames = required_extensions,
   };
+
+#ifdef DEBUG
+  // Debug builds run under the validation layer when it's installed, with
+  // synchronization validation so the barriers between the cull phases, the
+  // depth pyramid and the render passes are checked as well. The layer
+  // reports to stdout
+  const char *layer = VALIDATION_LAYER;
+  const char **extensions = NULL;
+  VkValidationFeatureEnableEXT enabled_features[] = {
+      VK_VALIDATION_FEATURE_ENABLE_SYNCHRONIZATION_VALIDATION_EXT,
+  };
+  VkValidationFeaturesEXT validation_features = {
+      .sType = VK_STRUCTURE_TYPE_VALIDATION_FEATURES_EXT,
+      .enabledValidationFeatureCount = 1,
+      .pEnabledValidationFeatures = enabled_features,
+  };
+
+  if (validation_layer_available()) {
+    extensions = kuta_malloc(KUTA_MEMORY_RENDERER,
+                             sizeof(char *) * (required_extensions_count + 1));
+  }
+  if (extensions) {
+    memcpy(extensions, required_extensions,
+           sizeof(char *) * required_extensions_count);
+    extensions[required_extensions_count] =
+        VK_EXT_VALIDATION_FEATURES_EXTENSION_NAME;
+
+    createInfo.pNext = &validation_features;
+    createInfo.enabledLayerCount = 1;
+    createInfo.ppEnabledLayerNames = &layer;
+    createInfo.enabledExtensionCount = required_extensions_count + 1;
+    createInfo.ppEnabledExtensionNames = extensions;
+  } else {
+    printf("Error: " VALIDATION_LAYER " isn't installed, running without "
+           "validation!\n");
+  }
+#endif
+
   EXPECT(vkCreateInstance(&createInfo, state->vk_core.allocator,
                           &state->vk_core.instance),
          "Failed to Create vulkan Instance");
+
+#ifdef DEBUG
+  kuta_free(extensions);
+#endif
 }
 
 void select_physical_device(State *state) {
@@ -37,7 +107,8 @@ void select_physical_device(State *state) {
          "Failed to enumerate physical devices count1")
   EXPECT(count == 0, "Failed to find vulkan supported physical device")
 
-  VkPhysicalDevice *devices = malloc(sizeof(VkPhysicalDevice) * count);
+  VkPhysicalDevice *devices =
+      kuta_malloc(KUTA_MEMORY_RENDERER, sizeof(VkPhysicalDevice) * count);
   if (!devices) {
     fprintf(stderr, "Failed to allocate memory for devices\n");
     exit(EXIT_FAILURE);
@@ -50,7 +121,7 @@ void select_physical_device(State *state) {
   state->vk_core.physical_device = devices[0];
 
   state->renderer.msaa_samples = get_max_usable_sample_count(state);
-  free(devices);
+  kuta_free(devices);
 }
 
 void create_surface(State *state) {
@@ -67,7 +138,8 @@ void select_queue_family(State *state) {
   vkGetPhysicalDeviceQueueFamilyProperties(state->vk_core.physical_device,
                                            &count, NULL);
   VkQueueFamilyProperties *queue_families =
-      malloc(count * sizeof(VkQueueFamilyProperties));
+      kuta_malloc(KUTA_MEMORY_RENDERER,
+                  count * sizeof(VkQueueFamilyProperties));
 
   EXPECT(queue_families == NULL,
          "Failed to allocate memmory for queue families")
@@ -89,22 +161,108 @@ void select_queue_family(State *state) {
   EXPECT(state->vk_core.graphics_queue_family == UINT32_MAX,
          "Failed no suitable queue family")
 
-  free(queue_families);
+  kuta_free(queue_families);
+}
+
+// What the device supports of Vulkan 1.2, features_12 is chained to
+// features. Both stay zeroed when the instance or the device is older, so
+// every 1.2 feature reads as missing
+static void query_features_12(State *state, VkPhysicalDeviceFeatures2 *features,
+                              VkPhysicalDeviceVulkan12Features *features_12) {
+  *features_12 = (VkPhysicalDeviceVulkan12Features){
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+  };
+  *features = (VkPhysicalDeviceFeatures2){
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = features_12,
+  };
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(state->vk_core.physical_device, &properties);
+  if (state->vk_core.api_version < VK_API_VERSION_1_2 ||
+      properties.apiVersion < VK_API_VERSION_1_2)
+    return;
+
+  vkGetPhysicalDeviceFeatures2(state->vk_core.physical_device, features);
+}
+
+// The GPU-driven path writes its own draw counts and first instances and
+// issues many draws per call, which takes drawIndirectCount from Vulkan 1.2,
+// drawIndirectFirstInstance and multiDrawIndirect
+static bool supports_gpu_driven(const VkPhysicalDeviceFeatures2 *features,
+                                const VkPhysicalDeviceVulkan12Features *f12) {
+  return f12->drawIndirectCount &&
+         features->features.drawIndirectFirstInstance &&
+         features->features.multiDrawIndirect;
+}
+
+// The bindless texture table is a runtime sized array written while bound,
+// indexed by what every instance of a draw shares so dynamic indexing is
+// enough. Its size stays below the 500k update after bind samplers every
+// such device allows
+static bool supports_bindless(const VkPhysicalDeviceFeatures2 *features,
+                              const VkPhysicalDeviceVulkan12Features *f12) {
+  return f12->runtimeDescriptorArray && f12->descriptorBindingPartiallyBound &&
+         f12->descriptorBindingSampledImageUpdateAfterBind &&
+         features->features.shaderSampledImageArrayDynamicIndexing;
 }
 
 void create_device(State *state) {
   VkPhysicalDeviceFeatures supported_features;
   vkGetPhysicalDeviceFeatures(state->vk_core.physical_device,
                               &supported_features);
-  VkPhysicalDeviceFeatures enabledFeatures = {
-      .samplerAnisotropy = VK_TRUE,
-      .sampleRateShading = VK_TRUE,
+  VkPhysicalDeviceFeatures2 enabledFeatures = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .features =
+          {
+              .samplerAnisotropy = VK_TRUE,
+              .sampleRateShading = VK_TRUE,
+          },
   };
+  VkPhysicalDeviceVulkan12Features enabled_features_12 = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+  };
+
+  VkPhysicalDeviceFeatures2 features;
+  VkPhysicalDeviceVulkan12Features features_12;
+  query_features_12(state, &features, &features_12);
+
+  if (state->renderer.gpu_driven &&
+      !supports_gpu_driven(&features, &features_12)) {
+    printf("Error: Device can't draw GPU-driven, culling on the CPU!\n");
+    state->renderer.gpu_driven = false;
+    state->renderer.occlusion_culling = false;
+  }
+  if (state->renderer.gpu_driven) {
+    enabledFeatures.features.drawIndirectFirstInstance = VK_TRUE;
+    enabledFeatures.features.multiDrawIndirect = VK_TRUE;
+    enabled_features_12.drawIndirectCount = VK_TRUE;
+    enabledFeatures.pNext = &enabled_features_12;
+  }
+  state->vk_core.draw_indirect_count = state->renderer.gpu_driven;
+
+  if (state->renderer.bindless &&
+      !supports_bindless(&features, &features_12)) {
+    printf("Error: Device can't index textures bindless, binding a descriptor "
+           "set per texture!\n");
+    state->renderer.bindless = false;
+  }
+  if (state->renderer.bindless) {
+    enabledFeatures.features.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+    enabled_features_12.runtimeDescriptorArray = VK_TRUE;
+    enabled_features_12.descriptorBindingPartiallyBound = VK_TRUE;
+    enabled_features_12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    enabledFeatures.pNext = &enabled_features_12;
+  }
+  bool chain_12 = state->renderer.gpu_driven || state->renderer.bindless;
+
   EXPECT(
       vkCreateDevice(
           state->vk_core.physical_device,
           &(VkDeviceCreateInfo){
               .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+              // Features2 needs 1.1, so it's only chained for the 1.2 path
+              .pNext = chain_12 ? &enabledFeatures : NULL,
               .pQueueCreateInfos =
                   &(VkDeviceQueueCreateInfo){
                       .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
@@ -115,7 +273,8 @@ void create_device(State *state) {
               .enabledExtensionCount = 1,
               .ppEnabledExtensionNames =
                   &(const char *){VK_KHR_SWAPCHAIN_EXTENSION_NAME},
-              .pEnabledFeatures = &enabledFeatures,
+              .pEnabledFeatures =
+                  chain_12 ? NULL : &enabledFeatures.features,
           },
           state->vk_core.allocator, &state->vk_core.device),
       "failed to create device and queues")
@@ -127,6 +286,9 @@ void get_queue(State *state) {
 }
 
 void init_vk(Settings *settings, State *state) {
+  // Driver memory counts as renderer memory unless a subsystem passes its own
+  // kuta_vk_allocator
+  state->vk_core.allocator = kuta_vk_allocator(KUTA_MEMORY_RENDERER);
   create_instance(state, settings);
   select_physical_device(state);
   create_surface(state);
@@ -1,9 +1,11 @@
 #include <cglm/cglm.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
+#include "allocator.h"
 #include "buffer_data.h"
 #include "descriptors.h"
 #include "internal_types.h"
@@ -11,6 +13,10 @@
 #include "texture_data.h"
 #include "utils.h"
 
+// Bytes a frame's uniform ring starts with, it doubles whenever a frame needs
+// more
+#define UNIFORM_RING_INITIAL_SIZE (256u << 10)
+
 VkVertexInputBindingDescription get_binding_description() {
   VkVertexInputBindingDescription binding_description = {
       .binding = 0,
@@ -64,7 +70,8 @@ uint32_t find_memory_type(uint32_t type_filter,
 }
 
 void alloc_buffer(VkBuffer *buffer, VkDeviceMemory *buffer_memory,
-                  VkMemoryPropertyFlags properties, State *state) {
+                  VkMemoryPropertyFlags properties, KutaMemoryTag tag,
+                  State *state) {
   VkMemoryRequirements mem_requirements;
   vkGetBufferMemoryRequirements(state->vk_core.device, *(buffer),
                                 &mem_requirements);
@@ -76,15 +83,16 @@ void alloc_buffer(VkBuffer *buffer, VkDeviceMemory *buffer_memory,
           find_memory_type(mem_requirements.memoryTypeBits, properties, state),
   };
 
-  EXPECT(vkAllocateMemory(state->vk_core.device, &alloc_info,
-                          state->vk_core.allocator, buffer_memory),
+  EXPECT(allocate_device_memory(state->vk_core.device, &alloc_info, tag,
+                                buffer_memory),
          "Failed to allocate for vertex_buffer_memory")
   vkBindBufferMemory(state->vk_core.device, *(buffer), *(buffer_memory), 0);
 }
 
 void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
                    VkMemoryPropertyFlags properties, VkBuffer *buffer,
-                   VkDeviceMemory *buffer_memory, State *state) {
+                   VkDeviceMemory *buffer_memory, KutaMemoryTag tag,
+                   State *state) {
 
   VkBufferCreateInfo buffer_info = {
       .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
@@ -93,10 +101,10 @@ void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
       .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
   };
   EXPECT(vkCreateBuffer(state->vk_core.device, &buffer_info,
-                        state->vk_core.allocator, buffer),
+                        kuta_vk_allocator(tag), buffer),
          "failed to create vertex buffer!")
 
-  alloc_buffer(buffer, buffer_memory, properties, state);
+  alloc_buffer(buffer, buffer_memory, properties, tag, state);
 }
 
 void copy_buffer(VkDeviceSize size, VkBuffer src_buffer, VkBuffer dst_buffer,
@@ -109,152 +117,260 @@ void copy_buffer(VkDeviceSize size, VkBuffer src_buffer, VkBuffer dst_buffer,
   end_single_time_commands(command_buffer, state);
 }
 
-void create_vertex_buffer(State *state, BufferData *buffer_data,
-                          Vertex *vertices, size_t vertex_count,
-                          VkBuffer *vertex_buffer,
-                          VkDeviceMemory *vertex_memory) {
-  VkDeviceSize buffer_size = sizeof(Vertex) * vertex_count;
-
-  create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+// Copies size bytes of data to offset in a device local buffer through a
+// staging buffer, waits until the copy is done
+void upload_buffer(State *state, VkBuffer buffer, VkDeviceSize offset,
+                   const void *data, VkDeviceSize size) {
+  VkBuffer staging_buffer;
+  VkDeviceMemory staging_memory;
+  create_buffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                &buffer_data->staging_buffer,
-                &buffer_data->staging_buffer_memory, state);
+                &staging_buffer, &staging_memory, KUTA_MEMORY_RESOURCES,
+                state);
 
-  void *data;
-  vkMapMemory(state->vk_core.device, buffer_data->staging_buffer_memory, 0,
-              buffer_size, 0, &data);
-  memcpy(data, vertices, buffer_size);
-  vkUnmapMemory(state->vk_core.device, buffer_data->staging_buffer_memory);
+  void *mapped;
+  vkMapMemory(state->vk_core.device, staging_memory, 0, size, 0, &mapped);
+  memcpy(mapped, data, (size_t)size);
+  vkUnmapMemory(state->vk_core.device, staging_memory);
 
-  create_buffer(
-      buffer_size,
-      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertex_buffer, vertex_memory, state);
-
-  copy_buffer(buffer_size, buffer_data->staging_buffer, *vertex_buffer, state);
+  VkCommandBuffer command_buffer = begin_single_time_commands(state);
+  VkBufferCopy copy_region = {
+      .srcOffset = 0,
+      .dstOffset = offset,
+      .size = size,
+  };
+  vkCmdCopyBuffer(command_buffer, staging_buffer, buffer, 1, &copy_region);
+  end_single_time_commands(command_buffer, state);
 
-  vkDestroyBuffer(state->vk_core.device, buffer_data->staging_buffer,
+  vkDestroyBuffer(state->vk_core.device, staging_buffer,
                   state->vk_core.allocator);
-  vkFreeMemory(state->vk_core.device, buffer_data->staging_buffer_memory,
-               state->vk_core.allocator);
+  free_device_memory(state->vk_core.device, staging_memory);
 }
 
-void create_index_buffer(State *state, BufferData *buffer_data,
-                         uint32_t *indices, size_t indices_count,
-                         VkBuffer *index_buffer, VkDeviceMemory *index_memory) {
-  VkDeviceSize buffer_size = sizeof(indices[0]) * indices_count;
+// Replaces a shared geometry buffer with one of capacity bytes, keeping the
+// first used bytes. Copying waits for the queue to go idle, so nothing reads
+// the old buffer anymore once it's destroyed
+static void grow_geometry_buffer(State *state, VkBuffer *buffer,
+                                 VkDeviceMemory *memory, VkDeviceSize used,
+                                 VkDeviceSize capacity,
+                                 VkBufferUsageFlags usage) {
+  VkBuffer old_buffer = *buffer;
+  VkDeviceMemory old_memory = *memory;
+
+  create_buffer(capacity,
+                usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                    VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory,
+                KUTA_MEMORY_RESOURCES, state);
+  if (old_buffer == VK_NULL_HANDLE)
+    return;
 
-  create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                &buffer_data->staging_buffer,
-                &buffer_data->staging_buffer_memory, state);
+  if (used > 0)
+    copy_buffer(used, old_buffer, *buffer, state);
+  vkDestroyBuffer(state->vk_core.device, old_buffer, state->vk_core.allocator);
+  free_device_memory(state->vk_core.device, old_memory);
+}
 
-  void *data;
-  vkMapMemory(state->vk_core.device, buffer_data->staging_buffer_memory, 0,
-              buffer_size, 0, &data);
-  memcpy(data, indices, (size_t)buffer_size);
-  vkUnmapMemory(state->vk_core.device, buffer_data->staging_buffer_memory);
+static uint32_t geometry_capacity(uint32_t capacity, uint32_t count) {
+  capacity = capacity ? capacity : 1024;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  return capacity;
+}
 
-  create_buffer(
-      buffer_size,
-      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, index_buffer, index_memory, state);
+// Appends the geometry's vertices and indices to the shared buffers and
+// records where they went in it. The buffers double whenever they're full
+void upload_geometry(State *state, GeometryBuffer *buffer,
+                     GeometryData *geometry) {
+  uint32_t vertex_count = buffer->vertex_count + geometry->vertex_count;
+  uint32_t index_count = buffer->index_count + geometry->index_count;
+
+  if (vertex_count > buffer->vertex_capacity) {
+    uint32_t capacity =
+        geometry_capacity(buffer->vertex_capacity, vertex_count);
+    grow_geometry_buffer(state, &buffer->vertices, &buffer->vertex_memory,
+                         sizeof(Vertex) * buffer->vertex_count,
+                         sizeof(Vertex) * capacity,
+                         VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    buffer->vertex_capacity = capacity;
+  }
+  if (index_count > buffer->index_capacity) {
+    uint32_t capacity = geometry_capacity(buffer->index_capacity, index_count);
+    grow_geometry_buffer(state, &buffer->indices, &buffer->index_memory,
+                         sizeof(uint32_t) * buffer->index_count,
+                         sizeof(uint32_t) * capacity,
+                         VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+    buffer->index_capacity = capacity;
+  }
+
+  geometry->vertex_offset = (int32_t)buffer->vertex_count;
+  geometry->first_index = buffer->index_count;
+  upload_buffer(state, buffer->vertices,
+                sizeof(Vertex) * buffer->vertex_count, geometry->vertices,
+                sizeof(Vertex) * geometry->vertex_count);
+  upload_buffer(state, buffer->indices,
+                sizeof(uint32_t) * buffer->index_count, geometry->indices,
+                sizeof(uint32_t) * geometry->index_count);
+  buffer->vertex_count = vertex_count;
+  buffer->index_count = index_count;
+}
 
-  copy_buffer(buffer_size, buffer_data->staging_buffer, *index_buffer, state);
+void destroy_geometry_buffer(State *state, GeometryBuffer *buffer) {
+  if (buffer->vertices != VK_NULL_HANDLE)
+    vkDestroyBuffer(state->vk_core.device, buffer->vertices,
+                    state->vk_core.allocator);
+  free_device_memory(state->vk_core.device, buffer->vertex_memory);
 
-  vkDestroyBuffer(state->vk_core.device, buffer_data->staging_buffer,
-                  state->vk_core.allocator);
-  vkFreeMemory(state->vk_core.device, buffer_data->staging_buffer_memory,
-               state->vk_core.allocator);
+  if (buffer->indices != VK_NULL_HANDLE)
+    vkDestroyBuffer(state->vk_core.device, buffer->indices,
+                    state->vk_core.allocator);
+  free_device_memory(state->vk_core.device, buffer->index_memory);
+  memset(buffer, 0, sizeof(GeometryBuffer));
+}
+
+// Every draw reads from the shared buffers, so they're bound once and draws
+// only differ in their offsets
+void bind_geometry_buffer(const GeometryBuffer *buffer,
+                          VkCommandBuffer command_buffer) {
+  VkDeviceSize offset = 0;
+  vkCmdBindVertexBuffers(command_buffer, 0, 1, &buffer->vertices, &offset);
+  vkCmdBindIndexBuffer(command_buffer, buffer->indices, 0,
+                       VK_INDEX_TYPE_UINT32);
+}
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static void create_uniform_ring(State *state, uint32_t frame,
+                                VkDeviceSize capacity) {
+  UniformRing *ring = &state->renderer.uniform_rings[frame];
+  // The GPU-driven path also stages its uploads in the ring
+  create_buffer(capacity,
+                VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                    VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                &ring->buffer, &ring->memory, KUTA_MEMORY_RENDERER, state);
+
+  vkMapMemory(state->vk_core.device, ring->memory, 0, VK_WHOLE_SIZE, 0,
+              (void **)&ring->mapped);
+  ring->capacity = capacity;
+  ring->used = 0;
 }
 
-void create_uniform_buffers(State *state, BufferData *buffer_data) {
-  VkDeviceSize buffer_size = sizeof(UBO);
+static void destroy_uniform_ring(UniformRing *ring, State *state) {
+  if (ring->buffer != VK_NULL_HANDLE) {
+    vkDestroyBuffer(state->vk_core.device, ring->buffer,
+                    state->vk_core.allocator);
+  }
+  free_device_memory(state->vk_core.device, ring->memory);
+  memset(ring, 0, sizeof(UniformRing));
+}
+
+// Sub-allocations are aligned for both uniform and storage buffer offsets,
+// and at least for the cglm types written into them
+void create_uniform_rings(State *state) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(state->vk_core.physical_device, &properties);
+  VkDeviceSize alignment = 16;
+  if (properties.limits.minUniformBufferOffsetAlignment > alignment)
+    alignment = properties.limits.minUniformBufferOffsetAlignment;
+  if (properties.limits.minStorageBufferOffsetAlignment > alignment)
+    alignment = properties.limits.minStorageBufferOffsetAlignment;
+  state->renderer.uniform_alignment = alignment;
 
   for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-    create_buffer(buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                  &buffer_data->uniform_buffers[i],
-                  &buffer_data->uniform_buffers_memory[i], state);
-
-    vkMapMemory(state->vk_core.device, buffer_data->uniform_buffers_memory[i],
-                0, buffer_size, 0, &buffer_data->uniform_buffers_mapped[i]);
+    create_uniform_ring(state, i, UNIFORM_RING_INITIAL_SIZE);
   }
 }
-void destroy_uniform_buffers(BufferData *buffer_data, State *state) {
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-    vkDestroyBuffer(state->vk_core.device, buffer_data->uniform_buffers[i],
-                    state->vk_core.allocator);
-    vkFreeMemory(state->vk_core.device, buffer_data->uniform_buffers_memory[i],
-                 state->vk_core.allocator);
+
+void destroy_uniform_rings(State *state) {
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    destroy_uniform_ring(&state->renderer.uniform_rings[i], state);
   }
 }
 
-void create_lighting_buffers(State *state) {
-  VkDeviceSize buffer_size = sizeof(LightingUBO);
+// Starts the frame's sub-allocations over, only call once its fence
+// signalled
+void uniform_ring_reset(State *state, uint32_t frame) {
+  state->renderer.uniform_rings[frame].used = 0;
+}
 
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-    create_buffer(buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                  &state->renderer.lighting_buffers[i],
-                  &state->renderer.lighting_memory[i], state);
+// Makes room for size more bytes in the frame's ring, what was allocated so
+// far is copied over. Returns true when the buffer was replaced and the
+// frame's descriptor sets have to be written again, which has to happen
+// before the frame's command buffer binds them
+bool uniform_ring_reserve(State *state, uint32_t frame, VkDeviceSize size) {
+  UniformRing *ring = &state->renderer.uniform_rings[frame];
+  VkDeviceSize needed =
+      align_up(ring->used, state->renderer.uniform_alignment) + size;
+  if (needed <= ring->capacity)
+    return false;
+
+  VkDeviceSize capacity = ring->capacity;
+  while (capacity < needed) {
+    capacity *= 2;
   }
+
+  UniformRing old = *ring;
+  create_uniform_ring(state, frame, capacity);
+  memcpy(ring->mapped, old.mapped, old.used);
+  ring->used = old.used;
+  destroy_uniform_ring(&old, state);
+  return true;
 }
 
-void destroy_lighting_buffers(State *state) {
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-    if (state->renderer.lighting_buffers[i] != VK_NULL_HANDLE) {
-      vkDestroyBuffer(state->vk_core.device,
-                      state->renderer.lighting_buffers[i],
-                      state->vk_core.allocator);
-    }
-    if (state->renderer.lighting_memory[i] != VK_NULL_HANDLE) {
-      vkFreeMemory(state->vk_core.device, state->renderer.lighting_memory[i],
-                   state->vk_core.allocator);
-    }
+// Bytes an allocation of size takes up in a ring, what a frame reserves is
+// the sum of these
+VkDeviceSize uniform_ring_span(const State *state, VkDeviceSize size) {
+  return align_up(size, state->renderer.uniform_alignment);
+}
+
+// Sub-allocates size bytes of the frame's ring and writes where they start
+// to offset. Returns NULL when the ring is full
+void *uniform_ring_alloc(State *state, uint32_t frame, VkDeviceSize size,
+                         uint32_t *offset) {
+  UniformRing *ring = &state->renderer.uniform_rings[frame];
+  VkDeviceSize start = align_up(ring->used, state->renderer.uniform_alignment);
+  if (start + size > ring->capacity) {
+    printf("Error: Uniform ring of frame %u is full!\n", frame);
+    return NULL;
   }
+
+  ring->used = start + size;
+  *offset = (uint32_t)start;
+  return ring->mapped + start;
 }
 
-void update_camera_uniform_buffer(World *world, BufferData *buffer_data,
-                                  State *state, uint32_t current_image) {
-  CameraComponent *camera = get_active_camera(world);
-  if (!camera)
+void update_camera_uniform_buffer(World *world, State *state,
+                                  uint32_t frame) {
+  UBO *ubo =
+      uniform_ring_alloc(state, frame, sizeof(UBO),
+                         &state->renderer.scene_offsets[SCENE_OFFSET_CAMERA]);
+  if (!ubo)
     return;
 
-  typedef struct {
-    mat4 view;
-    mat4 proj;
-  } CameraUBO;
-
-  CameraUBO ubo;
-  glm_mat4_copy(camera->view, ubo.view);
-  glm_mat4_copy(camera->projection, ubo.proj);
-
-  void *data;
-  vkMapMemory(state->vk_core.device,
-              buffer_data->uniform_buffers_memory[current_image], 0,
-              sizeof(CameraUBO), 0, &data);
-  memcpy(data, &ubo, sizeof(CameraUBO));
-  vkUnmapMemory(state->vk_core.device,
-                buffer_data->uniform_buffers_memory[current_image]);
+  CameraComponent *camera = get_active_camera(world);
+  if (camera) {
+    glm_mat4_copy(camera->view, ubo->view);
+    glm_mat4_copy(camera->projection, ubo->proj);
+  } else {
+    glm_mat4_identity(ubo->view);
+    glm_mat4_identity(ubo->proj);
+  }
 }
 
 void update_lighting_uniform_buffer(World *world, State *state,
-                                    uint32_t current_image) {
-  LightingUBO lighting_ubo;
-  lighting_system_gather(world, &lighting_ubo);
-
-  void *data;
-  vkMapMemory(state->vk_core.device,
-              state->renderer.lighting_memory[current_image], 0,
-              sizeof(LightingUBO), 0, &data);
-  memcpy(data, &lighting_ubo, sizeof(LightingUBO));
-  vkUnmapMemory(state->vk_core.device,
-                state->renderer.lighting_memory[current_image]);
+                                    uint32_t frame) {
+  LightingUBO *lighting_ubo = uniform_ring_alloc(
+      state, frame, sizeof(LightingUBO),
+      &state->renderer.scene_offsets[SCENE_OFFSET_LIGHTING]);
+  if (lighting_ubo)
+    lighting_system_gather(world, lighting_ubo);
 }
 
 VkFormat find_supported_format(VkFormat *candidates, size_t candidate_count,
@@ -292,15 +408,40 @@ bool has_stencil_component(VkFormat format) {
          format == VK_FORMAT_D24_UNORM_S8_UINT;
 }
 
+// The depth pyramid of occlusion culling is built by sampling the depth
+// attachment, which not every format and sample count allows
+static bool can_sample_depth(State *state, VkFormat depth_format) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(state->vk_core.physical_device, &properties);
+  VkFormatProperties format_properties;
+  vkGetPhysicalDeviceFormatProperties(state->vk_core.physical_device,
+                                      depth_format, &format_properties);
+
+  return (format_properties.optimalTilingFeatures &
+          VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) &&
+         (properties.limits.sampledImageDepthSampleCounts &
+          state->renderer.msaa_samples);
+}
+
 void create_depth_resources(State *state, uint32_t mip_levels) {
   VkFormat depth_format = find_depth_format(state);
+  VkImageUsageFlags usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+
+  if (state->renderer.occlusion_culling) {
+    if (can_sample_depth(state, depth_format)) {
+      usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+    } else {
+      printf("Error: Depth can't be sampled, occlusion culling is off!\n");
+      state->renderer.occlusion_culling = false;
+    }
+  }
 
   create_image(
       state->swp_ch.extent.width, state->swp_ch.extent.height, depth_format,
-      VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+      VK_IMAGE_TILING_OPTIMAL, usage,
       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &state->renderer.depth_image,
       &state->renderer.depth_image_memory, mip_levels,
-      state->renderer.msaa_samples, state);
+      state->renderer.msaa_samples, KUTA_MEMORY_SWAPCHAIN, state);
 
   state->renderer.depth_image_view =
       create_image_view(state->renderer.depth_image, depth_format,
@@ -16,35 +16,42 @@ AttributeDescriptions get_attribute_descriptions(void);
 uint32_t find_memory_type(uint32_t type_filter,
                           VkMemoryPropertyFlags properties, State *state);
 
-void create_vertex_buffer(State *state, BufferData *buffer_data,
-                          Vertex *vertices, size_t vertex_count,
-                          VkBuffer *vertex_buffer,
-                          VkDeviceMemory *vertex_memory);
+void upload_buffer(State *state, VkBuffer buffer, VkDeviceSize offset,
+                   const void *data, VkDeviceSize size);
 
-void create_index_buffer(State *state, BufferData *buffer_data,
-                         uint32_t *indices, size_t indices_count,
-                         VkBuffer *index_buffer, VkDeviceMemory *index_memory);
+void upload_geometry(State *state, GeometryBuffer *buffer,
+                     GeometryData *geometry);
 
-void create_uniform_buffers(State *state, BufferData *buffer_data);
+void destroy_geometry_buffer(State *state, GeometryBuffer *buffer);
 
-void create_lighting_buffers(State *state);
+void bind_geometry_buffer(const GeometryBuffer *buffer,
+                          VkCommandBuffer command_buffer);
 
-void destroy_lighting_buffers(State *state);
+void create_uniform_rings(State *state);
+
+void destroy_uniform_rings(State *state);
+
+void uniform_ring_reset(State *state, uint32_t frame);
+
+bool uniform_ring_reserve(State *state, uint32_t frame, VkDeviceSize size);
+
+VkDeviceSize uniform_ring_span(const State *state, VkDeviceSize size);
+
+void *uniform_ring_alloc(State *state, uint32_t frame, VkDeviceSize size,
+                         uint32_t *offset);
 
 bool has_stencil_component(VkFormat format);
 
 void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
                    VkMemoryPropertyFlags properties, VkBuffer *buffer,
-                   VkDeviceMemory *buffer_memory, State *state);
+                   VkDeviceMemory *buffer_memory, KutaMemoryTag tag,
+                   State *state);
 
 void create_depth_resources(State *state, uint32_t mip_levels);
 
 VkFormat find_depth_format(State *state);
 
-void destroy_uniform_buffers(BufferData *buffer_data, State *state);
-
-void update_camera_uniform_buffer(World *world, BufferData *buffer_data,
-                                  State *state, uint32_t current_image);
+void update_camera_uniform_buffer(World *world, State *state, uint32_t frame);
 
 void update_lighting_uniform_buffer(World *world, State *state,
-                                    uint32_t current_image);
+                                    uint32_t frame);
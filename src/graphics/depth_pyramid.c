@@ -0,0 +1,472 @@
+#include <cglm/cglm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "allocator.h"
+#include "arena.h"
+#include "buffer_data.h"
+#include "depth_pyramid.h"
+#include "internal_types.h"
+#include "texture_data.h"
+#include "utils.h"
+
+// Matches local_size_x and local_size_y of the pyramid shaders
+#define PYRAMID_GROUP_SIZE 8
+
+// Descriptor bindings of pyramid_copy.comp and pyramid_reduce.comp, the copy
+// reads the depth attachment and every further level reads the one before
+enum {
+  PYRAMID_BINDING_DEPTH,
+  PYRAMID_BINDING_SOURCE,
+  PYRAMID_BINDING_DESTINATION,
+  PYRAMID_BINDING_COUNT,
+};
+
+typedef struct {
+  uint32_t source_size[2];
+  uint32_t destination_size[2];
+  uint32_t samples;
+} PyramidPushConstants;
+
+static uint32_t previous_power_of_two(uint32_t value) {
+  uint32_t power = 1;
+  while (power * 2 <= value) {
+    power *= 2;
+  }
+  return power;
+}
+
+static uint32_t level_size(uint32_t size, uint32_t level) {
+  return size >> level ? size >> level : 1;
+}
+
+static VkImageMemoryBarrier pyramid_barrier(VkImage image,
+                                            VkImageAspectFlags aspect,
+                                            uint32_t base_level,
+                                            uint32_t level_count,
+                                            VkImageLayout old_layout,
+                                            VkImageLayout new_layout,
+                                            VkAccessFlags src_access,
+                                            VkAccessFlags dst_access) {
+  return (VkImageMemoryBarrier){
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .oldLayout = old_layout,
+      .newLayout = new_layout,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = image,
+      .subresourceRange.aspectMask = aspect,
+      .subresourceRange.baseMipLevel = base_level,
+      .subresourceRange.levelCount = level_count,
+      .subresourceRange.baseArrayLayer = 0,
+      .subresourceRange.layerCount = 1,
+      .srcAccessMask = src_access,
+      .dstAccessMask = dst_access,
+  };
+}
+
+static bool create_pyramid_pipeline(State *state, const char *path,
+                                    VkPipeline *pipeline) {
+  size_t shader_size;
+  const uint32_t *shader_src = read_file(path, &shader_size);
+  if (!shader_src)
+    return false;
+
+  VkShaderModule shader_module;
+  EXPECT(vkCreateShaderModule(
+             state->vk_core.device,
+             &(VkShaderModuleCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+                 .pCode = shader_src,
+                 .codeSize = shader_size,
+             },
+             state->vk_core.allocator, &shader_module),
+         "Failed to create depth pyramid shader module")
+
+  VkPipelineShaderStageCreateInfo shader_stage = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+      .module = shader_module,
+      .pName = "main",
+  };
+
+  EXPECT(vkCreateComputePipelines(
+             state->vk_core.device, NULL, 1,
+             &(VkComputePipelineCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+                 .stage = shader_stage,
+                 .layout = state->renderer.culling.pyramid.pipeline_layout,
+             },
+             state->vk_core.allocator, pipeline),
+         "Failed to create depth pyramid pipeline")
+
+  vkDestroyShaderModule(state->vk_core.device, shader_module,
+                        state->vk_core.allocator);
+  temp_free((void *)shader_src);
+  return true;
+}
+
+static void create_pyramid_layout(State *state) {
+  DepthPyramid *pyramid = &state->renderer.culling.pyramid;
+
+  VkDescriptorSetLayoutBinding bindings[PYRAMID_BINDING_COUNT];
+  for (uint32_t i = 0; i < PYRAMID_BINDING_COUNT; i++) {
+    bindings[i] = (VkDescriptorSetLayoutBinding){
+        .binding = i,
+        .descriptorType = i == PYRAMID_BINDING_DEPTH
+                              ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+                              : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+  }
+
+  EXPECT(vkCreateDescriptorSetLayout(
+             state->vk_core.device,
+             &(VkDescriptorSetLayoutCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                 .bindingCount = PYRAMID_BINDING_COUNT,
+                 .pBindings = bindings,
+             },
+             state->vk_core.allocator, &pyramid->descriptor_set_layout),
+         "Failed to create depth pyramid descriptor set layout")
+
+  EXPECT(vkCreatePipelineLayout(
+             state->vk_core.device,
+             &(VkPipelineLayoutCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                 .setLayoutCount = 1,
+                 .pSetLayouts = &pyramid->descriptor_set_layout,
+                 .pushConstantRangeCount = 1,
+                 .pPushConstantRanges =
+                     &(VkPushConstantRange){
+                         .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                         .size = sizeof(PyramidPushConstants),
+                     },
+             },
+             state->vk_core.allocator, &pyramid->pipeline_layout),
+         "Failed to create depth pyramid pipeline layout")
+
+  VkDescriptorPoolSize pool_sizes[] = {
+      {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, DEPTH_PYRAMID_MAX_LEVELS},
+      {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2 * DEPTH_PYRAMID_MAX_LEVELS},
+  };
+  EXPECT(vkCreateDescriptorPool(
+             state->vk_core.device,
+             &(VkDescriptorPoolCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+                 .poolSizeCount = sizeof(pool_sizes) / sizeof(pool_sizes[0]),
+                 .pPoolSizes = pool_sizes,
+                 .maxSets = DEPTH_PYRAMID_MAX_LEVELS,
+             },
+             state->vk_core.allocator, &pyramid->descriptor_pool),
+         "Failed to create depth pyramid descriptor pool")
+
+  for (uint32_t i = 0; i < DEPTH_PYRAMID_MAX_LEVELS; i++) {
+    EXPECT(vkAllocateDescriptorSets(
+               state->vk_core.device,
+               &(VkDescriptorSetAllocateInfo){
+                   .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                   .descriptorPool = pyramid->descriptor_pool,
+                   .descriptorSetCount = 1,
+                   .pSetLayouts = &pyramid->descriptor_set_layout,
+               },
+               &pyramid->level_sets[i]),
+           "Failed to allocate depth pyramid descriptor set %u", i)
+  }
+
+  // The cull shader fetches exact texels, it never filters
+  EXPECT(vkCreateSampler(state->vk_core.device,
+                         &(VkSamplerCreateInfo){
+                             .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+                             .magFilter = VK_FILTER_NEAREST,
+                             .minFilter = VK_FILTER_NEAREST,
+                             .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+                             .addressModeU =
+                                 VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                             .addressModeV =
+                                 VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                             .addressModeW =
+                                 VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                             .maxLod = VK_LOD_CLAMP_NONE,
+                         },
+                         state->vk_core.allocator, &pyramid->sampler),
+         "Failed to create depth pyramid sampler")
+}
+
+static void write_pyramid_descriptors(State *state) {
+  DepthPyramid *pyramid = &state->renderer.culling.pyramid;
+
+  for (uint32_t level = 0; level < pyramid->level_count; level++) {
+    VkDescriptorImageInfo source = {
+        .sampler = pyramid->sampler,
+        .imageView = state->renderer.depth_image_view,
+        .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+    };
+    uint32_t source_binding = PYRAMID_BINDING_DEPTH;
+    if (level > 0) {
+      source = (VkDescriptorImageInfo){
+          .imageView = pyramid->level_views[level - 1],
+          .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+      };
+      source_binding = PYRAMID_BINDING_SOURCE;
+    }
+    VkDescriptorImageInfo destination = {
+        .imageView = pyramid->level_views[level],
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+
+    VkWriteDescriptorSet descriptor_writes[2] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = pyramid->level_sets[level],
+            .dstBinding = source_binding,
+            .descriptorType = level > 0
+                                  ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                                  : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .pImageInfo = &source,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = pyramid->level_sets[level],
+            .dstBinding = PYRAMID_BINDING_DESTINATION,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .descriptorCount = 1,
+            .pImageInfo = &destination,
+        },
+    };
+    vkUpdateDescriptorSets(state->vk_core.device, 2, descriptor_writes, 0,
+                           NULL);
+  }
+}
+
+// Sizes the pyramid after the depth attachment, which has to exist already
+static void create_pyramid_images(State *state) {
+  DepthPyramid *pyramid = &state->renderer.culling.pyramid;
+
+  pyramid->width = previous_power_of_two(state->swp_ch.extent.width);
+  pyramid->height = previous_power_of_two(state->swp_ch.extent.height);
+  pyramid->level_count = 1;
+  for (uint32_t size = glm_max(pyramid->width, pyramid->height);
+       size > 1 && pyramid->level_count < DEPTH_PYRAMID_MAX_LEVELS;
+       size /= 2) {
+    pyramid->level_count++;
+  }
+
+  VkFormat depth_format = find_depth_format(state);
+  pyramid->depth_aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+  if (has_stencil_component(depth_format))
+    pyramid->depth_aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+
+  create_image(pyramid->width, pyramid->height, VK_FORMAT_R32_SFLOAT,
+               VK_IMAGE_TILING_OPTIMAL,
+               VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &pyramid->image,
+               &pyramid->memory, pyramid->level_count, VK_SAMPLE_COUNT_1_BIT,
+               KUTA_MEMORY_RENDERER, state);
+  pyramid->view =
+      create_image_view(pyramid->image, VK_FORMAT_R32_SFLOAT,
+                        VK_IMAGE_ASPECT_COLOR_BIT, pyramid->level_count, state);
+
+  for (uint32_t level = 0; level < pyramid->level_count; level++) {
+    EXPECT(vkCreateImageView(
+               state->vk_core.device,
+               &(VkImageViewCreateInfo){
+                   .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                   .image = pyramid->image,
+                   .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                   .format = VK_FORMAT_R32_SFLOAT,
+                   .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                   .subresourceRange.baseMipLevel = level,
+                   .subresourceRange.levelCount = 1,
+                   .subresourceRange.layerCount = 1,
+               },
+               state->vk_core.allocator, &pyramid->level_views[level]),
+           "Failed to create depth pyramid level view %u", level)
+  }
+
+  // The pyramid stays in the general layout, it's written and sampled
+  VkCommandBuffer command_buffer = begin_single_time_commands(state);
+  VkImageMemoryBarrier barrier = pyramid_barrier(
+      pyramid->image, VK_IMAGE_ASPECT_COLOR_BIT, 0, pyramid->level_count,
+      VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0,
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0,
+                       NULL, 1, &barrier);
+  end_single_time_commands(command_buffer, state);
+
+  write_pyramid_descriptors(state);
+  pyramid->valid = false;
+}
+
+static void destroy_pyramid_images(State *state) {
+  DepthPyramid *pyramid = &state->renderer.culling.pyramid;
+
+  for (uint32_t level = 0; level < pyramid->level_count; level++) {
+    vkDestroyImageView(state->vk_core.device, pyramid->level_views[level],
+                       state->vk_core.allocator);
+    pyramid->level_views[level] = VK_NULL_HANDLE;
+  }
+  if (pyramid->view != VK_NULL_HANDLE)
+    vkDestroyImageView(state->vk_core.device, pyramid->view,
+                       state->vk_core.allocator);
+  if (pyramid->image != VK_NULL_HANDLE)
+    vkDestroyImage(state->vk_core.device, pyramid->image,
+                   state->vk_core.allocator);
+  free_device_memory(state->vk_core.device, pyramid->memory);
+
+  pyramid->view = VK_NULL_HANDLE;
+  pyramid->image = VK_NULL_HANDLE;
+  pyramid->memory = VK_NULL_HANDLE;
+  pyramid->level_count = 0;
+  pyramid->valid = false;
+}
+
+// Sets up the pipelines and images of the depth pyramid. Returns false when
+// its shaders are missing, occlusion culling can't run then
+bool create_depth_pyramid(State *state) {
+  DepthPyramid *pyramid = &state->renderer.culling.pyramid;
+  const char *copy_path = state->renderer.msaa_samples > VK_SAMPLE_COUNT_1_BIT
+                              ? "./assets/shaders/pyramid_copy_ms.spv"
+                              : "./assets/shaders/pyramid_copy.spv";
+
+  create_pyramid_layout(state);
+  if (!create_pyramid_pipeline(state, copy_path, &pyramid->copy_pipeline) ||
+      !create_pyramid_pipeline(state, "./assets/shaders/pyramid_reduce.spv",
+                               &pyramid->reduce_pipeline)) {
+    destroy_depth_pyramid(state);
+    return false;
+  }
+
+  create_pyramid_images(state);
+  return true;
+}
+
+// Follows the depth attachment to its new size, call once the swapchain's
+// depth resources were recreated and the device is idle
+void resize_depth_pyramid(State *state) {
+  destroy_pyramid_images(state);
+  create_pyramid_images(state);
+}
+
+void destroy_depth_pyramid(State *state) {
+  DepthPyramid *pyramid = &state->renderer.culling.pyramid;
+
+  destroy_pyramid_images(state);
+  vkDestroySampler(state->vk_core.device, pyramid->sampler,
+                   state->vk_core.allocator);
+  vkDestroyDescriptorPool(state->vk_core.device, pyramid->descriptor_pool,
+                          state->vk_core.allocator);
+  vkDestroyPipeline(state->vk_core.device, pyramid->copy_pipeline,
+                    state->vk_core.allocator);
+  vkDestroyPipeline(state->vk_core.device, pyramid->reduce_pipeline,
+                    state->vk_core.allocator);
+  vkDestroyPipelineLayout(state->vk_core.device, pyramid->pipeline_layout,
+                          state->vk_core.allocator);
+  vkDestroyDescriptorSetLayout(state->vk_core.device,
+                               pyramid->descriptor_set_layout,
+                               state->vk_core.allocator);
+  memset(pyramid, 0, sizeof(DepthPyramid));
+}
+
+static void dispatch_level(DepthPyramid *pyramid, VkCommandBuffer cmd_buffer,
+                           uint32_t level,
+                           const PyramidPushConstants *push_constants) {
+  uint32_t width = push_constants->destination_size[0];
+  uint32_t height = push_constants->destination_size[1];
+
+  vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          pyramid->pipeline_layout, 0, 1,
+                          &pyramid->level_sets[level], 0, NULL);
+  vkCmdPushConstants(cmd_buffer, pyramid->pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                     sizeof(PyramidPushConstants), push_constants);
+  vkCmdDispatch(cmd_buffer,
+                (width + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE,
+                (height + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE, 1);
+}
+
+// Rebuilds the pyramid from the depth the frame drew so far. Has to be
+// recorded between render passes, the depth attachment is back in its
+// attachment layout afterwards
+void depth_pyramid_build(State *state, VkCommandBuffer cmd_buffer,
+                         mat4 view_projection) {
+  DepthPyramid *pyramid = &state->renderer.culling.pyramid;
+  VkImage depth_image = state->renderer.depth_image;
+
+  // The early cull phase read the pyramid this overwrites
+  VkImageMemoryBarrier to_build[2] = {
+      pyramid_barrier(depth_image, pyramid->depth_aspect, 0, 1,
+                      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                      VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+                      VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                      VK_ACCESS_SHADER_READ_BIT),
+      pyramid_barrier(pyramid->image, VK_IMAGE_ASPECT_COLOR_BIT, 0,
+                      pyramid->level_count, VK_IMAGE_LAYOUT_GENERAL,
+                      VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_READ_BIT,
+                      VK_ACCESS_SHADER_WRITE_BIT),
+  };
+  vkCmdPipelineBarrier(cmd_buffer,
+                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                           VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0,
+                       NULL, 2, to_build);
+
+  PyramidPushConstants push_constants = {
+      .source_size = {state->swp_ch.extent.width,
+                      state->swp_ch.extent.height},
+      .destination_size = {pyramid->width, pyramid->height},
+      .samples = (uint32_t)state->renderer.msaa_samples,
+  };
+  vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    pyramid->copy_pipeline);
+  dispatch_level(pyramid, cmd_buffer, 0, &push_constants);
+
+  vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    pyramid->reduce_pipeline);
+  for (uint32_t level = 1; level < pyramid->level_count; level++) {
+    VkImageMemoryBarrier barrier = pyramid_barrier(
+        pyramid->image, VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 1,
+        VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+        VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+    vkCmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0,
+                         NULL, 1, &barrier);
+
+    push_constants = (PyramidPushConstants){
+        .source_size = {level_size(pyramid->width, level - 1),
+                        level_size(pyramid->height, level - 1)},
+        .destination_size = {level_size(pyramid->width, level),
+                             level_size(pyramid->height, level)},
+    };
+    dispatch_level(pyramid, cmd_buffer, level, &push_constants);
+  }
+
+  // The late cull phase samples every level, the late render pass draws
+  // into the depth again
+  VkImageMemoryBarrier to_use[2] = {
+      pyramid_barrier(pyramid->image, VK_IMAGE_ASPECT_COLOR_BIT, 0,
+                      pyramid->level_count, VK_IMAGE_LAYOUT_GENERAL,
+                      VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_WRITE_BIT,
+                      VK_ACCESS_SHADER_READ_BIT),
+      pyramid_barrier(depth_image, pyramid->depth_aspect, 0, 1,
+                      VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+                      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 0,
+                      VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT),
+  };
+  vkCmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                           VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                           VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                       0, 0, NULL, 0, NULL, 2, to_use);
+
+  glm_mat4_copy(view_projection, pyramid->view_projection);
+  pyramid->valid = true;
+}
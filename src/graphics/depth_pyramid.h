@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cglm/cglm.h>
+#include <stdbool.h>
+
+#include "internal_types.h"
+
+bool create_depth_pyramid(State *state);
+
+void resize_depth_pyramid(State *state);
+
+void destroy_depth_pyramid(State *state);
+
+void depth_pyramid_build(State *state, VkCommandBuffer cmd_buffer,
+                         mat4 view_projection);
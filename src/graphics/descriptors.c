@@ -4,14 +4,16 @@
 #include <stdint.h>
 #include <vulkan/vulkan_core.h>
 
+#include "allocator.h"
+#include "arena.h"
 #include "descriptors.h"
 #include "utils.h"
 
 void create_descriptor_set_layout(State *state) {
-  // Binding 0: Camera UBO (Vertex Shader)
+  // Binding 0: Camera UBO (Vertex Shader), offset into the frame's ring
   VkDescriptorSetLayoutBinding ubo_layout_binding = {
       .binding = 0,
-      .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+      .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
       .descriptorCount = 1,
       .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
       .pImmutableSamplers = NULL,
@@ -26,21 +28,32 @@ void create_descriptor_set_layout(State *state) {
       .pImmutableSamplers = NULL,
   };
 
-  // Binding 2: Lighting UBO (Fragment Shader)
+  // Binding 2: Lighting UBO (Fragment Shader), offset into the frame's ring
   VkDescriptorSetLayoutBinding lighting_layout_binding = {
       .binding = 2,
-      .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+      .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
       .descriptorCount = 1,
       .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
       .pImmutableSamplers = NULL,
   };
 
-  VkDescriptorSetLayoutBinding bindings[3] = {
-      ubo_layout_binding, sampler_layout_binding, lighting_layout_binding};
+  // Binding 3: Instance data (Vertex Shader)
+  VkDescriptorSetLayoutBinding instance_layout_binding = {
+      .binding = 3,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 1,
+      .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+      .pImmutableSamplers = NULL,
+  };
+
+  // Bindless mode samples from the texture table in set 1 instead
+  VkDescriptorSetLayoutBinding bindings[4] = {
+      ubo_layout_binding, lighting_layout_binding, instance_layout_binding,
+      sampler_layout_binding};
 
   VkDescriptorSetLayoutCreateInfo layout_info = {
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-      .bindingCount = 3,
+      .bindingCount = state->renderer.bindless ? 3 : 4,
       .pBindings = bindings,
   };
 
@@ -48,34 +61,141 @@ void create_descriptor_set_layout(State *state) {
                                      state->vk_core.allocator,
                                      &state->renderer.descriptor_set_layout),
          "Failed to create descriptor set layout!")
+
+  if (!state->renderer.bindless)
+    return;
+
+  // Texture table: slots without a texture are never sampled, loaded ones
+  // are written while command buffers using the table are pending
+  VkDescriptorBindingFlags table_flags =
+      VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+  VkDescriptorSetLayoutBindingFlagsCreateInfo table_flags_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+      .bindingCount = 1,
+      .pBindingFlags = &table_flags,
+  };
+  VkDescriptorSetLayoutBinding table_binding = {
+      .binding = 0,
+      .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+      .descriptorCount = MAX_BINDLESS_TEXTURES,
+      .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+  };
+
+  EXPECT(vkCreateDescriptorSetLayout(
+             state->vk_core.device,
+             &(VkDescriptorSetLayoutCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                 .pNext = &table_flags_info,
+                 .flags =
+                     VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+                 .bindingCount = 1,
+                 .pBindings = &table_binding,
+             },
+             state->vk_core.allocator, &state->renderer.texture_table_layout),
+         "Failed to create texture table layout!")
 }
 
 void destroy_descriptor_set_layout(State *state) {
   vkDestroyDescriptorSetLayout(state->vk_core.device,
                                state->renderer.descriptor_set_layout,
                                state->vk_core.allocator);
+  if (state->renderer.texture_table_layout != VK_NULL_HANDLE)
+    vkDestroyDescriptorSetLayout(state->vk_core.device,
+                                 state->renderer.texture_table_layout,
+                                 state->vk_core.allocator);
+}
+
+// The table lives as long as the renderer so textures can be written into it
+// whenever they load, before or after renderer_deinit
+void create_texture_table(State *state) {
+  if (!state->renderer.bindless)
+    return;
+
+  EXPECT(vkCreateDescriptorPool(
+             state->vk_core.device,
+             &(VkDescriptorPoolCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+                 .flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+                 .maxSets = 1,
+                 .poolSizeCount = 1,
+                 .pPoolSizes =
+                     &(VkDescriptorPoolSize){
+                         .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         .descriptorCount = MAX_BINDLESS_TEXTURES,
+                     },
+             },
+             state->vk_core.allocator, &state->renderer.texture_table_pool),
+         "Failed to create texture table pool!")
+
+  EXPECT(vkAllocateDescriptorSets(
+             state->vk_core.device,
+             &(VkDescriptorSetAllocateInfo){
+                 .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                 .descriptorPool = state->renderer.texture_table_pool,
+                 .descriptorSetCount = 1,
+                 .pSetLayouts = &state->renderer.texture_table_layout,
+             },
+             &state->renderer.texture_table),
+         "Failed to allocate texture table");
+}
+
+// Puts a loaded texture into the table slot of its id
+void write_texture_table(State *state, uint32_t texture_id,
+                         const TextureData *texture) {
+  if (texture_id >= MAX_BINDLESS_TEXTURES) {
+    printf("Error: Texture ID %u doesn't fit the texture table of %u!\n",
+           texture_id, MAX_BINDLESS_TEXTURES);
+    return;
+  }
+
+  VkDescriptorImageInfo image_info = {
+      .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      .imageView = texture->texture_image_view,
+      .sampler = texture->texture_sampler,
+  };
+  VkWriteDescriptorSet descriptor_write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = state->renderer.texture_table,
+      .dstBinding = 0,
+      .dstArrayElement = texture_id,
+      .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+      .descriptorCount = 1,
+      .pImageInfo = &image_info,
+  };
+  vkUpdateDescriptorSets(state->vk_core.device, 1, &descriptor_write, 0, NULL);
+}
+
+// Scene sets per frame in flight, one per texture unless they come from the
+// texture table
+static uint32_t frame_set_count(State *state, ResourceManager *rm) {
+  return state->renderer.bindless ? 1 : rm->geometry_count;
 }
 
 void create_descriptor_pool(State *state, ResourceManager *rm) {
-  uint32_t total_sets = MAX_FRAMES_IN_FLIGHT * rm->geometry_count;
+  uint32_t total_sets = MAX_FRAMES_IN_FLIGHT * frame_set_count(state, rm);
 
-  VkDescriptorPoolSize pool_sizes[3] = {0}; // Changed from 2 to 3
+  VkDescriptorPoolSize pool_sizes[4] = {0};
 
   // Camera UBOs
-  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   pool_sizes[0].descriptorCount = total_sets;
 
   // Texture Samplers
   pool_sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
   pool_sizes[1].descriptorCount = total_sets;
 
-  // Lighting UBOs - NEW!
-  pool_sizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  // Lighting UBOs
+  pool_sizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   pool_sizes[2].descriptorCount = total_sets;
 
+  // Instance storage buffers
+  pool_sizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  pool_sizes[3].descriptorCount = total_sets;
+
   VkDescriptorPoolCreateInfo pool_info = {
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-      .poolSizeCount = 3, // Changed from 2 to 3
+      .poolSizeCount = 4,
       .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
       .pPoolSizes = pool_sizes,
       .maxSets = total_sets,
@@ -90,10 +210,12 @@ void create_descriptor_pool(State *state, ResourceManager *rm) {
 void create_descriptor_sets(BufferData *buffer_data, ResourceManager *rm,
                             State *state) {
 
-  size_t total_sets = MAX_FRAMES_IN_FLIGHT * rm->geometry_count;
+  uint32_t frame_sets = frame_set_count(state, rm);
+  size_t total_sets = MAX_FRAMES_IN_FLIGHT * frame_sets;
 
   VkDescriptorSetLayout *layouts =
-      malloc(sizeof(VkDescriptorSetLayout) * total_sets);
+      temp_alloc(sizeof(VkDescriptorSetLayout) * total_sets,
+                 _Alignof(VkDescriptorSetLayout));
   for (size_t i = 0; i < total_sets; i++) {
     layouts[i] = state->renderer.descriptor_set_layout;
   }
@@ -106,81 +228,116 @@ void create_descriptor_sets(BufferData *buffer_data, ResourceManager *rm,
   };
 
   state->renderer.descriptor_sets =
-      malloc(total_sets * sizeof(VkDescriptorSet));
+      kuta_malloc(KUTA_MEMORY_RENDERER, total_sets * sizeof(VkDescriptorSet));
   state->renderer.descriptor_set_count = total_sets;
 
   EXPECT(vkAllocateDescriptorSets(state->vk_core.device, &alloc_info,
                                   state->renderer.descriptor_sets),
          "Failed to allocate descriptor sets");
 
-  for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
-    for (size_t model = 0; model < rm->geometry_count; model++) {
-      size_t set_index = frame * rm->geometry_count + model;
-
-      // Camera UBO info (binding 0)
-      VkDescriptorBufferInfo buffer_info = {
-          .buffer = buffer_data->uniform_buffers[frame],
-          .offset = 0,
-          .range = sizeof(UBO),
-      };
-
-      // Texture info (binding 1)
-      VkDescriptorImageInfo image_info = {
-          .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-          .imageView = rm->textures[model].texture_image_view,
-          .sampler = rm->textures[model].texture_sampler,
-      };
-
-      // Lighting UBO info (binding 2) - NEW!
-      VkDescriptorBufferInfo lighting_buffer_info = {
-          .buffer = state->renderer.lighting_buffers[frame],
-          .offset = 0,
-          .range = sizeof(LightingUBO),
-      };
-
-      VkWriteDescriptorSet descriptor_writes[3] = {
-          // Changed from 2 to 3
-          // Binding 0: Camera UBO
-          {
-              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-              .dstSet = state->renderer.descriptor_sets[set_index],
-              .dstBinding = 0,
-              .dstArrayElement = 0,
-              .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-              .descriptorCount = 1,
-              .pBufferInfo = &buffer_info,
-          },
-          // Binding 1: Texture Sampler
-          {
-              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-              .dstSet = state->renderer.descriptor_sets[set_index],
-              .dstBinding = 1,
-              .dstArrayElement = 0,
-              .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-              .descriptorCount = 1,
-              .pImageInfo = &image_info,
-          },
-          // Binding 2: Lighting UBO - NEW!
-          {
-              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-              .dstSet = state->renderer.descriptor_sets[set_index],
-              .dstBinding = 2,
-              .dstArrayElement = 0,
-              .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-              .descriptorCount = 1,
-              .pBufferInfo = &lighting_buffer_info,
-          }};
-
-      vkUpdateDescriptorSets(state->vk_core.device, 3, descriptor_writes, 0,
-                             NULL); // Changed from 2 to 3
+  // Bindless sets have no binding 1, load_texture fills the texture table
+  if (!state->renderer.bindless) {
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+      for (size_t model = 0; model < frame_sets; model++) {
+        size_t set_index = frame * frame_sets + model;
+
+        // Texture info (binding 1)
+        VkDescriptorImageInfo image_info = {
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            .imageView = rm->textures[model].texture_image_view,
+            .sampler = rm->textures[model].texture_sampler,
+        };
+
+        VkWriteDescriptorSet descriptor_write = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = state->renderer.descriptor_sets[set_index],
+            .dstBinding = 1,
+            .dstArrayElement = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .pImageInfo = &image_info,
+        };
+        vkUpdateDescriptorSets(state->vk_core.device, 1, &descriptor_write, 0,
+                               NULL);
+      }
     }
   }
 
-  free(layouts);
+  for (uint32_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+    write_frame_descriptors(state, rm, frame);
+  }
+
+  temp_free(layouts);
+}
+
+// Points the frame's sets at its uniform ring: bindings 0 and 2 take their
+// offsets when bound, binding 3 reads the instances at the ring's start or
+// the cull pass output on the GPU-driven path. Only needed again when one
+// of those buffers was replaced
+void write_frame_descriptors(State *state, ResourceManager *rm,
+                             uint32_t frame) {
+  VkBuffer ring = state->renderer.uniform_rings[frame].buffer;
+
+  VkDescriptorBufferInfo camera_buffer_info = {
+      .buffer = ring,
+      .offset = 0,
+      .range = sizeof(UBO),
+  };
+  VkDescriptorBufferInfo lighting_buffer_info = {
+      .buffer = ring,
+      .offset = 0,
+      .range = sizeof(LightingUBO),
+  };
+  VkDescriptorBufferInfo instance_buffer_info = {
+      .buffer = state->renderer.gpu_driven
+                    ? state->renderer.culling.frames[frame].instances.buffer
+                    : ring,
+      .offset = 0,
+      .range = VK_WHOLE_SIZE,
+  };
+
+  uint32_t frame_sets = frame_set_count(state, rm);
+  for (size_t model = 0; model < frame_sets; model++) {
+    size_t set_index = frame * frame_sets + model;
+    VkDescriptorSet set = state->renderer.descriptor_sets[set_index];
+
+    VkWriteDescriptorSet descriptor_writes[3] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = set,
+            .dstBinding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .descriptorCount = 1,
+            .pBufferInfo = &camera_buffer_info,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = set,
+            .dstBinding = 2,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .descriptorCount = 1,
+            .pBufferInfo = &lighting_buffer_info,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = set,
+            .dstBinding = 3,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .pBufferInfo = &instance_buffer_info,
+        },
+    };
+    vkUpdateDescriptorSets(state->vk_core.device, 3, descriptor_writes, 0,
+                           NULL);
+  }
 }
 
 void destroy_descriptor_sets(State *state) {
   vkDestroyDescriptorPool(state->vk_core.device,
                           state->renderer.descriptor_pool,
                           state->vk_core.allocator);
+  if (state->renderer.texture_table_pool != VK_NULL_HANDLE)
+    vkDestroyDescriptorPool(state->vk_core.device,
+                            state->renderer.texture_table_pool,
+                            state->vk_core.allocator);
 }
@@ -12,6 +12,13 @@ void create_descriptor_set_layout(State *state);
 void destroy_descriptor_set_layout(State *state);
 void create_descriptor_pool(State *state, ResourceManager *rm);
 
+void create_texture_table(State *state);
+void write_texture_table(State *state, uint32_t texture_id,
+                         const TextureData *texture);
+
 void create_descriptor_sets(BufferData *buffer_data, ResourceManager *rm,
                             State *state);
 void destroy_descriptor_sets(State *state);
+
+void write_frame_descriptors(State *state, ResourceManager *rm,
+                             uint32_t frame);
@@ -0,0 +1,219 @@
+#include <cglm/cglm.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "frustum.h"
+#include "internal_types.h"
+
+// Entities frustum_cull tests at once, the bounds arrays are padded to it
+#define CULL_LANES 4
+#define CULL_ARRAY_COUNT 7
+
+// Planes of the camera's view projection. Without a camera every plane
+// passes everything and nothing is too small
+void frustum_from_camera(CameraComponent *camera, float min_screen_size,
+                         Frustum *frustum) {
+  memset(frustum, 0, sizeof(Frustum));
+  if (!camera) {
+    for (uint32_t i = 0; i < 6; i++) {
+      frustum->planes[i][3] = 1.0f;
+    }
+    return;
+  }
+
+  mat4 view_projection;
+  glm_mat4_mul(camera->projection, camera->view, view_projection);
+  glm_frustum_planes(view_projection, frustum->planes);
+
+  glm_vec3_copy(camera->position, frustum->eye);
+  glm_vec3_copy(camera->front, frustum->forward);
+  // The projection's y axis is flipped for Vulkan
+  frustum->projection_scale = fabsf(camera->projection[1][1]);
+  frustum->min_screen_size = min_screen_size;
+}
+
+// Makes room for count candidates, the contents are lost when it grows
+bool cull_bounds_reserve(CullBounds *bounds, uint32_t count) {
+  bounds->count = count;
+  if (count <= bounds->capacity)
+    return true;
+
+  uint32_t capacity = bounds->capacity ? bounds->capacity : 256;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  size_t floats = sizeof(float) * capacity;
+  unsigned char *block =
+      kuta_aligned_alloc(KUTA_MEMORY_RENDERER,
+                         floats * CULL_ARRAY_COUNT + capacity, 16);
+  if (!block) {
+    bounds->count = 0;
+    return false;
+  }
+
+  kuta_free(bounds->block);
+  bounds->block = block;
+  float **arrays[CULL_ARRAY_COUNT] = {
+      &bounds->center_x, &bounds->center_y, &bounds->center_z,
+      &bounds->extent_x, &bounds->extent_y, &bounds->extent_z,
+      &bounds->radius,
+  };
+  for (uint32_t i = 0; i < CULL_ARRAY_COUNT; i++) {
+    *arrays[i] = (float *)(block + floats * i);
+  }
+  bounds->visible = block + floats * CULL_ARRAY_COUNT;
+  bounds->capacity = capacity;
+  return true;
+}
+
+// Moves the geometry's box and sphere to world space. The box stays axis
+// aligned, so it grows to hold the rotated one
+void cull_bounds_set(CullBounds *bounds, uint32_t index, mat4 model,
+                     const GeometryData *geometry) {
+  vec3 center, extent;
+  glm_vec3_center((float *)geometry->aabb_min, (float *)geometry->aabb_max,
+                  center);
+  glm_vec3_sub((float *)geometry->aabb_max, center, extent);
+
+  vec3 world_center;
+  glm_mat4_mulv3(model, center, 1.0f, world_center);
+  bounds->center_x[index] = world_center[0];
+  bounds->center_y[index] = world_center[1];
+  bounds->center_z[index] = world_center[2];
+
+  float *world_extent[3] = {&bounds->extent_x[index],
+                            &bounds->extent_y[index],
+                            &bounds->extent_z[index]};
+  for (uint32_t row = 0; row < 3; row++) {
+    *world_extent[row] = fabsf(model[0][row]) * extent[0] +
+                         fabsf(model[1][row]) * extent[1] +
+                         fabsf(model[2][row]) * extent[2];
+  }
+
+  float scale = glm_max(glm_max(glm_vec3_norm(model[0]),
+                                glm_vec3_norm(model[1])),
+                        glm_vec3_norm(model[2]));
+  bounds->radius[index] = geometry->bounds_radius * scale;
+}
+
+#if defined(CGLM_SSE_FP)
+
+static uint32_t cull_lanes(const Frustum *frustum, CullBounds *bounds) {
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 sign_mask = _mm_set1_ps(-0.0f);
+  uint32_t visible_count = 0;
+
+  for (uint32_t i = 0; i < bounds->count; i += CULL_LANES) {
+    __m128 cx = _mm_load_ps(bounds->center_x + i);
+    __m128 cy = _mm_load_ps(bounds->center_y + i);
+    __m128 cz = _mm_load_ps(bounds->center_z + i);
+    __m128 ex = _mm_load_ps(bounds->extent_x + i);
+    __m128 ey = _mm_load_ps(bounds->extent_y + i);
+    __m128 ez = _mm_load_ps(bounds->extent_z + i);
+    __m128 outside = zero;
+
+    // Outside once the box's nearest corner is behind a plane
+    for (uint32_t p = 0; p < 6; p++) {
+      __m128 nx = _mm_set1_ps(frustum->planes[p][0]);
+      __m128 ny = _mm_set1_ps(frustum->planes[p][1]);
+      __m128 nz = _mm_set1_ps(frustum->planes[p][2]);
+
+      __m128 distance = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+          _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(frustum->planes[p][3])));
+      __m128 reach = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign_mask, nx), ex),
+                     _mm_mul_ps(_mm_andnot_ps(sign_mask, ny), ey)),
+          _mm_mul_ps(_mm_andnot_ps(sign_mask, nz), ez));
+      outside =
+          _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), zero));
+    }
+
+    if (frustum->min_screen_size > 0.0f) {
+      __m128 depth = _mm_add_ps(
+          _mm_add_ps(
+              _mm_mul_ps(_mm_set1_ps(frustum->forward[0]),
+                         _mm_sub_ps(cx, _mm_set1_ps(frustum->eye[0]))),
+              _mm_mul_ps(_mm_set1_ps(frustum->forward[1]),
+                         _mm_sub_ps(cy, _mm_set1_ps(frustum->eye[1])))),
+          _mm_mul_ps(_mm_set1_ps(frustum->forward[2]),
+                     _mm_sub_ps(cz, _mm_set1_ps(frustum->eye[2]))));
+      __m128 size = _mm_mul_ps(_mm_load_ps(bounds->radius + i),
+                               _mm_set1_ps(frustum->projection_scale));
+      __m128 limit =
+          _mm_mul_ps(depth, _mm_set1_ps(frustum->min_screen_size));
+      outside = _mm_or_ps(outside, _mm_cmplt_ps(size, limit));
+    }
+
+    int mask = _mm_movemask_ps(outside);
+    for (uint32_t lane = 0; lane < CULL_LANES; lane++) {
+      uint8_t visible = !(mask & (1 << lane));
+      bounds->visible[i + lane] = visible;
+      if (i + lane < bounds->count)
+        visible_count += visible;
+    }
+  }
+
+  return visible_count;
+}
+
+#else
+
+static uint32_t cull_lanes(const Frustum *frustum, CullBounds *bounds) {
+  uint32_t visible_count = 0;
+
+  for (uint32_t i = 0; i < bounds->count; i++) {
+    bool outside = false;
+
+    for (uint32_t p = 0; p < 6 && !outside; p++) {
+      const float *plane = frustum->planes[p];
+      float distance = plane[0] * bounds->center_x[i] +
+                       plane[1] * bounds->center_y[i] +
+                       plane[2] * bounds->center_z[i] + plane[3];
+      float reach = fabsf(plane[0]) * bounds->extent_x[i] +
+                    fabsf(plane[1]) * bounds->extent_y[i] +
+                    fabsf(plane[2]) * bounds->extent_z[i];
+      outside = distance + reach < 0.0f;
+    }
+
+    if (!outside && frustum->min_screen_size > 0.0f) {
+      float depth =
+          frustum->forward[0] * (bounds->center_x[i] - frustum->eye[0]) +
+          frustum->forward[1] * (bounds->center_y[i] - frustum->eye[1]) +
+          frustum->forward[2] * (bounds->center_z[i] - frustum->eye[2]);
+      outside = bounds->radius[i] * frustum->projection_scale <
+                depth * frustum->min_screen_size;
+    }
+
+    bounds->visible[i] = !outside;
+    visible_count += !outside;
+  }
+
+  return visible_count;
+}
+
+#endif
+
+// Tests every candidate's box against the frustum planes and, when enabled,
+// its sphere's projected height against min_screen_size. Writes the result
+// to bounds->visible and returns how many passed
+uint32_t frustum_cull(const Frustum *frustum, CullBounds *bounds) {
+  // The padding lanes are tested too, their results are never read
+  for (uint32_t i = bounds->count; i % CULL_LANES != 0; i++) {
+    bounds->center_x[i] = bounds->center_y[i] = bounds->center_z[i] = 0.0f;
+    bounds->extent_x[i] = bounds->extent_y[i] = bounds->extent_z[i] = 0.0f;
+    bounds->radius[i] = 0.0f;
+  }
+
+  return cull_lanes(frustum, bounds);
+}
+
+void cull_bounds_free(CullBounds *bounds) {
+  kuta_free(bounds->block);
+  memset(bounds, 0, sizeof(CullBounds));
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cglm/cglm.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "internal_types.h"
+#include "types.h"
+
+typedef struct {
+  vec4 planes[6]; // world space, inside where dot(xyz, p) + w >= 0
+  vec3 eye;
+  vec3 forward;
+  float projection_scale; // cotangent of half the vertical field of view
+  float min_screen_size;  // 0 turns the screen size test off
+} Frustum;
+
+void frustum_from_camera(CameraComponent *camera, float min_screen_size,
+                         Frustum *frustum);
+
+bool cull_bounds_reserve(CullBounds *bounds, uint32_t count);
+
+void cull_bounds_set(CullBounds *bounds, uint32_t index, mat4 model,
+                     const GeometryData *geometry);
+
+uint32_t frustum_cull(const Frustum *frustum, CullBounds *bounds);
+
+void cull_bounds_free(CullBounds *bounds);
@@ -0,0 +1,1049 @@
+#include <cglm/cglm.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "allocator.h"
+#include "arena.h"
+#include "buffer_data.h"
+#include "depth_pyramid.h"
+#include "descriptors.h"
+#include "ecs.h"
+#include "frustum.h"
+#include "gpu_culling.h"
+#include "internal_types.h"
+#include "kuta.h"
+#include "kuta_internal.h"
+#include "utils.h"
+
+// Matches local_size_x in cull.comp
+#define CULL_GROUP_SIZE 64
+// Entity indices the resident buffers start with, they double whenever the
+// world outgrows them
+#define CULL_INITIAL_OBJECTS 1024
+
+// Descriptor bindings of cull.comp, the pyramid is only bound when it's
+// built with OCCLUSION
+enum {
+  CULL_BINDING_OBJECTS,
+  CULL_BINDING_GROUPS,
+  CULL_BINDING_DRAWS,
+  CULL_BINDING_RANGES,
+  CULL_BINDING_DRAW_COUNTS,
+  CULL_BINDING_PREFIXES,
+  CULL_BINDING_COMMANDS,
+  CULL_BINDING_COUNTS,
+  CULL_BINDING_SCRATCH,
+  CULL_BINDING_INSTANCES,
+  CULL_BINDING_UNIFORMS,
+  CULL_BINDING_VISIBILITY,
+  CULL_BINDING_PYRAMID,
+  CULL_BINDING_COUNT,
+};
+
+// Dispatches of a cull phase, see cull.comp
+enum {
+  CULL_STEP_CULL,
+  CULL_STEP_SCAN,
+  CULL_STEP_WRITE,
+};
+
+typedef struct {
+  uint32_t phase;
+  uint32_t step;
+} CullPushConstants;
+
+// Array strides cull.comp and shader.vert expect
+_Static_assert(sizeof(CullObject) == 80, "CullObject doesn't match cull.comp");
+_Static_assert(sizeof(CullGroup) == 64, "CullGroup doesn't match cull.comp");
+_Static_assert(sizeof(CullDraw) == 20, "CullDraw doesn't match cull.comp");
+_Static_assert(sizeof(InstanceData) == 80,
+               "InstanceData doesn't match the shaders");
+// std140 offsets of CullUniforms, the members after the vectors are packed
+_Static_assert(offsetof(CullUniforms, planes) == 128 &&
+                   offsetof(CullUniforms, pyramid_size) == 256 &&
+                   offsetof(CullUniforms, pyramid_levels) == 264 &&
+                   offsetof(CullUniforms, lod_error) == 292,
+               "CullUniforms doesn't match cull.comp");
+
+static VkDescriptorType cull_binding_type(uint32_t binding) {
+  switch (binding) {
+  case CULL_BINDING_UNIFORMS:
+    return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  case CULL_BINDING_PYRAMID:
+    return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  default:
+    return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  }
+}
+
+static uint32_t cull_binding_count(State *state) {
+  return state->renderer.occlusion_culling ? CULL_BINDING_COUNT
+                                           : CULL_BINDING_PYRAMID;
+}
+
+static void create_cull_pipeline(State *state, VkShaderModule module) {
+  GpuCulling *culling = &state->renderer.culling;
+  uint32_t binding_count = cull_binding_count(state);
+
+  VkDescriptorSetLayoutBinding bindings[CULL_BINDING_COUNT];
+  for (uint32_t i = 0; i < binding_count; i++) {
+    bindings[i] = (VkDescriptorSetLayoutBinding){
+        .binding = i,
+        .descriptorType = cull_binding_type(i),
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+  }
+
+  EXPECT(vkCreateDescriptorSetLayout(
+             state->vk_core.device,
+             &(VkDescriptorSetLayoutCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                 .bindingCount = binding_count,
+                 .pBindings = bindings,
+             },
+             state->vk_core.allocator, &culling->descriptor_set_layout),
+         "Failed to create cull descriptor set layout")
+
+  EXPECT(vkCreatePipelineLayout(
+             state->vk_core.device,
+             &(VkPipelineLayoutCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                 .setLayoutCount = 1,
+                 .pSetLayouts = &culling->descriptor_set_layout,
+                 .pushConstantRangeCount = 1,
+                 .pPushConstantRanges =
+                     &(VkPushConstantRange){
+                         .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                         .size = sizeof(CullPushConstants),
+                     },
+             },
+             state->vk_core.allocator, &culling->pipeline_layout),
+         "Failed to create cull pipeline layout")
+
+  VkPipelineShaderStageCreateInfo shader_stage = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+      .module = module,
+      .pName = "main",
+  };
+
+  EXPECT(vkCreateComputePipelines(
+             state->vk_core.device, NULL, 1,
+             &(VkComputePipelineCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+                 .stage = shader_stage,
+                 .layout = culling->pipeline_layout,
+             },
+             state->vk_core.allocator, &culling->pipeline),
+         "Failed to create cull pipeline")
+}
+
+static void create_cull_descriptor_sets(State *state) {
+  GpuCulling *culling = &state->renderer.culling;
+
+  VkDescriptorPoolSize pool_sizes[] = {
+      {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+       (CULL_BINDING_COUNT - 2) * MAX_FRAMES_IN_FLIGHT},
+      {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, MAX_FRAMES_IN_FLIGHT},
+      {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, MAX_FRAMES_IN_FLIGHT},
+  };
+  EXPECT(vkCreateDescriptorPool(
+             state->vk_core.device,
+             &(VkDescriptorPoolCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+                 .poolSizeCount = sizeof(pool_sizes) / sizeof(pool_sizes[0]),
+                 .pPoolSizes = pool_sizes,
+                 .maxSets = MAX_FRAMES_IN_FLIGHT,
+             },
+             state->vk_core.allocator, &culling->descriptor_pool),
+         "Failed to create cull descriptor pool")
+
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    EXPECT(vkAllocateDescriptorSets(
+               state->vk_core.device,
+               &(VkDescriptorSetAllocateInfo){
+                   .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                   .descriptorPool = culling->descriptor_pool,
+                   .descriptorSetCount = 1,
+                   .pSetLayouts = &culling->descriptor_set_layout,
+               },
+               &culling->frames[i].descriptor_set),
+           "Failed to allocate cull descriptor set %u", i)
+  }
+}
+
+static void write_cull_descriptors(State *state, uint32_t frame) {
+  GpuCulling *culling = &state->renderer.culling;
+  CullFrame *cull_frame = &culling->frames[frame];
+  DepthPyramid *pyramid = &culling->pyramid;
+  uint32_t binding_count = cull_binding_count(state);
+
+  VkBuffer buffers[CULL_BINDING_COUNT] = {
+      [CULL_BINDING_OBJECTS] = culling->objects.buffer,
+      [CULL_BINDING_GROUPS] = culling->groups.buffer,
+      [CULL_BINDING_DRAWS] = culling->draws.buffer,
+      [CULL_BINDING_RANGES] = culling->ranges.buffer,
+      [CULL_BINDING_DRAW_COUNTS] = cull_frame->draw_counts.buffer,
+      [CULL_BINDING_PREFIXES] = cull_frame->prefixes.buffer,
+      [CULL_BINDING_COMMANDS] = cull_frame->commands.buffer,
+      [CULL_BINDING_COUNTS] = cull_frame->counts.buffer,
+      [CULL_BINDING_SCRATCH] = cull_frame->scratch.buffer,
+      [CULL_BINDING_INSTANCES] = cull_frame->instances.buffer,
+      [CULL_BINDING_UNIFORMS] = cull_frame->uniforms.buffer,
+      [CULL_BINDING_VISIBILITY] = cull_frame->visibility.buffer,
+  };
+  VkDescriptorBufferInfo buffer_infos[CULL_BINDING_COUNT];
+  VkDescriptorImageInfo pyramid_info = {
+      .sampler = pyramid->sampler,
+      .imageView = pyramid->view,
+      .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+  };
+
+  VkWriteDescriptorSet descriptor_writes[CULL_BINDING_COUNT];
+  for (uint32_t i = 0; i < binding_count; i++) {
+    descriptor_writes[i] = (VkWriteDescriptorSet){
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = cull_frame->descriptor_set,
+        .dstBinding = i,
+        .descriptorType = cull_binding_type(i),
+        .descriptorCount = 1,
+    };
+    if (i == CULL_BINDING_PYRAMID) {
+      descriptor_writes[i].pImageInfo = &pyramid_info;
+    } else {
+      buffer_infos[i] = (VkDescriptorBufferInfo){buffers[i], 0, VK_WHOLE_SIZE};
+      descriptor_writes[i].pBufferInfo = &buffer_infos[i];
+    }
+  }
+
+  vkUpdateDescriptorSets(state->vk_core.device, binding_count,
+                         descriptor_writes, 0, NULL);
+}
+
+static void create_cull_buffer(State *state, VkDeviceSize size,
+                               VkBufferUsageFlags usage, CullBuffer *buffer) {
+  create_buffer(size, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                &buffer->buffer, &buffer->memory, KUTA_MEMORY_RENDERER, state);
+}
+
+static void create_mapped_buffer(State *state, VkDeviceSize size,
+                                 VkBufferUsageFlags usage, CullBuffer *buffer,
+                                 void **mapped) {
+  create_buffer(size, usage,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                &buffer->buffer, &buffer->memory, KUTA_MEMORY_RENDERER, state);
+  vkMapMemory(state->vk_core.device, buffer->memory, 0, VK_WHOLE_SIZE, 0,
+              mapped);
+}
+
+static void destroy_cull_buffer(State *state, CullBuffer *buffer) {
+  if (buffer->buffer != VK_NULL_HANDLE)
+    vkDestroyBuffer(state->vk_core.device, buffer->buffer,
+                    state->vk_core.allocator);
+  free_device_memory(state->vk_core.device, buffer->memory);
+  buffer->buffer = VK_NULL_HANDLE;
+  buffer->memory = VK_NULL_HANDLE;
+}
+
+static uint32_t cull_phase_count(const State *state) {
+  return state->renderer.occlusion_culling ? 2 : 1;
+}
+
+// Marks every object as not drawn, waits until it's done
+static void clear_objects(State *state) {
+  VkCommandBuffer command_buffer = begin_single_time_commands(state);
+  vkCmdFillBuffer(command_buffer, state->renderer.culling.objects.buffer, 0,
+                  VK_WHOLE_SIZE, UINT32_MAX);
+  end_single_time_commands(command_buffer, state);
+}
+
+// The buffers sized by the entity indices, the resident objects and each
+// frame's scratch, instances and visibility list. With occlusion culling
+// the late phase's instances follow the early phase's
+static void create_object_buffers(State *state, uint32_t capacity) {
+  GpuCulling *culling = &state->renderer.culling;
+  uint32_t phases = cull_phase_count(state);
+
+  create_cull_buffer(state, sizeof(CullObject) * capacity,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     &culling->objects);
+  clear_objects(state);
+
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    CullFrame *cull_frame = &culling->frames[i];
+    create_cull_buffer(state, sizeof(uint32_t) * 2 * capacity,
+                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                       &cull_frame->scratch);
+    create_cull_buffer(state, sizeof(InstanceData) * capacity * phases,
+                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                       &cull_frame->instances);
+    // An object reports at most one change per frame
+    create_mapped_buffer(
+        state,
+        sizeof(CullVisibilityList) + sizeof(CullVisibilityChange) * capacity,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &cull_frame->visibility,
+        (void **)&cull_frame->visibility_mapped);
+    cull_frame->visibility_mapped->count = 0;
+  }
+
+  CullSlot *slots = kuta_realloc(KUTA_MEMORY_RENDERER, culling->slots,
+                                 sizeof(CullSlot) * capacity);
+  uint32_t *uploads = kuta_realloc(KUTA_MEMORY_RENDERER, culling->uploads,
+                                   sizeof(uint32_t) * capacity);
+  VkBufferCopy *regions =
+      kuta_realloc(KUTA_MEMORY_RENDERER, culling->upload_regions,
+                   sizeof(VkBufferCopy) * capacity);
+  EXPECT(!slots || !uploads || !regions, "Failed to grow cull slots")
+  culling->slots = slots;
+  culling->uploads = uploads;
+  culling->upload_regions = regions;
+  culling->object_capacity = capacity;
+}
+
+static void destroy_object_buffers(State *state) {
+  GpuCulling *culling = &state->renderer.culling;
+
+  destroy_cull_buffer(state, &culling->objects);
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    CullFrame *cull_frame = &culling->frames[i];
+    destroy_cull_buffer(state, &cull_frame->scratch);
+    destroy_cull_buffer(state, &cull_frame->instances);
+    destroy_cull_buffer(state, &cull_frame->visibility);
+    cull_frame->visibility_mapped = NULL;
+  }
+  culling->object_capacity = 0;
+}
+
+// The buffers sized by the draws and ranges, a run per phase. Prefixes have
+// an extra entry for the totals
+static void create_draw_buffers(State *state) {
+  GpuCulling *culling = &state->renderer.culling;
+  uint32_t phases = cull_phase_count(state);
+  uint32_t draw_count = culling->draw_count ? culling->draw_count : 1;
+  uint32_t range_count = culling->range_count ? culling->range_count : 1;
+  VkBufferUsageFlags indirect = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    CullFrame *cull_frame = &culling->frames[i];
+    create_cull_buffer(state, sizeof(uint32_t) * draw_count * phases,
+                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                           VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                       &cull_frame->draw_counts);
+    create_cull_buffer(state,
+                       sizeof(uint32_t) * 2 * (draw_count + 1) * phases,
+                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                       &cull_frame->prefixes);
+    create_cull_buffer(state,
+                       sizeof(VkDrawIndexedIndirectCommand) * draw_count *
+                           phases,
+                       indirect, &cull_frame->commands);
+    create_cull_buffer(state, sizeof(uint32_t) * range_count * phases,
+                       indirect, &cull_frame->counts);
+  }
+}
+
+static void destroy_draw_buffers(State *state) {
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    CullFrame *cull_frame = &state->renderer.culling.frames[i];
+    destroy_cull_buffer(state, &cull_frame->draw_counts);
+    destroy_cull_buffer(state, &cull_frame->prefixes);
+    destroy_cull_buffer(state, &cull_frame->commands);
+    destroy_cull_buffer(state, &cull_frame->counts);
+  }
+}
+
+// Uploads one of the group tables, an empty one still gets an element so
+// its descriptor has a buffer
+static void upload_cull_table(State *state, CullBuffer *buffer,
+                              const void *data, size_t stride,
+                              uint32_t count) {
+  destroy_cull_buffer(state, buffer);
+  create_cull_buffer(state, stride * (count ? count : 1),
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     buffer);
+  if (count > 0)
+    upload_buffer(state, buffer->buffer, 0, data, stride * count);
+}
+
+static int compare_group_order(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+  return (left > right) - (left < right);
+}
+
+// Lays out a draw per level of detail of every group, grouped into one
+// range per texture. Bindless mode samples the texture per instance, so all
+// of them go into a single range. Waits for the device, the frames in flight
+// read the tables this replaces
+static void rebuild_cull_tables(State *state) {
+  GpuCulling *culling = &state->renderer.culling;
+  ResourceManager *rm = get_resource_manager();
+  uint32_t group_count = culling->group_count;
+  bool bindless = state->renderer.bindless;
+
+  vkQueueWaitIdle(state->vk_core.graphics_queue);
+
+  uint32_t draw_count = 0;
+  for (uint32_t i = 0; i < group_count; i++) {
+    draw_count += rm->geometries[culling->group_keys[i].model_id].lod_count;
+  }
+
+  uint64_t *order = temp_alloc(sizeof(uint64_t) * group_count, 8);
+  CullGroup *groups = temp_alloc(sizeof(CullGroup) * group_count, 16);
+  CullDraw *draws = temp_alloc(sizeof(CullDraw) * draw_count, 16);
+  CullRange *ranges = kuta_realloc(KUTA_MEMORY_RENDERER, culling->range_draws,
+                                   sizeof(CullRange) * (group_count + 1));
+  uint32_t *textures =
+      kuta_realloc(KUTA_MEMORY_RENDERER, culling->range_textures,
+                   sizeof(uint32_t) * (group_count + 1));
+  EXPECT((group_count && (!order || !groups)) || (draw_count && !draws) ||
+             !ranges || !textures,
+         "Failed to allocate cull tables")
+  culling->range_draws = ranges;
+  culling->range_textures = textures;
+
+  // Sorted by texture, the group index breaks ties
+  for (uint32_t i = 0; i < group_count; i++) {
+    order[i] = (uint64_t)culling->group_keys[i].texture_id << 32 | i;
+  }
+  qsort(order, group_count, sizeof(uint64_t), compare_group_order);
+
+  uint32_t draw = 0;
+  uint32_t range_count = 0;
+  for (uint32_t i = 0; i < group_count; i++) {
+    uint32_t index = (uint32_t)order[i];
+    const CullGroupKey *key = &culling->group_keys[index];
+    const GeometryData *geometry = &rm->geometries[key->model_id];
+
+    if (range_count == 0 ||
+        (!bindless && textures[range_count - 1] != key->texture_id)) {
+      ranges[range_count] = (CullRange){.first_draw = draw};
+      textures[range_count] = key->texture_id;
+      range_count++;
+    }
+
+    CullGroup *group = &groups[index];
+    memset(group, 0, sizeof(CullGroup));
+    memcpy(group->bounds, geometry->bounds_center, sizeof(float) * 3);
+    group->bounds[3] = geometry->bounds_radius;
+    memcpy(group->aabb_min, geometry->aabb_min, sizeof(group->aabb_min));
+    memcpy(group->aabb_max, geometry->aabb_max, sizeof(group->aabb_max));
+    group->first_draw = draw;
+    group->lod_count = geometry->lod_count;
+
+    for (uint32_t lod = 0; lod < geometry->lod_count; lod++) {
+      const GeometryLod *level = &geometry->lods[lod];
+      group->lod_errors[lod] = level->error;
+      draws[draw++] = (CullDraw){
+          .index_count = level->index_count,
+          .first_index = geometry->first_index + level->first_index,
+          .vertex_offset = geometry->vertex_offset,
+          .range = range_count - 1,
+          .texture_id = key->texture_id,
+      };
+    }
+    ranges[range_count - 1].end_draw = draw;
+  }
+
+  upload_cull_table(state, &culling->groups, groups, sizeof(CullGroup),
+                    group_count);
+  upload_cull_table(state, &culling->draws, draws, sizeof(CullDraw),
+                    draw_count);
+  upload_cull_table(state, &culling->ranges, ranges, sizeof(CullRange),
+                    range_count);
+  temp_free(draws);
+  temp_free(groups);
+  temp_free(order);
+
+  culling->draw_count = draw_count;
+  culling->range_count = range_count;
+  culling->tables_dirty = false;
+
+  destroy_draw_buffers(state);
+  create_draw_buffers(state);
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    write_cull_descriptors(state, i);
+  }
+}
+
+// Returns the group drawing the model with the texture, a new one gets its
+// draws with the next rebuild_cull_tables
+static uint32_t find_group(GpuCulling *culling, uint32_t model_id,
+                           uint32_t texture_id) {
+  for (uint32_t i = 0; i < culling->group_count; i++) {
+    const CullGroupKey *key = &culling->group_keys[i];
+    if (key->model_id == model_id && key->texture_id == texture_id)
+      return i;
+  }
+
+  if (culling->group_count == culling->group_capacity) {
+    uint32_t capacity =
+        culling->group_capacity ? culling->group_capacity * 2 : 64;
+    CullGroupKey *keys =
+        kuta_realloc(KUTA_MEMORY_RENDERER, culling->group_keys,
+                     sizeof(CullGroupKey) * capacity);
+    if (!keys) {
+      printf("Error: Failed to grow cull groups!\n");
+      return CULL_GROUP_NONE;
+    }
+    culling->group_keys = keys;
+    culling->group_capacity = capacity;
+  }
+
+  culling->group_keys[culling->group_count] = (CullGroupKey){
+      .model_id = model_id,
+      .texture_id = texture_id,
+  };
+  culling->tables_dirty = true;
+  return culling->group_count++;
+}
+
+// Queues the object at index for the next upload, a full one wins over a
+// matrix only one
+static void queue_upload(GpuCulling *culling, uint32_t index,
+                         CullUpload upload) {
+  CullSlot *slot = &culling->slots[index];
+  if (slot->upload == CULL_UPLOAD_NONE)
+    culling->uploads[culling->upload_count++] = index;
+  if (upload > slot->upload)
+    slot->upload = upload;
+}
+
+// Picks up whether the entity is drawn and with what. Handles of destroyed
+// entities only clear the slot while it's still theirs
+static void refresh_slot(GpuCulling *culling, World *world, Entity entity) {
+  uint32_t index = ENTITY_INDEX(entity);
+  CullSlot *slot = &culling->slots[index];
+  if (!entity_exists(world, entity) && slot->entity != entity)
+    return;
+
+  MeshRendererComponent *renderer =
+      get_component(world, entity, COMPONENT_MESH_RENDERER);
+  VisibilityComponent *visibility =
+      get_component(world, entity, COMPONENT_VISIBILITY);
+  bool listed = renderer && visibility &&
+                get_component(world, entity, COMPONENT_TRANSFORM);
+
+  uint32_t group = CULL_GROUP_NONE;
+  if (listed && visibility->visible && visibility->alpha > 0.0f) {
+    group = find_group(culling, renderer->model_id, renderer->texture_id);
+  } else if (visibility) {
+    visibility->on_screen = false;
+  }
+
+  slot->entity = entity;
+  slot->group = group;
+  queue_upload(culling, index, CULL_UPLOAD_FULL);
+}
+
+// Starts over from the world's render query, after the world changed or its
+// changes went untracked. Waits for the device, the frames in flight report
+// on what this clears
+static void resync_scene(State *state, World *world) {
+  GpuCulling *culling = &state->renderer.culling;
+
+  vkQueueWaitIdle(state->vk_core.graphics_queue);
+  clear_objects(state);
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    culling->frames[i].visibility_mapped->count = 0;
+  }
+  for (uint32_t i = 0; i < culling->object_capacity; i++) {
+    culling->slots[i] = (CullSlot){
+        .entity = ENTITY_NULL,
+        .group = CULL_GROUP_NONE,
+        .upload = CULL_UPLOAD_NONE,
+    };
+  }
+  culling->upload_count = 0;
+
+  world->render_changes.count = 0;
+  world->track_render_changes = true;
+  culling->world = world;
+
+  uint32_t count = kuta_query_count(world->render_query);
+  for (uint32_t i = 0; i < count; i++) {
+    refresh_slot(culling, world, kuta_query_entity(world->render_query, i));
+  }
+}
+
+// Makes room for every entity index of the world. The replaced buffers are
+// read by the frames in flight and referenced by their descriptors, so it
+// waits for the device and resyncs the scene into the new ones
+static bool reserve_objects(State *state, World *world) {
+  GpuCulling *culling = &state->renderer.culling;
+  if (world->next_entity_id <= culling->object_capacity)
+    return false;
+
+  uint32_t capacity = culling->object_capacity;
+  while (capacity < world->next_entity_id) {
+    capacity *= 2;
+  }
+
+  vkQueueWaitIdle(state->vk_core.graphics_queue);
+  destroy_object_buffers(state);
+  create_object_buffers(state, capacity);
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    write_cull_descriptors(state, i);
+    write_frame_descriptors(state, get_resource_manager(), i);
+  }
+  return true;
+}
+
+// Hands what the frame's cull pass reported to the entities' visibility,
+// only call once the frame's fence signalled. Reports on objects uploaded
+// again since, and on entities destroyed since, are dropped
+static void read_visibility(GpuCulling *culling, World *world,
+                            CullFrame *cull_frame) {
+  CullVisibilityList *list = cull_frame->visibility_mapped;
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    const CullVisibilityChange *change = &list->changes[i];
+    const CullSlot *slot = &culling->slots[ENTITY_INDEX(change->entity)];
+    if (slot->upload_frame > cull_frame->frame_number)
+      continue;
+
+    VisibilityComponent *visibility =
+        get_component(world, change->entity, COMPONENT_VISIBILITY);
+    if (visibility)
+      visibility->on_screen = change->on_screen != 0;
+  }
+  list->count = 0;
+}
+
+// Brings the resident objects up to date with the world, end_frame calls it
+// once transforms are up to date. Only what changed is queued for upload:
+// entities joining or leaving the render query or passed to
+// mark_render_dirty, and the transforms transform_system_update rewrote.
+// Switching worlds starts over from the new world's render query
+void gpu_culling_sync(State *state, World *world) {
+  GpuCulling *culling = &state->renderer.culling;
+  CullFrame *cull_frame = &culling->frames[state->renderer.current_frame];
+
+  bool resync = reserve_objects(state, world) ||
+                !world->track_render_changes || culling->world != world;
+  if (resync) {
+    resync_scene(state, world);
+  } else {
+    read_visibility(culling, world, cull_frame);
+  }
+
+  for (uint32_t i = 0; i < world->render_changes.count; i++) {
+    refresh_slot(culling, world, world->render_changes.items[i]);
+  }
+  world->render_changes.count = 0;
+
+  for (uint32_t i = 0; i < world->changed_transforms.count; i++) {
+    Entity entity = world->changed_transforms.items[i];
+    uint32_t index = ENTITY_INDEX(entity);
+    const CullSlot *slot = &culling->slots[index];
+    if (slot->entity == entity && slot->group != CULL_GROUP_NONE)
+      queue_upload(culling, index, CULL_UPLOAD_MODEL);
+  }
+
+  if (culling->tables_dirty)
+    rebuild_cull_tables(state);
+  culling->object_count = world->next_entity_id;
+}
+
+// Ring bytes gpu_culling_upload allocates, the frame reserves them up front
+// together with everything else it allocates
+VkDeviceSize gpu_culling_upload_size(const State *state) {
+  const GpuCulling *culling = &state->renderer.culling;
+  if (culling->upload_count == 0)
+    return 0;
+  return uniform_ring_span(state, sizeof(CullObject) * culling->upload_count);
+}
+
+// Stages the queued objects in the frame's uniform ring and turns them into
+// the copies the early cull phase records. Full uploads reset the object,
+// matrix only ones leave what the cull pass keeps in it alone
+void gpu_culling_upload(State *state, World *world) {
+  GpuCulling *culling = &state->renderer.culling;
+  uint32_t frame = state->renderer.current_frame;
+
+  culling->frame_number++;
+  culling->frames[frame].frame_number = culling->frame_number;
+  culling->upload_region_count = 0;
+  if (culling->upload_count == 0)
+    return;
+
+  uint32_t offset;
+  CullObject *staged = uniform_ring_alloc(
+      state, frame, sizeof(CullObject) * culling->upload_count, &offset);
+  if (!staged)
+    return;
+
+  for (uint32_t i = 0; i < culling->upload_count; i++) {
+    uint32_t index = culling->uploads[i];
+    CullSlot *slot = &culling->slots[index];
+    CullObject *object = &staged[i];
+    TransformComponent *transform =
+        get_component(world, slot->entity, COMPONENT_TRANSFORM);
+
+    if (transform && slot->group != CULL_GROUP_NONE) {
+      memcpy(object->model, transform->world_matrix, sizeof(object->model));
+    } else {
+      memset(object->model, 0, sizeof(object->model));
+    }
+
+    VkDeviceSize size = sizeof(object->model);
+    if (slot->upload == CULL_UPLOAD_FULL) {
+      // The cull pass reports from what the CPU last saw on
+      VisibilityComponent *visibility =
+          get_component(world, slot->entity, COMPONENT_VISIBILITY);
+      object->group = slot->group;
+      object->entity = slot->entity;
+      object->state =
+          visibility && visibility->on_screen ? CULL_STATE_ON_SCREEN : 0;
+      object->_pad = 0;
+      slot->upload_frame = culling->frame_number;
+      size = sizeof(CullObject);
+    }
+    slot->upload = CULL_UPLOAD_NONE;
+
+    // Neighbouring full uploads are staged next to each other too
+    VkDeviceSize src = offset + sizeof(CullObject) * (VkDeviceSize)i;
+    VkDeviceSize dst = sizeof(CullObject) * (VkDeviceSize)index;
+    VkBufferCopy *last =
+        culling->upload_region_count
+            ? &culling->upload_regions[culling->upload_region_count - 1]
+            : NULL;
+    if (last && last->srcOffset + last->size == src &&
+        last->dstOffset + last->size == dst) {
+      last->size += size;
+    } else {
+      culling->upload_regions[culling->upload_region_count++] = (VkBufferCopy){
+          .srcOffset = src,
+          .dstOffset = dst,
+          .size = size,
+      };
+    }
+  }
+  culling->upload_count = 0;
+}
+
+// Nothing to cull or draw
+static bool cull_pass_empty(const GpuCulling *culling) {
+  return culling->draw_count == 0 || culling->object_count == 0;
+}
+
+// Copies the staged objects into the resident buffer and clears the frame's
+// draw counts. The previous frame's cull pass may still read the objects
+static void record_uploads(State *state, VkCommandBuffer cmd_buffer) {
+  GpuCulling *culling = &state->renderer.culling;
+  uint32_t frame = state->renderer.current_frame;
+
+  vkCmdPipelineBarrier(
+      cmd_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+      &(VkMemoryBarrier){
+          .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+          .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+          .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      },
+      0, NULL, 0, NULL);
+
+  if (culling->upload_region_count > 0) {
+    vkCmdCopyBuffer(cmd_buffer, state->renderer.uniform_rings[frame].buffer,
+                    culling->objects.buffer, culling->upload_region_count,
+                    culling->upload_regions);
+  }
+  vkCmdFillBuffer(cmd_buffer, culling->frames[frame].draw_counts.buffer, 0,
+                  VK_WHOLE_SIZE, 0);
+
+  vkCmdPipelineBarrier(
+      cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+      &(VkMemoryBarrier){
+          .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+          .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          .dstAccessMask =
+              VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+      },
+      0, NULL, 0, NULL);
+}
+
+static void write_cull_uniforms(State *state, World *world) {
+  GpuCulling *culling = &state->renderer.culling;
+  CullFrame *cull_frame = &culling->frames[state->renderer.current_frame];
+  CullUniforms *uniforms = cull_frame->uniforms_mapped;
+  CameraComponent *camera = get_active_camera(world);
+  DepthPyramid *pyramid = &culling->pyramid;
+
+  Frustum frustum;
+  frustum_from_camera(camera, culling->min_screen_size, &frustum);
+  memcpy(uniforms->planes, frustum.planes, sizeof(frustum.planes));
+  if (camera) {
+    glm_mat4_mul(camera->projection, camera->view, uniforms->view_projection);
+    glm_vec4(camera->position, camera->nearPlane, uniforms->camera_position);
+    // The projection's y axis is flipped for Vulkan
+    glm_vec4(camera->front, fabsf(camera->projection[1][1]) / 2.0f,
+             uniforms->camera_front);
+  } else {
+    glm_mat4_identity(uniforms->view_projection);
+    glm_vec4_zero(uniforms->camera_position);
+    glm_vec4_zero(uniforms->camera_front);
+  }
+  glm_mat4_copy(pyramid->view_projection, uniforms->prev_view_projection);
+  uniforms->pyramid_size[0] = (float)pyramid->width;
+  uniforms->pyramid_size[1] = (float)pyramid->height;
+  uniforms->pyramid_levels = pyramid->level_count;
+  uniforms->object_count = culling->object_count;
+  uniforms->draw_count = culling->draw_count;
+  uniforms->range_count = culling->range_count;
+  uniforms->instance_stride = culling->object_capacity;
+  uniforms->occlusion =
+      state->renderer.occlusion_culling && pyramid->valid && camera;
+  uniforms->min_screen_size = frustum.min_screen_size;
+  uniforms->lod_error = culling->lod_error;
+}
+
+static void dispatch_step(GpuCulling *culling, VkCommandBuffer cmd_buffer,
+                          CullPhase phase, uint32_t step,
+                          uint32_t group_count) {
+  CullPushConstants push_constants = {.phase = phase, .step = step};
+  vkCmdPushConstants(cmd_buffer, culling->pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants),
+                     &push_constants);
+  vkCmdDispatch(cmd_buffer, group_count, 1, 1);
+}
+
+// Each step reads what the one before wrote, the last one's results go to
+// the draws, the late phase and the host
+static void cull_barrier(VkCommandBuffer cmd_buffer,
+                         VkPipelineStageFlags dst_stages,
+                         VkAccessFlags dst_access) {
+  vkCmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       dst_stages, 0, 1,
+                       &(VkMemoryBarrier){
+                           .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                           .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                           .dstAccessMask = dst_access,
+                       },
+                       0, NULL, 0, NULL);
+}
+
+static void record_cull_phase(State *state, VkCommandBuffer cmd_buffer,
+                              CullPhase phase) {
+  GpuCulling *culling = &state->renderer.culling;
+  CullFrame *cull_frame = &culling->frames[state->renderer.current_frame];
+  uint32_t object_groups =
+      (culling->object_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+  VkAccessFlags shader_access =
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+  vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    culling->pipeline);
+  vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          culling->pipeline_layout, 0, 1,
+                          &cull_frame->descriptor_set, 0, NULL);
+
+  dispatch_step(culling, cmd_buffer, phase, CULL_STEP_CULL, object_groups);
+  cull_barrier(cmd_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+               shader_access);
+  dispatch_step(culling, cmd_buffer, phase, CULL_STEP_SCAN, 1);
+  cull_barrier(cmd_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+               shader_access);
+  dispatch_step(culling, cmd_buffer, phase, CULL_STEP_WRITE, object_groups);
+  cull_barrier(cmd_buffer,
+               VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                   VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                   VK_PIPELINE_STAGE_HOST_BIT,
+               VK_ACCESS_INDIRECT_COMMAND_READ_BIT | shader_access |
+                   VK_ACCESS_HOST_READ_BIT);
+}
+
+// Records a phase of the cull pass. The early phase applies the frame's
+// uploads, frustum culls the objects, with occlusion culling also against
+// last frame's depth pyramid, and picks their levels of detail. The late
+// phase rebuilds the pyramid from the early phase's depth and draws what the
+// early phase wrongly occluded. Has to be recorded outside the render pass,
+// the draws of gpu_culling_draw wait for it
+void gpu_culling_record(State *state, World *world, VkCommandBuffer cmd_buffer,
+                        CullPhase phase) {
+  GpuCulling *culling = &state->renderer.culling;
+  CullFrame *cull_frame = &culling->frames[state->renderer.current_frame];
+
+  if (phase == CULL_PHASE_EARLY) {
+    record_uploads(state, cmd_buffer);
+    if (cull_pass_empty(culling))
+      return;
+    write_cull_uniforms(state, world);
+  } else {
+    if (cull_pass_empty(culling))
+      return;
+    depth_pyramid_build(state, cmd_buffer,
+                        cull_frame->uniforms_mapped->view_projection);
+  }
+
+  record_cull_phase(state, cmd_buffer, phase);
+}
+
+// Draws what the phase of the cull pass kept, one multi-draw per range. The
+// cull pass packed each range's non-empty draws at its start and wrote how
+// many there are
+void gpu_culling_draw(State *state, VkCommandBuffer cmd_buffer,
+                      CullPhase phase) {
+  GpuCulling *culling = &state->renderer.culling;
+  uint32_t frame = state->renderer.current_frame;
+  CullFrame *cull_frame = &culling->frames[frame];
+  ResourceManager *rm = get_resource_manager();
+  if (cull_pass_empty(culling))
+    return;
+
+  bind_geometry_buffer(&rm->geometry_buffer, cmd_buffer);
+  if (state->renderer.bindless) {
+    VkDescriptorSet descriptor_sets[] = {
+        state->renderer.descriptor_sets[frame],
+        state->renderer.texture_table,
+    };
+    vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            state->renderer.pipeline_layout, 0, 2,
+                            descriptor_sets, SCENE_OFFSET_COUNT,
+                            state->renderer.scene_offsets);
+  }
+
+  for (uint32_t i = 0; i < culling->range_count; i++) {
+    const CullRange *range = &culling->range_draws[i];
+    if (!state->renderer.bindless) {
+      VkDescriptorSet descriptor_set =
+          get_texture_descriptor_set(culling->range_textures[i]);
+      vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              state->renderer.pipeline_layout, 0, 1,
+                              &descriptor_set, SCENE_OFFSET_COUNT,
+                              state->renderer.scene_offsets);
+    }
+
+    uint32_t first = culling->draw_count * phase + range->first_draw;
+    uint32_t count = culling->range_count * phase + i;
+    vkCmdDrawIndexedIndirectCount(
+        cmd_buffer, cull_frame->commands.buffer,
+        sizeof(VkDrawIndexedIndirectCommand) * first,
+        cull_frame->counts.buffer, sizeof(uint32_t) * count,
+        range->end_draw - range->first_draw,
+        sizeof(VkDrawIndexedIndirectCommand));
+  }
+}
+
+static const uint32_t *load_cull_shader(State *state, size_t *size) {
+  if (state->renderer.occlusion_culling) {
+    const uint32_t *shader_src =
+        read_file("./assets/shaders/cull_occlusion.spv", size);
+    if (shader_src)
+      return shader_src;
+
+    printf("Error: Failed to load cull_occlusion.spv, build the "
+           "kuta_shaders target to compile it. Occlusion culling is off!\n");
+    destroy_depth_pyramid(state);
+    state->renderer.occlusion_culling = false;
+  }
+  return read_file("./assets/shaders/cull.spv", size);
+}
+
+// Sets up the compute pass of the GPU-driven path. Without the cull shader
+// the renderer falls back to the CPU path, so call it before the graphics
+// descriptor sets are written. The depth attachment has to exist already,
+// occlusion culling builds its pyramid from it
+void create_gpu_culling(State *state) {
+  GpuCulling *culling = &state->renderer.culling;
+  if (!state->renderer.gpu_driven)
+    return;
+
+  if (state->renderer.occlusion_culling && !create_depth_pyramid(state)) {
+    printf("Error: Failed to load the depth pyramid shaders, build the "
+           "kuta_shaders target to compile them. Occlusion culling is "
+           "off!\n");
+    state->renderer.occlusion_culling = false;
+  }
+
+  size_t shader_size;
+  const uint32_t *shader_src = load_cull_shader(state, &shader_size);
+  if (!shader_src) {
+    printf("Error: Failed to load cull.spv, build the kuta_shaders target "
+           "to compile it. Culling on the CPU!\n");
+    state->renderer.gpu_driven = false;
+    return;
+  }
+
+  VkShaderModule shader_module;
+  EXPECT(vkCreateShaderModule(
+             state->vk_core.device,
+             &(VkShaderModuleCreateInfo){
+                 .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+                 .pCode = shader_src,
+                 .codeSize = shader_size,
+             },
+             state->vk_core.allocator, &shader_module),
+         "Failed to create cull shader module")
+
+  create_cull_pipeline(state, shader_module);
+  vkDestroyShaderModule(state->vk_core.device, shader_module,
+                        state->vk_core.allocator);
+  temp_free((void *)shader_src);
+
+  create_cull_descriptor_sets(state);
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    CullFrame *cull_frame = &culling->frames[i];
+    create_mapped_buffer(state, sizeof(CullUniforms),
+                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                         &cull_frame->uniforms,
+                         (void **)&cull_frame->uniforms_mapped);
+  }
+  create_object_buffers(state, CULL_INITIAL_OBJECTS);
+  rebuild_cull_tables(state);
+}
+
+// Follows the swapchain's new size, recreate_swapchain calls it once the
+// depth resources were recreated
+void resize_gpu_culling(State *state) {
+  if (!state->renderer.occlusion_culling)
+    return;
+
+  resize_depth_pyramid(state);
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    write_cull_descriptors(state, i);
+  }
+}
+
+void destroy_gpu_culling(State *state) {
+  GpuCulling *culling = &state->renderer.culling;
+
+  destroy_object_buffers(state);
+  destroy_draw_buffers(state);
+  destroy_cull_buffer(state, &culling->groups);
+  destroy_cull_buffer(state, &culling->draws);
+  destroy_cull_buffer(state, &culling->ranges);
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    destroy_cull_buffer(state, &culling->frames[i].uniforms);
+  }
+  kuta_free(culling->slots);
+  kuta_free(culling->uploads);
+  kuta_free(culling->upload_regions);
+  kuta_free(culling->group_keys);
+  kuta_free(culling->range_draws);
+  kuta_free(culling->range_textures);
+
+  destroy_depth_pyramid(state);
+  vkDestroyDescriptorPool(state->vk_core.device, culling->descriptor_pool,
+                          state->vk_core.allocator);
+  vkDestroyPipeline(state->vk_core.device, culling->pipeline,
+                    state->vk_core.allocator);
+  vkDestroyPipelineLayout(state->vk_core.device, culling->pipeline_layout,
+                          state->vk_core.allocator);
+  vkDestroyDescriptorSetLayout(state->vk_core.device,
+                               culling->descriptor_set_layout,
+                               state->vk_core.allocator);
+  memset(culling, 0, sizeof(GpuCulling));
+}
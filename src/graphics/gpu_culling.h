@@ -0,0 +1,22 @@
+#pragma once
+
+#include "internal_types.h"
+#include "types.h"
+
+void create_gpu_culling(State *state);
+
+void resize_gpu_culling(State *state);
+
+void destroy_gpu_culling(State *state);
+
+void gpu_culling_sync(State *state, World *world);
+
+VkDeviceSize gpu_culling_upload_size(const State *state);
+
+void gpu_culling_upload(State *state, World *world);
+
+void gpu_culling_record(State *state, World *world, VkCommandBuffer cmd_buffer,
+                        CullPhase phase);
+
+void gpu_culling_draw(State *state, VkCommandBuffer cmd_buffer,
+                      CullPhase phase);
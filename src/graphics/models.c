@@ -1,12 +1,40 @@
+#include "allocator.h"
 #include "internal_types.h"
+#include "simplify.h"
 
 #include <assimp/cimport.h>
+#include <cglm/cglm.h>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+// The vertices' box and a sphere around its centre, not the tightest sphere
+// but close for most meshes and a single pass
+static void compute_bounds(GeometryData *geometry) {
+  if (geometry->vertex_count == 0)
+    return;
+
+  float *min = geometry->aabb_min;
+  float *max = geometry->aabb_max;
+  glm_vec3_copy(geometry->vertices[0].pos, min);
+  glm_vec3_copy(geometry->vertices[0].pos, max);
+  for (size_t i = 1; i < geometry->vertex_count; i++) {
+    glm_vec3_minv(min, geometry->vertices[i].pos, min);
+    glm_vec3_maxv(max, geometry->vertices[i].pos, max);
+  }
+  glm_vec3_center(min, max, geometry->bounds_center);
+
+  float radius_squared = 0.0f;
+  for (size_t i = 0; i < geometry->vertex_count; i++) {
+    float distance = glm_vec3_distance2(geometry->bounds_center,
+                                        geometry->vertices[i].pos);
+    radius_squared = glm_max(radius_squared, distance);
+  }
+  geometry->bounds_radius = sqrtf(radius_squared);
+}
+
 GeometryData load_models(const char *filename) {
   GeometryData geometry = {0};
   const struct aiScene *scene = aiImportFile(
@@ -31,8 +59,10 @@ GeometryData load_models(const char *filename) {
   }
 
   // Allocate arrays
-  geometry.vertices = malloc(sizeof(Vertex) * total_vertices);
-  geometry.indices = malloc(sizeof(uint32_t) * total_indices);
+  geometry.vertices =
+      kuta_malloc(KUTA_MEMORY_RESOURCES, sizeof(Vertex) * total_vertices);
+  geometry.indices =
+      kuta_malloc(KUTA_MEMORY_RESOURCES, sizeof(uint32_t) * total_indices);
   geometry.vertex_count = 0;
   geometry.index_count = 0;
 
@@ -73,6 +103,56 @@ GeometryData load_models(const char *filename) {
     }
   }
 
+  compute_bounds(&geometry);
+  geometry.lods[0] = (GeometryLod){.index_count = geometry.index_count};
+  geometry.lod_count = 1;
+
   aiReleaseImport(scene);
   return geometry;
 }
+
+// Appends simplified index lists behind the full one until lod_count levels
+// exist, each aiming at half the triangles of the one before. Stops early
+// once a level barely gets smaller, as happens when the seams and borders
+// are all that's left
+void generate_lods(GeometryData *geometry, uint32_t lod_count) {
+  if (lod_count > KUTA_MAX_GEOMETRY_LODS)
+    lod_count = KUTA_MAX_GEOMETRY_LODS;
+  if (lod_count <= 1 || geometry->index_count == 0)
+    return;
+
+  size_t base_count = geometry->lods[0].index_count;
+  uint32_t *indices =
+      kuta_realloc(KUTA_MEMORY_RESOURCES, geometry->indices,
+                   sizeof(uint32_t) * base_count * lod_count);
+  if (!indices) {
+    printf("Error: Failed to allocate level of detail indices!\n");
+    return;
+  }
+  geometry->indices = indices;
+
+  for (uint32_t lod = 1; lod < lod_count; lod++) {
+    const GeometryLod *previous = &geometry->lods[lod - 1];
+    size_t target = (base_count >> lod) / 3 * 3;
+    float error = 0.0f;
+    size_t count = simplify_mesh(
+        geometry->vertices, geometry->vertex_count, indices, base_count,
+        target, indices + geometry->index_count, &error);
+    if (count == 0 || count * 10 > (size_t)previous->index_count * 9)
+      break;
+
+    // Kept monotonic so render_queue_build can walk the chain in order
+    geometry->lods[lod] = (GeometryLod){
+        .first_index = (uint32_t)geometry->index_count,
+        .index_count = (uint32_t)count,
+        .error = glm_max(error, previous->error),
+    };
+    geometry->index_count += count;
+    geometry->lod_count++;
+  }
+
+  indices = kuta_realloc(KUTA_MEMORY_RESOURCES, geometry->indices,
+                         sizeof(uint32_t) * geometry->index_count);
+  if (indices)
+    geometry->indices = indices;
+}
@@ -2,3 +2,5 @@
 #include "internal_types.h"
 
 GeometryData load_models(const char *filename);
+
+void generate_lods(GeometryData *geometry, uint32_t lod_count);
@@ -0,0 +1,508 @@
+#include <cglm/cglm.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "allocator.h"
+#include "buffer_data.h"
+#include "descriptors.h"
+#include "ecs.h"
+#include "frustum.h"
+#include "internal_types.h"
+#include "kuta.h"
+#include "kuta_internal.h"
+#include "render_queue.h"
+#include "renderer.h"
+#include "utils.h"
+
+// Draws with alpha below this go to the transparent pass
+#define RENDER_OPAQUE_ALPHA 1.0f
+// Only one graphics pipeline exists so far, record_command_buffer binds it
+#define RENDER_PIPELINE_DEFAULT 0
+
+#define SORT_KEY_DEPTH_BITS 22
+#define SORT_KEY_DEPTH_MAX ((1u << SORT_KEY_DEPTH_BITS) - 1)
+
+// Parallel recording splits the batches into this many slices per job
+// worker, so a worker held up by another job doesn't stall the frame
+#define RECORD_SLICES_PER_WORKER 2
+
+// A coarser level of detail is only switched to once its error is this much
+// below the limit, so entities near a threshold don't flicker between two
+#define LOD_HYSTERESIS 0.2f
+
+typedef enum {
+  RENDER_PASS_OPAQUE,
+  RENDER_PASS_TRANSPARENT,
+} RenderPassKind;
+
+// Opaque draws sort by state first so they batch, and front to back within
+// a state for early depth rejection:
+//   pass:2 | pipeline:6 | texture:16 | mesh:16 | lod:2 | depth:22
+// Transparent draws have to blend back to front, so depth goes first:
+//   pass:2 | far to near depth:22 | pipeline:6 | texture:16 | mesh:16 | lod:2
+static uint64_t draw_sort_key(RenderPassKind pass, const DrawPacket *packet,
+                              uint32_t depth) {
+  uint64_t pipeline = packet->pipeline & 0x3F;
+  uint64_t texture = packet->texture_id & 0xFFFF;
+  uint64_t mesh = packet->model_id & 0xFFFF;
+  uint64_t lod = packet->lod & 0x3;
+
+  if (pass == RENDER_PASS_OPAQUE) {
+    return (uint64_t)pass << 62 | pipeline << 56 | texture << 40 | mesh << 24 |
+           lod << 22 | depth;
+  }
+  return (uint64_t)pass << 62 | (uint64_t)(SORT_KEY_DEPTH_MAX - depth) << 40 |
+         pipeline << 34 | texture << 18 | mesh << 2 | lod;
+}
+
+// Distance along the camera's view direction, scaled to the far plane
+static uint32_t quantize_depth(const CameraComponent *camera, vec3 position) {
+  if (!camera || camera->farPlane <= 0.0f)
+    return 0;
+
+  vec3 offset;
+  glm_vec3_sub(position, (float *)camera->position, offset);
+  float depth = glm_vec3_dot(offset, (float *)camera->front) /
+                camera->farPlane;
+  depth = glm_clamp(depth, 0.0f, 1.0f);
+  return (uint32_t)(depth * (float)SORT_KEY_DEPTH_MAX);
+}
+
+// Picks the coarsest level of detail whose error covers at most lod_error of
+// the screen height, starting from the one the entity had last frame
+static uint32_t select_lod(const RenderQueue *queue,
+                           const GeometryData *geometry,
+                           const CameraComponent *camera, mat4 model,
+                           uint32_t current) {
+  if (geometry->lod_count <= 1 || !camera)
+    return 0;
+
+  vec3 offset;
+  glm_vec3_sub(model[3], (float *)camera->position, offset);
+  float depth = glm_vec3_dot(offset, (float *)camera->front);
+  if (depth <= camera->nearPlane)
+    return 0;
+
+  float scale = glm_max(glm_max(glm_vec3_norm(model[0]),
+                                glm_vec3_norm(model[1])),
+                        glm_vec3_norm(model[2]));
+  // Fraction of the screen height a model space length covers at depth, the
+  // projection's y axis is flipped for Vulkan
+  float to_screen =
+      scale * fabsf(camera->projection[1][1]) / (2.0f * depth);
+
+  uint32_t lod = current < geometry->lod_count ? current : 0;
+  while (lod > 0 && geometry->lods[lod].error * to_screen > queue->lod_error) {
+    lod--;
+  }
+  while (lod + 1 < geometry->lod_count &&
+         geometry->lods[lod + 1].error * to_screen <=
+             queue->lod_error * (1.0f - LOD_HYSTERESIS)) {
+    lod++;
+  }
+  return lod;
+}
+
+// Makes room for the level of detail of entity indices below count, new
+// entries start at the full mesh
+static bool reserve_lods(RenderQueue *queue, uint32_t count) {
+  if (count <= queue->lod_capacity)
+    return true;
+
+  uint32_t capacity = queue->lod_capacity ? queue->lod_capacity : 256;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  uint8_t *lods = kuta_realloc(KUTA_MEMORY_RENDERER, queue->lods, capacity);
+  if (!lods)
+    return false;
+  memset(lods + queue->lod_capacity, 0, capacity - queue->lod_capacity);
+  queue->lods = lods;
+  queue->lod_capacity = capacity;
+  return true;
+}
+
+static bool render_queue_reserve(RenderQueue *queue, uint32_t count) {
+  if (count <= queue->capacity)
+    return true;
+
+  uint32_t capacity = queue->capacity ? queue->capacity : 256;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  DrawPacket *packets = kuta_realloc(KUTA_MEMORY_RENDERER, queue->packets,
+                                     sizeof(DrawPacket) * capacity);
+  if (!packets)
+    return false;
+  queue->packets = packets;
+
+  DrawBatch *batches = kuta_realloc(KUTA_MEMORY_RENDERER, queue->batches,
+                                    sizeof(DrawBatch) * capacity);
+  if (!batches)
+    return false;
+  queue->batches = batches;
+
+  uint64_t **key_arrays[] = {&queue->keys, &queue->scratch_keys};
+  for (uint32_t i = 0; i < 2; i++) {
+    uint64_t *keys = kuta_realloc(KUTA_MEMORY_RENDERER, *key_arrays[i],
+                                  sizeof(uint64_t) * capacity);
+    if (!keys)
+      return false;
+    *key_arrays[i] = keys;
+  }
+
+  uint32_t **order_arrays[] = {&queue->order, &queue->scratch_order};
+  for (uint32_t i = 0; i < 2; i++) {
+    uint32_t *order = kuta_realloc(KUTA_MEMORY_RENDERER, *order_arrays[i],
+                                   sizeof(uint32_t) * capacity);
+    if (!order)
+      return false;
+    *order_arrays[i] = order;
+  }
+
+  queue->capacity = capacity;
+  return true;
+}
+
+// LSD radix sort over the key bytes with the packet order riding along. The
+// histograms of every byte come from one read of the keys, bytes all keys
+// share are skipped, which are most of them in a typical scene
+static void radix_sort(RenderQueue *queue) {
+  uint32_t counts[8][256];
+  memset(counts, 0, sizeof(counts));
+
+  for (uint32_t i = 0; i < queue->count; i++) {
+    uint64_t key = queue->keys[i];
+    for (uint32_t byte = 0; byte < 8; byte++) {
+      counts[byte][(key >> (byte * 8)) & 0xFF]++;
+    }
+  }
+
+  for (uint32_t byte = 0; byte < 8; byte++) {
+    uint32_t shift = byte * 8;
+    uint32_t *count = counts[byte];
+    if (count[(queue->keys[0] >> shift) & 0xFF] == queue->count)
+      continue;
+
+    uint32_t offsets[256];
+    uint32_t offset = 0;
+    for (uint32_t digit = 0; digit < 256; digit++) {
+      offsets[digit] = offset;
+      offset += count[digit];
+    }
+
+    for (uint32_t i = 0; i < queue->count; i++) {
+      uint64_t key = queue->keys[i];
+      uint32_t slot = offsets[(key >> shift) & 0xFF]++;
+      queue->scratch_keys[slot] = key;
+      queue->scratch_order[slot] = queue->order[i];
+    }
+
+    uint64_t *keys = queue->keys;
+    queue->keys = queue->scratch_keys;
+    queue->scratch_keys = keys;
+    uint32_t *order = queue->order;
+    queue->order = queue->scratch_order;
+    queue->scratch_order = order;
+  }
+}
+
+static bool same_draw_state(const DrawPacket *a, const DrawPacket *b) {
+  return a->model_id == b->model_id && a->texture_id == b->texture_id &&
+         a->pipeline == b->pipeline && a->lod == b->lod;
+}
+
+// Splits the sorted packets into runs sharing their state
+static void build_batches(RenderQueue *queue) {
+  queue->batch_count = 0;
+
+  for (uint32_t first = 0; first < queue->count;) {
+    const DrawPacket *packet = &queue->packets[queue->order[first]];
+    uint32_t end = first + 1;
+    while (end < queue->count &&
+           same_draw_state(packet, &queue->packets[queue->order[end]])) {
+      end++;
+    }
+
+    queue->batches[queue->batch_count++] = (DrawBatch){
+        .first = first,
+        .count = end - first,
+    };
+    first = end;
+  }
+}
+
+// Frustum culls the render query's entities four at a time. Returns false
+// without a camera or when culling failed, in which case every entity is a
+// candidate
+static bool cull_candidates(RenderQueue *queue, World *world,
+                            CameraComponent *camera) {
+  ComponentPool *renderers = &world->component_pools[COMPONENT_MESH_RENDERER];
+  ComponentPool *transforms = &world->component_pools[COMPONENT_TRANSFORM];
+  ResourceManager *rm = get_resource_manager();
+  uint32_t count = kuta_query_count(world->render_query);
+
+  if (!camera)
+    return false;
+  if (!cull_bounds_reserve(&queue->bounds, count)) {
+    printf("Error: Failed to grow cull bounds!\n");
+    return false;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    Entity entity = kuta_query_entity(world->render_query, i);
+    MeshRendererComponent *renderer = component_pool_get(renderers, entity);
+    TransformComponent *transform = component_pool_get(transforms, entity);
+    cull_bounds_set(&queue->bounds, i, transform->world_matrix,
+                    &rm->geometries[renderer->model_id]);
+  }
+
+  Frustum frustum;
+  frustum_from_camera(camera, queue->min_screen_size, &frustum);
+  frustum_cull(&frustum, &queue->bounds);
+  return true;
+}
+
+// Collects a packet per visible entity of the render query that survives
+// frustum culling, picks its level of detail and sorts them, end_frame calls
+// it once transforms are up to date
+void render_queue_build(RenderQueue *queue, World *world) {
+  ComponentPool *renderers = &world->component_pools[COMPONENT_MESH_RENDERER];
+  ComponentPool *transforms = &world->component_pools[COMPONENT_TRANSFORM];
+  ComponentPool *visibilities = &world->component_pools[COMPONENT_VISIBILITY];
+  CameraComponent *camera = get_active_camera(world);
+  ResourceManager *rm = get_resource_manager();
+
+  queue->count = 0;
+  queue->batch_count = 0;
+  uint32_t count = kuta_query_count(world->render_query);
+  if (count == 0)
+    return;
+
+  if (!render_queue_reserve(queue, count)) {
+    printf("Error: Failed to grow render queue!\n");
+    return;
+  }
+
+  bool culled = cull_candidates(queue, world, camera);
+
+  for (uint32_t i = 0; i < count; i++) {
+    Entity entity = kuta_query_entity(world->render_query, i);
+    VisibilityComponent *visibility = component_pool_get(visibilities, entity);
+    bool drawn = visibility->visible && visibility->alpha > 0.0f &&
+                 (!culled || queue->bounds.visible[i]);
+
+    visibility->on_screen = drawn;
+    if (!drawn)
+      continue;
+
+    MeshRendererComponent *renderer = component_pool_get(renderers, entity);
+    TransformComponent *transform = component_pool_get(transforms, entity);
+
+    uint32_t index = queue->count++;
+    DrawPacket *packet = &queue->packets[index];
+    packet->model_id = renderer->model_id;
+    packet->texture_id = renderer->texture_id;
+    packet->pipeline = RENDER_PIPELINE_DEFAULT;
+    packet->lod = 0;
+    packet->entity = entity;
+
+    // Without room for the last frame's choice it starts over from the full
+    // mesh, which only costs the hysteresis
+    uint32_t entity_index = ENTITY_INDEX(entity);
+    if (reserve_lods(queue, entity_index + 1)) {
+      packet->lod = select_lod(queue, &rm->geometries[renderer->model_id],
+                               camera, transform->world_matrix,
+                               queue->lods[entity_index]);
+      queue->lods[entity_index] = (uint8_t)packet->lod;
+    }
+
+    RenderPassKind pass = visibility->alpha < RENDER_OPAQUE_ALPHA
+                              ? RENDER_PASS_TRANSPARENT
+                              : RENDER_PASS_OPAQUE;
+    uint32_t depth = quantize_depth(camera, transform->world_matrix[3]);
+    queue->keys[index] = draw_sort_key(pass, packet, depth);
+    queue->order[index] = index;
+  }
+
+  if (queue->count > 1)
+    radix_sort(queue);
+  build_batches(queue);
+}
+
+// Records one instanced draw per batch in [begin, end). The shared geometry
+// buffers are bound once and texture sets only when the previous batch bound
+// another one. In bindless mode the sets are bound once and the instances
+// carry their texture id
+static void record_batches(RenderQueue *queue, VkCommandBuffer cmd_buffer,
+                           uint32_t begin, uint32_t end, State *state) {
+  ResourceManager *rm = get_resource_manager();
+  uint32_t bound_texture = UINT32_MAX;
+
+  bind_geometry_buffer(&rm->geometry_buffer, cmd_buffer);
+  if (state->renderer.bindless) {
+    VkDescriptorSet descriptor_sets[] = {
+        state->renderer.descriptor_sets[state->renderer.current_frame],
+        state->renderer.texture_table,
+    };
+    vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            state->renderer.pipeline_layout, 0, 2,
+                            descriptor_sets, SCENE_OFFSET_COUNT,
+                            state->renderer.scene_offsets);
+  }
+
+  for (uint32_t i = begin; i < end; i++) {
+    const DrawBatch *batch = &queue->batches[i];
+    const DrawPacket *packet = &queue->packets[queue->order[batch->first]];
+
+    if (packet->texture_id != bound_texture && !state->renderer.bindless) {
+      VkDescriptorSet descriptor_set =
+          get_texture_descriptor_set(packet->texture_id);
+      vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              state->renderer.pipeline_layout, 0, 1,
+                              &descriptor_set, SCENE_OFFSET_COUNT,
+                              state->renderer.scene_offsets);
+      bound_texture = packet->texture_id;
+    }
+
+    // gl_InstanceIndex starts at first, indexing this batch's matrices
+    const GeometryData *geometry = &rm->geometries[packet->model_id];
+    const GeometryLod *lod = &geometry->lods[packet->lod];
+    vkCmdDrawIndexed(cmd_buffer, lod->index_count, batch->count,
+                     geometry->first_index + lod->first_index,
+                     geometry->vertex_offset, batch->first);
+  }
+}
+
+// A parallel recording of the queue, each slice of slice_size batches goes
+// into its own secondary command buffer
+typedef struct {
+  RenderQueue *queue;
+  State *state;
+  const VkCommandBufferInheritanceInfo *inheritance;
+  uint32_t slice_size;
+} ParallelRecord;
+
+static void record_slice(void *context, uint32_t begin, uint32_t end) {
+  ParallelRecord *record = context;
+  VkCommandBuffer cmd_buffer = acquire_worker_command_buffer(record->state);
+
+  EXPECT(vkBeginCommandBuffer(
+             cmd_buffer,
+             &(VkCommandBufferBeginInfo){
+                 .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                 .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                          VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+                 .pInheritanceInfo = record->inheritance,
+             }),
+         "Couldn't begin secondary command buffer");
+  bind_scene_state(record->state, cmd_buffer);
+  record_batches(record->queue, cmd_buffer, begin, end, record->state);
+  EXPECT(vkEndCommandBuffer(cmd_buffer),
+         "Couldn't end secondary command buffer");
+
+  record->queue->slices[begin / record->slice_size] = cmd_buffer;
+}
+
+// Slices keep the sort order, so executing them in order draws exactly
+// what recording inline would
+static void record_parallel(RenderQueue *queue, VkCommandBuffer cmd_buffer,
+                            const VkCommandBufferInheritanceInfo *inheritance,
+                            State *state) {
+  uint32_t slice_count =
+      state->renderer.worker_count * RECORD_SLICES_PER_WORKER;
+  uint32_t slice_size = (queue->batch_count + slice_count - 1) / slice_count;
+  slice_count = (queue->batch_count + slice_size - 1) / slice_size;
+
+  if (slice_count > queue->slice_capacity) {
+    VkCommandBuffer *slices =
+        kuta_realloc(KUTA_MEMORY_RENDERER, queue->slices,
+                     sizeof(VkCommandBuffer) * slice_count);
+    EXPECT(!slices, "Failed to grow render queue slices");
+    queue->slices = slices;
+    queue->slice_capacity = slice_count;
+  }
+
+  ParallelRecord record = {
+      .queue = queue,
+      .state = state,
+      .inheritance = inheritance,
+      .slice_size = slice_size,
+  };
+  kuta_job_parallel_for(queue->batch_count, slice_size, record_slice, &record);
+  vkCmdExecuteCommands(cmd_buffer, slice_count, queue->slices);
+}
+
+// Whether render_queue_record splits the queue across the job workers
+bool render_queue_parallel(const RenderQueue *queue, const State *state) {
+  return state->renderer.worker_pools != NULL &&
+         queue->batch_count >= queue->parallel_threshold;
+}
+
+// Ring bytes render_queue_upload allocates, the frame reserves them up front
+// together with everything else it allocates
+VkDeviceSize render_queue_upload_size(const RenderQueue *queue,
+                                      const State *state) {
+  if (queue->count == 0)
+    return 0;
+  return uniform_ring_span(state, sizeof(InstanceData) * queue->count);
+}
+
+// Writes the instance data in sorted order as the first allocation of the
+// frame's uniform ring, where descriptor binding 3 reads it
+void render_queue_upload(RenderQueue *queue, World *world, State *state) {
+  ComponentPool *transforms = &world->component_pools[COMPONENT_TRANSFORM];
+  uint32_t frame = state->renderer.current_frame;
+  if (queue->count == 0)
+    return;
+
+  uint32_t offset;
+  InstanceData *instances = uniform_ring_alloc(
+      state, frame, sizeof(InstanceData) * queue->count, &offset);
+  if (!instances)
+    return;
+
+  for (uint32_t i = 0; i < queue->count; i++) {
+    const DrawPacket *packet = &queue->packets[queue->order[i]];
+    TransformComponent *transform =
+        component_pool_get(transforms, packet->entity);
+    memcpy(instances[i].model, transform->world_matrix, sizeof(mat4));
+    instances[i].texture_id = packet->texture_id;
+  }
+}
+
+// Records the batches. With inheritance set the render pass was begun for
+// secondary command buffers and the job workers record them, see
+// render_queue_parallel
+void render_queue_record(RenderQueue *queue, World *world,
+                         VkCommandBuffer cmd_buffer,
+                         const VkCommandBufferInheritanceInfo *inheritance,
+                         State *state) {
+  if (queue->count == 0)
+    return;
+
+  if (inheritance) {
+    record_parallel(queue, cmd_buffer, inheritance, state);
+    return;
+  }
+  record_batches(queue, cmd_buffer, 0, queue->batch_count, state);
+}
+
+void render_queue_free(RenderQueue *queue) {
+  kuta_free(queue->packets);
+  kuta_free(queue->batches);
+  cull_bounds_free(&queue->bounds);
+  kuta_free(queue->keys);
+  kuta_free(queue->order);
+  kuta_free(queue->scratch_keys);
+  kuta_free(queue->scratch_order);
+  kuta_free(queue->lods);
+  kuta_free(queue->slices);
+  memset(queue, 0, sizeof(RenderQueue));
+}
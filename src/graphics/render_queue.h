@@ -0,0 +1,20 @@
+#pragma once
+
+#include "internal_types.h"
+#include "types.h"
+
+void render_queue_build(RenderQueue *queue, World *world);
+
+VkDeviceSize render_queue_upload_size(const RenderQueue *queue,
+                                      const State *state);
+
+void render_queue_upload(RenderQueue *queue, World *world, State *state);
+
+bool render_queue_parallel(const RenderQueue *queue, const State *state);
+
+void render_queue_record(RenderQueue *queue, World *world,
+                         VkCommandBuffer cmd_buffer,
+                         const VkCommandBufferInheritanceInfo *inheritance,
+                         State *state);
+
+void render_queue_free(RenderQueue *queue);
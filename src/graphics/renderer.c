@@ -6,21 +6,52 @@
 #include <string.h>
 #include <vulkan/vulkan_core.h>
 
+#include "allocator.h"
+#include "arena.h"
 #include "buffer_data.h"
+#include "descriptors.h"
 #include "internal_types.h"
+#include "kuta.h"
 #include "kuta_internal.h"
 #include "utils.h"
 
+#define FRAG_SHADER_PATH "./assets/shaders/frag.spv"
+#define FRAG_BINDLESS_SHADER_PATH "./assets/shaders/frag_bindless.spv"
+
+// Bindless mode samples the texture table from its own fragment shader
+// variant, without it the renderer keeps a descriptor set per texture. Has
+// to run before the descriptor set layouts are created
+void check_bindless_shader(State *state) {
+  if (!state->renderer.bindless)
+    return;
+
+  size_t size;
+  const uint32_t *shader_src = read_file(FRAG_BINDLESS_SHADER_PATH, &size);
+  if (shader_src) {
+    temp_free((void *)shader_src);
+    return;
+  }
+
+  printf("Error: Failed to load frag_bindless.spv, build the kuta_shaders "
+         "target to compile it. Binding a descriptor set per texture!\n");
+  state->renderer.bindless = false;
+}
+
 void create_graphics_pipeline(State *state) {
   size_t vert_size;
   const uint32_t *vert_shader_src =
       read_file("./assets/shaders/vert.spv", &vert_size);
-  EXPECT(!vert_shader_src, "emtpy sprv file");
+  EXPECT(!vert_shader_src,
+         "Failed to load vert.spv, build the kuta_shaders target to compile "
+         "it");
 
   size_t frag_size;
-  const uint32_t *frag_shader_src =
-      read_file("./assets/shaders/frag.spv", &frag_size);
-  EXPECT(!frag_shader_src, "emtpy sprv file");
+  const uint32_t *frag_shader_src = read_file(
+      state->renderer.bindless ? FRAG_BINDLESS_SHADER_PATH : FRAG_SHADER_PATH,
+      &frag_size);
+  EXPECT(!frag_shader_src,
+         "Failed to load the fragment shader, build the kuta_shaders target "
+         "to compile it");
 
   VkShaderModule vertex_shader_module, fragment_shader_module;
 
@@ -84,20 +115,19 @@ void create_graphics_pipeline(State *state) {
       .alphaBlendOp = VK_BLEND_OP_ADD,
   }};
 
-  VkPushConstantRange push_constant_range = {
-      .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-      .offset = 0,
-      .size = sizeof(mat4) // Size of your model matrix
+  // Bindless mode adds the texture table as set 1, the instances say which
+  // of its textures they're drawn with
+  VkDescriptorSetLayout set_layouts[] = {
+      state->renderer.descriptor_set_layout,
+      state->renderer.texture_table_layout,
   };
 
   EXPECT(vkCreatePipelineLayout(
              state->vk_core.device,
              &(VkPipelineLayoutCreateInfo){
                  .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-                 .setLayoutCount = 1,
-                 .pSetLayouts = &state->renderer.descriptor_set_layout,
-                 .pushConstantRangeCount = 1,
-                 .pPushConstantRanges = &push_constant_range,
+                 .setLayoutCount = state->renderer.bindless ? 2 : 1,
+                 .pSetLayouts = set_layouts,
              },
              state->vk_core.allocator, &state->renderer.pipeline_layout),
          "Failed to create pipeline layout")
@@ -193,8 +223,8 @@ void create_graphics_pipeline(State *state) {
   vkDestroyShaderModule(state->vk_core.device, fragment_shader_module,
                         state->vk_core.allocator);
 
-  free((void *)vert_shader_src);
-  free((void *)frag_shader_src);
+  temp_free((void *)vert_shader_src);
+  temp_free((void *)frag_shader_src);
 }
 
 void destroy_graphics_pipeline(State *state) {
@@ -205,8 +235,18 @@ void destroy_graphics_pipeline(State *state) {
                           state->vk_core.allocator);
 }
 
-void create_render_pass(State *state) {
+// The scene's pass clears its attachments. With load set it keeps what an
+// earlier pass of the frame drew instead, which the late occlusion phase
+// draws on top of. Both share the framebuffers, only their load and store
+// ops differ
+static void create_scene_render_pass(State *state, bool load,
+                                     VkRenderPass *render_pass) {
   VkFormat image_format = state->swp_ch.image_format;
+  // The depth pyramid is built from the first pass's depth
+  VkAttachmentStoreOp depth_store_op =
+      state->renderer.occlusion_culling && !load
+          ? VK_ATTACHMENT_STORE_OP_STORE
+          : VK_ATTACHMENT_STORE_OP_DONT_CARE;
 
   VkAttachmentReference color_attachment_ref = {
       .attachment = 0,
@@ -228,9 +268,11 @@ void create_render_pass(State *state) {
       {
           .format = image_format,
           .samples = state->renderer.msaa_samples,
-          .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+          .initialLayout = load ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+                                : VK_IMAGE_LAYOUT_UNDEFINED,
           .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-          .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+          .loadOp =
+              load ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR,
           .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
           .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
           .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
@@ -239,10 +281,13 @@ void create_render_pass(State *state) {
       {
           .format = find_depth_format(state),
           .samples = state->renderer.msaa_samples,
-          .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+          .initialLayout =
+              load ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+                   : VK_IMAGE_LAYOUT_UNDEFINED,
           .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-          .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-          .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+          .loadOp =
+              load ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR,
+          .storeOp = depth_store_op,
           .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
           .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
       },
@@ -266,6 +311,10 @@ void create_render_pass(State *state) {
       .pResolveAttachments = &color_attachment_resolve_ref,
   }};
 
+  VkAccessFlags load_access =
+      load ? VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+           : 0;
   VkSubpassDependency dependency = {
       .srcSubpass = VK_SUBPASS_EXTERNAL,
       .dstSubpass = 0,
@@ -276,7 +325,8 @@ void create_render_pass(State *state) {
       .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
       .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
-                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                       load_access,
   };
 
   EXPECT(vkCreateRenderPass(
@@ -290,19 +340,32 @@ void create_render_pass(State *state) {
                  .dependencyCount = 1,
                  .pDependencies = &dependency,
              },
-             state->vk_core.allocator, &state->renderer.render_pass),
+             state->vk_core.allocator, render_pass),
          "Failed to create a render pass")
 }
 
+void create_render_pass(State *state) {
+  create_scene_render_pass(state, false, &state->renderer.render_pass);
+  if (state->renderer.occlusion_culling)
+    create_scene_render_pass(state, true, &state->renderer.render_pass_load);
+}
+
 void destroy_render_pass(State *state) {
   vkDestroyRenderPass(state->vk_core.device, state->renderer.render_pass,
                       state->vk_core.allocator);
+  if (state->renderer.render_pass_load != VK_NULL_HANDLE) {
+    vkDestroyRenderPass(state->vk_core.device,
+                        state->renderer.render_pass_load,
+                        state->vk_core.allocator);
+    state->renderer.render_pass_load = VK_NULL_HANDLE;
+  }
 }
 
 void create_frame_buffers(State *state) {
   uint32_t frame_buffer_count = state->swp_ch.image_count;
   state->renderer.frame_buffers =
-      malloc(frame_buffer_count * sizeof(VkFramebuffer));
+      kuta_malloc(KUTA_MEMORY_RENDERER,
+                  frame_buffer_count * sizeof(VkFramebuffer));
   EXPECT(state->renderer.frame_buffers == NULL,
          "Couldn't allocate memory for framebuffers array")
   VkExtent2D frame_buffers_extent = state->swp_ch.extent;
@@ -341,7 +404,96 @@ void destroy_frame_buffers(State *state) {
                          state->vk_core.allocator);
   }
 
-  free(state->renderer.frame_buffers);
+  kuta_free(state->renderer.frame_buffers);
+}
+
+// Command pools are externally synchronized, so every job worker records
+// into pools of its own. They're reset as a whole once per frame
+static void create_worker_command_pools(State *state) {
+  uint32_t worker_count = kuta_job_worker_count();
+  if (worker_count <= 1)
+    return;
+
+  uint32_t count = MAX_FRAMES_IN_FLIGHT * worker_count;
+  state->renderer.worker_pools =
+      kuta_calloc(KUTA_MEMORY_RENDERER, count, sizeof(WorkerCommandPool));
+  EXPECT(!state->renderer.worker_pools,
+         "Failed to allocate worker command pools");
+  state->renderer.worker_count = worker_count;
+
+  for (uint32_t i = 0; i < count; i++) {
+    EXPECT(vkCreateCommandPool(
+               state->vk_core.device,
+               &(VkCommandPoolCreateInfo){
+                   .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                   .queueFamilyIndex = state->vk_core.graphics_queue_family,
+                   .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+               },
+               state->vk_core.allocator,
+               &state->renderer.worker_pools[i].pool),
+           "Failed to create worker command pool %u", i);
+  }
+}
+
+static void destroy_worker_command_pools(State *state) {
+  uint32_t count = MAX_FRAMES_IN_FLIGHT * state->renderer.worker_count;
+  for (uint32_t i = 0; i < count; i++) {
+    WorkerCommandPool *pool = &state->renderer.worker_pools[i];
+    vkDestroyCommandPool(state->vk_core.device, pool->pool,
+                         state->vk_core.allocator);
+    kuta_free(pool->buffers);
+  }
+  kuta_free(state->renderer.worker_pools);
+  state->renderer.worker_pools = NULL;
+  state->renderer.worker_count = 0;
+}
+
+// The frame's fence has signalled, so nothing recorded from its pools is
+// still executing
+static void reset_worker_command_pools(State *state, uint32_t frame) {
+  uint32_t worker_count = state->renderer.worker_count;
+  for (uint32_t i = 0; i < worker_count; i++) {
+    WorkerCommandPool *pool =
+        &state->renderer.worker_pools[frame * worker_count + i];
+    if (pool->used == 0)
+      continue;
+    vkResetCommandPool(state->vk_core.device, pool->pool, 0);
+    pool->used = 0;
+  }
+}
+
+// Hands out a secondary command buffer from the calling job worker's pool
+// of the current frame, allocating more when they ran out
+VkCommandBuffer acquire_worker_command_buffer(State *state) {
+  uint32_t worker = kuta_job_worker_index();
+  EXPECT(worker >= state->renderer.worker_count,
+         "Secondary command buffers are only recorded by job workers");
+  WorkerCommandPool *pool =
+      &state->renderer.worker_pools[state->renderer.current_frame *
+                                        state->renderer.worker_count +
+                                    worker];
+
+  if (pool->used == pool->capacity) {
+    uint32_t capacity = pool->capacity ? pool->capacity * 2 : 4;
+    VkCommandBuffer *buffers =
+        kuta_realloc(KUTA_MEMORY_RENDERER, pool->buffers,
+                     sizeof(VkCommandBuffer) * capacity);
+    EXPECT(!buffers, "Failed to grow worker command buffers");
+    pool->buffers = buffers;
+
+    EXPECT(vkAllocateCommandBuffers(
+               state->vk_core.device,
+               &(VkCommandBufferAllocateInfo){
+                   .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                   .commandPool = pool->pool,
+                   .commandBufferCount = capacity - pool->capacity,
+                   .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+               },
+               buffers + pool->capacity),
+           "Failed to allocate secondary command buffers");
+    pool->capacity = capacity;
+  }
+  return pool->buffers[pool->used++];
 }
 
 void create_command_pool(State *state) {
@@ -354,16 +506,19 @@ void create_command_pool(State *state) {
              },
              state->vk_core.allocator, &state->renderer.command_pool),
          "Failed to create command pool")
+  create_worker_command_pools(state);
 }
 
 void destroy_coommand_pool(State *state) {
+  destroy_worker_command_pools(state);
   vkDestroyCommandPool(state->vk_core.device, state->renderer.command_pool,
                        state->vk_core.allocator);
 }
 
 void allocate_command_buffer(State *state) {
   uint32_t count = state->swp_ch.image_count;
-  state->renderer.command_buffers = malloc(count * sizeof(VkCommandBuffer));
+  state->renderer.command_buffers =
+      kuta_malloc(KUTA_MEMORY_RENDERER, count * sizeof(VkCommandBuffer));
   EXPECT(!state->renderer.command_buffers,
          "Failed to allocate command buffers array");
 
@@ -383,10 +538,11 @@ void create_sync_objects(State *state) {
   uint32_t image_count = state->swp_ch.image_count;
 
   state->renderer.acquired_image_semaphore =
-      malloc(image_count * sizeof(VkSemaphore));
+      kuta_malloc(KUTA_MEMORY_RENDERER, image_count * sizeof(VkSemaphore));
   state->renderer.finished_render_semaphore =
-      malloc(image_count * sizeof(VkSemaphore));
-  state->renderer.in_flight_fence = malloc(image_count * sizeof(VkFence));
+      kuta_malloc(KUTA_MEMORY_RENDERER, image_count * sizeof(VkSemaphore));
+  state->renderer.in_flight_fence =
+      kuta_malloc(KUTA_MEMORY_RENDERER, image_count * sizeof(VkFence));
 
   for (uint32_t i = 0; i < image_count; ++i) {
     EXPECT(
@@ -425,9 +581,67 @@ void destroy_sync_objects(State *state) {
                        state->renderer.finished_render_semaphore[i],
                        state->vk_core.allocator);
   }
-  free(state->renderer.in_flight_fence);
-  free(state->renderer.acquired_image_semaphore);
-  free(state->renderer.finished_render_semaphore);
+  kuta_free(state->renderer.in_flight_fence);
+  kuta_free(state->renderer.acquired_image_semaphore);
+  kuta_free(state->renderer.finished_render_semaphore);
+}
+
+// Pipeline and dynamic state the scene's draws start from, every secondary
+// command buffer has to bind them again
+void bind_scene_state(State *state, VkCommandBuffer command_buffer) {
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    state->renderer.graphics_pipeline);
+
+  VkViewport viewport = {.x = 0.0f,
+                         .y = 0.0f,
+                         .width = state->swp_ch.extent.width,
+                         .height = state->swp_ch.extent.height,
+                         .minDepth = 0.0f,
+                         .maxDepth = 1.0f};
+  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+  VkRect2D scissor = {.offset = {0, 0}, .extent = state->swp_ch.extent};
+  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+}
+
+// Records one pass over the scene's attachments drawing the render queue's
+// batches of the given cull phase. Large queues are recorded by the job
+// workers into secondary command buffers the pass executes
+static void record_scene_pass(State *state, World *world,
+                              VkCommandBuffer command_buffer,
+                              VkRenderPass render_pass,
+                              const VkClearValue *clear_values,
+                              CullPhase phase) {
+  uint32_t image_index = state->swp_ch.acquired_image_index;
+  bool parallel = render_system_draw_parallel();
+
+  vkCmdBeginRenderPass(
+      command_buffer,
+      &(VkRenderPassBeginInfo){
+          .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+          .renderPass = render_pass,
+          .framebuffer = state->renderer.frame_buffers[image_index],
+          .renderArea = (VkRect2D){.extent = state->swp_ch.extent},
+          .clearValueCount = 2,
+          .pClearValues = clear_values,
+      },
+      parallel ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+               : VK_SUBPASS_CONTENTS_INLINE);
+
+  if (parallel) {
+    VkCommandBufferInheritanceInfo inheritance = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+        .renderPass = render_pass,
+        .subpass = 0,
+        .framebuffer = state->renderer.frame_buffers[image_index],
+    };
+    render_system_draw(world, command_buffer, phase, &inheritance);
+  } else {
+    bind_scene_state(state, command_buffer);
+    render_system_draw(world, command_buffer, phase, NULL);
+  }
+
+  vkCmdEndRenderPass(command_buffer);
 }
 
 void record_command_buffer(BufferData *buffer_data, Settings *settings,
@@ -436,6 +650,21 @@ void record_command_buffer(BufferData *buffer_data, Settings *settings,
       state->renderer.command_buffers[state->renderer.current_frame];
 
   vkResetCommandBuffer(command_buffer, 0);
+  reset_worker_command_pools(state, state->renderer.current_frame);
+
+  // Everything the frame allocates from its ring is reserved at once, so the
+  // ring can only be replaced before the first offset is handed out. The
+  // instances go first, descriptor binding 3 reads from the ring's start
+  uint32_t frame = state->renderer.current_frame;
+  uniform_ring_reset(state, frame);
+  VkDeviceSize ring_size = render_system_upload_size() +
+                           uniform_ring_span(state, sizeof(UBO)) +
+                           uniform_ring_span(state, sizeof(LightingUBO));
+  if (uniform_ring_reserve(state, frame, ring_size))
+    write_frame_descriptors(state, get_resource_manager(), frame);
+  render_system_upload(world);
+  update_camera_uniform_buffer(world, state, frame);
+  update_lighting_uniform_buffer(world, state, frame);
 
   EXPECT(vkBeginCommandBuffer(
              command_buffer,
@@ -452,38 +681,22 @@ void record_command_buffer(BufferData *buffer_data, Settings *settings,
                                   }
 
   };
-  uint32_t image_index = state->swp_ch.acquired_image_index;
 
-  vkCmdBeginRenderPass(
-      command_buffer,
-      &(VkRenderPassBeginInfo){
-          .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-          .renderPass = state->renderer.render_pass,
-          .framebuffer = state->renderer.frame_buffers[image_index],
-          .renderArea = (VkRect2D){.extent = state->swp_ch.extent},
-          .clearValueCount =
-              (uint32_t)(sizeof(clear_values) / sizeof(clear_values[0])),
-          .pClearValues = clear_values,
-      },
-      VK_SUBPASS_CONTENTS_INLINE);
+  // Compute can't be dispatched inside a render pass
+  if (state->renderer.gpu_driven)
+    render_system_cull(world, command_buffer, CULL_PHASE_EARLY);
 
-  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                    state->renderer.graphics_pipeline);
+  record_scene_pass(state, world, command_buffer, state->renderer.render_pass,
+                    clear_values, CULL_PHASE_EARLY);
 
-  VkViewport viewport = {.x = 0.0f,
-                         .y = 0.0f,
-                         .width = state->swp_ch.extent.width,
-                         .height = state->swp_ch.extent.height,
-                         .minDepth = 0.0f,
-                         .maxDepth = 1.0f};
-  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
-
-  VkRect2D scissor = {.offset = {0, 0}, .extent = state->swp_ch.extent};
-  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
-
-  render_system_draw(world, command_buffer);
-
-  vkCmdEndRenderPass(command_buffer);
+  // What last frame's depth hid is tested again against this frame's, the
+  // survivors are drawn on top
+  if (state->renderer.occlusion_culling) {
+    render_system_cull(world, command_buffer, CULL_PHASE_LATE);
+    record_scene_pass(state, world, command_buffer,
+                      state->renderer.render_pass_load, clear_values,
+                      CULL_PHASE_LATE);
+  }
 
   EXPECT(vkEndCommandBuffer(command_buffer), "Couldn't end command buffer");
 }
@@ -494,9 +707,6 @@ void submit_command_buffer(BufferData *buffer_data, State *state,
   uint32_t image_index = state->swp_ch.acquired_image_index;
   VkCommandBuffer command_buffer = state->renderer.command_buffers[frame];
 
-  update_camera_uniform_buffer(world, buffer_data, state, frame);
-  update_lighting_uniform_buffer(world, state, frame);
-
   EXPECT(vkQueueSubmit(
              state->vk_core.graphics_queue, 1,
              &(VkSubmitInfo){
@@ -524,7 +734,7 @@ void destroy_renderer(State *state) {
     vkFreeCommandBuffers(state->vk_core.device, state->renderer.command_pool,
                          state->swp_ch.image_count,
                          state->renderer.command_buffers);
-    free(state->renderer.command_buffers);
+    kuta_free(state->renderer.command_buffers);
   }
 
   destroy_sync_objects(state);
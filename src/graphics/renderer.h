@@ -13,12 +13,18 @@ void destroy_frame_buffers(State *state);
 
 void destroy_renderer(State *state);
 
+void check_bindless_shader(State *state);
+
 void create_graphics_pipeline(State *state);
 
 void create_render_pass(State *state);
 
 void create_command_pool(State *state);
 
+VkCommandBuffer acquire_worker_command_buffer(State *state);
+
+void bind_scene_state(State *state, VkCommandBuffer command_buffer);
+
 void allocate_command_buffer(State *state);
 
 void create_sync_objects(State *state);
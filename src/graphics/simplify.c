@@ -0,0 +1,442 @@
+#include <cglm/cglm.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "internal_types.h"
+#include "simplify.h"
+
+#define SLOT_EMPTY UINT32_MAX
+#define EDGE_EMPTY UINT64_MAX
+
+// Only the cheapest collapses of a pass are taken, up to this factor of the
+// cost the pass needs to reach its target
+#define PASS_COST_SLACK 1.5f
+
+// Sum of the planes of the triangles around a vertex, weighted by area.
+// Evaluated at a point it gives the weighted squared distance to them
+typedef struct {
+  float a2, b2, c2, d2;
+  float ab, ac, ad, bc, bd, cd;
+  float weight;
+} Quadric;
+
+typedef struct {
+  uint32_t from;
+  uint32_t to;
+  float cost;
+} Collapse;
+
+// Scratch memory of a simplify_mesh call
+typedef struct {
+  uint32_t *welded;
+  uint32_t *slots;
+  uint8_t *locked;
+  uint8_t *touched;
+  Quadric *quadrics;
+  uint32_t *remap;
+  uint32_t *offsets;
+  uint32_t *adjacency;
+  Collapse *collapses;
+} Scratch;
+
+static uint32_t hash_u32(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+// Power of two at least twice count, keeps the probe chains short
+static uint32_t table_size(size_t count) {
+  uint32_t size = 16;
+  while (size < count * 2) {
+    size *= 2;
+  }
+  return size;
+}
+
+static uint32_t hash_position(const float *pos) {
+  uint32_t bits[3];
+  memcpy(bits, pos, sizeof(bits));
+  return hash_u32(bits[0] ^ hash_u32(bits[1] ^ hash_u32(bits[2])));
+}
+
+// Points every vertex at the first one with the same position. UV and normal
+// seams split a position into several vertices that have to move together
+static void weld_positions(const Vertex *vertices, size_t vertex_count,
+                           uint32_t *slots, uint32_t *welded) {
+  uint32_t size = table_size(vertex_count);
+  memset(slots, 0xFF, sizeof(uint32_t) * size);
+
+  for (size_t v = 0; v < vertex_count; v++) {
+    const float *pos = vertices[v].pos;
+    uint32_t slot = hash_position(pos) & (size - 1);
+    while (slots[slot] != SLOT_EMPTY &&
+           memcmp(vertices[slots[slot]].pos, pos, sizeof(vec3)) != 0) {
+      slot = (slot + 1) & (size - 1);
+    }
+    if (slots[slot] == SLOT_EMPTY)
+      slots[slot] = (uint32_t)v;
+    welded[v] = slots[slot];
+  }
+}
+
+static uint64_t edge_key(uint32_t a, uint32_t b) {
+  return (uint64_t)a << 32 | b;
+}
+
+static uint32_t edge_slot(const uint64_t *edges, uint32_t size, uint64_t key) {
+  uint32_t slot =
+      hash_u32((uint32_t)key ^ hash_u32((uint32_t)(key >> 32))) & (size - 1);
+  while (edges[slot] != EDGE_EMPTY && edges[slot] != key) {
+    slot = (slot + 1) & (size - 1);
+  }
+  return slot;
+}
+
+// Locks what a collapse would tear open: vertices on a seam, whose twins
+// would stay behind, and vertices on an open border. Border edges are the
+// ones whose reverse no triangle uses
+static bool find_locked(const uint32_t *indices, size_t index_count,
+                        size_t vertex_count, const uint32_t *welded,
+                        uint8_t *locked) {
+  memset(locked, 0, vertex_count);
+  for (size_t v = 0; v < vertex_count; v++) {
+    if (welded[v] != v) {
+      locked[v] = 1;
+      locked[welded[v]] = 1;
+    }
+  }
+
+  uint32_t size = table_size(index_count);
+  uint64_t *edges = temp_alloc(sizeof(uint64_t) * size, sizeof(uint64_t));
+  if (!edges)
+    return false;
+  memset(edges, 0xFF, sizeof(uint64_t) * size);
+
+  for (size_t i = 0; i < index_count; i++) {
+    size_t next = i % 3 == 2 ? i - 2 : i + 1;
+    uint64_t key = edge_key(welded[indices[i]], welded[indices[next]]);
+    edges[edge_slot(edges, size, key)] = key;
+  }
+  for (size_t i = 0; i < index_count; i++) {
+    size_t next = i % 3 == 2 ? i - 2 : i + 1;
+    uint64_t reverse = edge_key(welded[indices[next]], welded[indices[i]]);
+    if (edges[edge_slot(edges, size, reverse)] == EDGE_EMPTY) {
+      locked[indices[i]] = 1;
+      locked[indices[next]] = 1;
+    }
+  }
+
+  temp_free(edges);
+  return true;
+}
+
+static void quadric_add_triangle(Quadric *quadric, const float *p0,
+                                 const float *p1, const float *p2) {
+  vec3 e1, e2, normal;
+  glm_vec3_sub((float *)p1, (float *)p0, e1);
+  glm_vec3_sub((float *)p2, (float *)p0, e2);
+  glm_vec3_cross(e1, e2, normal);
+
+  float length = glm_vec3_norm(normal);
+  if (length == 0.0f)
+    return;
+  glm_vec3_scale(normal, 1.0f / length, normal);
+
+  float a = normal[0], b = normal[1], c = normal[2];
+  float d = -glm_vec3_dot(normal, (float *)p0);
+  float weight = length * 0.5f;
+
+  quadric->a2 += a * a * weight;
+  quadric->b2 += b * b * weight;
+  quadric->c2 += c * c * weight;
+  quadric->d2 += d * d * weight;
+  quadric->ab += a * b * weight;
+  quadric->ac += a * c * weight;
+  quadric->ad += a * d * weight;
+  quadric->bc += b * c * weight;
+  quadric->bd += b * d * weight;
+  quadric->cd += c * d * weight;
+  quadric->weight += weight;
+}
+
+static void quadric_merge(Quadric *quadric, const Quadric *other) {
+  float *dst = (float *)quadric;
+  const float *src = (const float *)other;
+  for (size_t i = 0; i < sizeof(Quadric) / sizeof(float); i++) {
+    dst[i] += src[i];
+  }
+}
+
+// Mean squared distance from pos to the planes of both quadrics
+static float quadric_cost(const Quadric *q0, const Quadric *q1,
+                          const float *pos) {
+  Quadric q = *q0;
+  quadric_merge(&q, q1);
+  if (q.weight == 0.0f)
+    return 0.0f;
+
+  float x = pos[0], y = pos[1], z = pos[2];
+  float cost = q.a2 * x * x + q.b2 * y * y + q.c2 * z * z + q.d2 +
+               2.0f * (q.ab * x * y + q.ac * x * z + q.bc * y * z) +
+               2.0f * (q.ad * x + q.bd * y + q.cd * z);
+  return fabsf(cost) / q.weight;
+}
+
+// Triangles around each vertex, those of vertex v are adjacency[offsets[v]]
+// up to adjacency[offsets[v + 1]]
+static void build_adjacency(const uint32_t *indices, size_t index_count,
+                            size_t vertex_count, uint32_t *offsets,
+                            uint32_t *adjacency) {
+  memset(offsets, 0, sizeof(uint32_t) * (vertex_count + 1));
+  for (size_t i = 0; i < index_count; i++) {
+    offsets[indices[i] + 1]++;
+  }
+  for (size_t v = 0; v < vertex_count; v++) {
+    offsets[v + 1] += offsets[v];
+  }
+  for (size_t i = 0; i < index_count; i++) {
+    adjacency[offsets[indices[i]]++] = (uint32_t)(i / 3);
+  }
+  // Filling moved every offset to the start of the next vertex
+  for (size_t v = vertex_count; v > 0; v--) {
+    offsets[v] = offsets[v - 1];
+  }
+  offsets[0] = 0;
+}
+
+// True when moving from onto to would turn one of from's remaining
+// triangles over
+static bool collapse_flips(const Vertex *vertices, const uint32_t *indices,
+                           const Scratch *scratch, uint32_t from,
+                           uint32_t to) {
+  for (uint32_t k = scratch->offsets[from]; k < scratch->offsets[from + 1];
+       k++) {
+    const uint32_t *triangle = &indices[scratch->adjacency[k] * 3];
+    if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+      continue;
+
+    vec3 p[3], e1, e2, before, after;
+    for (uint32_t c = 0; c < 3; c++) {
+      glm_vec3_copy((float *)vertices[triangle[c]].pos, p[c]);
+    }
+    glm_vec3_sub(p[1], p[0], e1);
+    glm_vec3_sub(p[2], p[0], e2);
+    glm_vec3_cross(e1, e2, before);
+
+    for (uint32_t c = 0; c < 3; c++) {
+      if (triangle[c] == from)
+        glm_vec3_copy((float *)vertices[to].pos, p[c]);
+    }
+    glm_vec3_sub(p[1], p[0], e1);
+    glm_vec3_sub(p[2], p[0], e2);
+    glm_vec3_cross(e1, e2, after);
+
+    if (glm_vec3_dot(before, after) <= 0.0f)
+      return true;
+  }
+  return false;
+}
+
+static int compare_collapses(const void *a, const void *b) {
+  float ca = ((const Collapse *)a)->cost;
+  float cb = ((const Collapse *)b)->cost;
+  return (ca > cb) - (ca < cb);
+}
+
+// Every edge once, in both directions whose start isn't locked. The cost
+// is that of the merged quadrics at the vertex kept
+static size_t collect_collapses(const Vertex *vertices,
+                                const uint32_t *indices, size_t index_count,
+                                const Scratch *scratch) {
+  size_t count = 0;
+  for (size_t i = 0; i < index_count; i++) {
+    size_t next = i % 3 == 2 ? i - 2 : i + 1;
+    uint32_t a = indices[i];
+    uint32_t b = indices[next];
+    if (a >= b)
+      continue;
+
+    const Quadric *qa = &scratch->quadrics[scratch->welded[a]];
+    const Quadric *qb = &scratch->quadrics[scratch->welded[b]];
+    if (!scratch->locked[a]) {
+      scratch->collapses[count++] = (Collapse){
+          .from = a, .to = b, .cost = quadric_cost(qa, qb, vertices[b].pos)};
+    }
+    if (!scratch->locked[b]) {
+      scratch->collapses[count++] = (Collapse){
+          .from = b, .to = a, .cost = quadric_cost(qa, qb, vertices[a].pos)};
+    }
+  }
+  return count;
+}
+
+// Takes the cheapest collapses that don't share a triangle with one taken
+// before, stopping once about enough triangles are gone. Without
+// limit_cost it goes as far up the list as it has to
+static size_t apply_collapses(const Vertex *vertices, const uint32_t *indices,
+                              size_t vertex_count, size_t collapse_count,
+                              size_t triangle_goal, bool limit_cost,
+                              Scratch *scratch, float *max_cost) {
+  memset(scratch->touched, 0, vertex_count);
+  for (size_t v = 0; v < vertex_count; v++) {
+    scratch->remap[v] = (uint32_t)v;
+  }
+
+  // An interior collapse removes two triangles
+  size_t wanted = (triangle_goal + 1) / 2;
+  size_t limit_index = wanted < collapse_count ? wanted : collapse_count - 1;
+  float cost_limit = scratch->collapses[limit_index].cost * PASS_COST_SLACK;
+
+  size_t applied = 0;
+  for (size_t i = 0; i < collapse_count && applied < wanted; i++) {
+    const Collapse *collapse = &scratch->collapses[i];
+    if (limit_cost && collapse->cost > cost_limit)
+      break;
+    if (scratch->touched[collapse->from] || scratch->touched[collapse->to])
+      continue;
+    if (collapse_flips(vertices, indices, scratch, collapse->from,
+                       collapse->to))
+      continue;
+
+    scratch->remap[collapse->from] = collapse->to;
+    quadric_merge(&scratch->quadrics[scratch->welded[collapse->to]],
+                  &scratch->quadrics[scratch->welded[collapse->from]]);
+    *max_cost = glm_max(*max_cost, collapse->cost);
+
+    uint32_t from = collapse->from;
+    for (uint32_t k = scratch->offsets[from]; k < scratch->offsets[from + 1];
+         k++) {
+      const uint32_t *triangle = &indices[scratch->adjacency[k] * 3];
+      for (uint32_t c = 0; c < 3; c++) {
+        scratch->touched[triangle[c]] = 1;
+      }
+    }
+    applied++;
+  }
+  return applied;
+}
+
+static void *scratch_take(uint8_t **cursor, size_t size) {
+  void *ptr = *cursor;
+  *cursor += (size + 15) & ~(size_t)15;
+  return ptr;
+}
+
+// Removes triangles by collapsing edges onto one of their two vertices until
+// about target_index_count indices are left. The vertices themselves stay as
+// they are so the result shares the vertex buffer. Seams and open borders
+// are kept. Returns the index count written to destination, which has room
+// for index_count, and the largest distance a surface moved in error
+size_t simplify_mesh(const Vertex *vertices, size_t vertex_count,
+                     const uint32_t *indices, size_t index_count,
+                     size_t target_index_count, uint32_t *destination,
+                     float *error) {
+  memcpy(destination, indices, sizeof(uint32_t) * index_count);
+  *error = 0.0f;
+  if (index_count <= target_index_count || vertex_count == 0)
+    return index_count;
+
+  size_t sizes[] = {
+      sizeof(uint32_t) * vertex_count,
+      sizeof(uint32_t) * table_size(vertex_count),
+      vertex_count,
+      vertex_count,
+      sizeof(Quadric) * vertex_count,
+      sizeof(uint32_t) * vertex_count,
+      sizeof(uint32_t) * (vertex_count + 1),
+      sizeof(uint32_t) * index_count,
+      sizeof(Collapse) * index_count * 2,
+  };
+  size_t total = 0;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    total += (sizes[i] + 15) & ~(size_t)15;
+  }
+  uint8_t *memory = temp_alloc(total, 16);
+  if (!memory) {
+    printf("Error: Failed to allocate mesh simplification memory!\n");
+    return index_count;
+  }
+
+  uint8_t *cursor = memory;
+  Scratch scratch = {
+      .welded = scratch_take(&cursor, sizes[0]),
+      .slots = scratch_take(&cursor, sizes[1]),
+      .locked = scratch_take(&cursor, sizes[2]),
+      .touched = scratch_take(&cursor, sizes[3]),
+      .quadrics = scratch_take(&cursor, sizes[4]),
+      .remap = scratch_take(&cursor, sizes[5]),
+      .offsets = scratch_take(&cursor, sizes[6]),
+      .adjacency = scratch_take(&cursor, sizes[7]),
+      .collapses = scratch_take(&cursor, sizes[8]),
+  };
+
+  weld_positions(vertices, vertex_count, scratch.slots, scratch.welded);
+  if (!find_locked(indices, index_count, vertex_count, scratch.welded,
+                   scratch.locked)) {
+    printf("Error: Failed to allocate mesh simplification memory!\n");
+    temp_free(memory);
+    return index_count;
+  }
+
+  memset(scratch.quadrics, 0, sizes[4]);
+  for (size_t i = 0; i < index_count; i += 3) {
+    const float *p0 = vertices[indices[i]].pos;
+    const float *p1 = vertices[indices[i + 1]].pos;
+    const float *p2 = vertices[indices[i + 2]].pos;
+    quadric_add_triangle(&scratch.quadrics[scratch.welded[indices[i]]], p0,
+                         p1, p2);
+    quadric_add_triangle(&scratch.quadrics[scratch.welded[indices[i + 1]]],
+                         p0, p1, p2);
+    quadric_add_triangle(&scratch.quadrics[scratch.welded[indices[i + 2]]],
+                         p0, p1, p2);
+  }
+
+  size_t count = index_count;
+  float max_cost = 0.0f;
+  while (count > target_index_count) {
+    build_adjacency(destination, count, vertex_count, scratch.offsets,
+                    scratch.adjacency);
+    size_t collapse_count =
+        collect_collapses(vertices, destination, count, &scratch);
+    if (collapse_count == 0)
+      break;
+    qsort(scratch.collapses, collapse_count, sizeof(Collapse),
+          compare_collapses);
+
+    // The cheap end of the list can be all flips, then the pass has to
+    // reach further
+    size_t triangle_goal = (count - target_index_count + 2) / 3;
+    if (apply_collapses(vertices, destination, vertex_count, collapse_count,
+                        triangle_goal, true, &scratch, &max_cost) == 0 &&
+        apply_collapses(vertices, destination, vertex_count, collapse_count,
+                        triangle_goal, false, &scratch, &max_cost) == 0)
+      break;
+
+    // Triangles that lost a corner to the collapse are gone
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i += 3) {
+      uint32_t a = scratch.remap[destination[i]];
+      uint32_t b = scratch.remap[destination[i + 1]];
+      uint32_t c = scratch.remap[destination[i + 2]];
+      if (a == b || b == c || a == c)
+        continue;
+      destination[kept++] = a;
+      destination[kept++] = b;
+      destination[kept++] = c;
+    }
+    count = kept;
+  }
+
+  temp_free(memory);
+  *error = sqrtf(max_cost);
+  return count;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "internal_types.h"
+
+size_t simplify_mesh(const Vertex *vertices, size_t vertex_count,
+                     const uint32_t *indices, size_t index_count,
+                     size_t target_index_count, uint32_t *destination,
+                     float *error);
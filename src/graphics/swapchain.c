@@ -4,7 +4,10 @@
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
+#include "allocator.h"
+#include "arena.h"
 #include "buffer_data.h"
+#include "gpu_culling.h"
 #include "internal_types.h"
 #include "kuta_internal.h"
 #include "renderer.h"
@@ -70,8 +73,8 @@ VkSurfaceFormatKHR get_formats(VkPhysicalDevice *physical_device,
          "Failed to get the number of surface formats")
 
   // Allocate memory for the formats and query them
-  VkSurfaceFormatKHR *formats =
-      malloc(format_count * sizeof(VkSurfaceFormatKHR));
+  VkSurfaceFormatKHR *formats = temp_alloc(
+      format_count * sizeof(VkSurfaceFormatKHR), _Alignof(VkSurfaceFormatKHR));
   EXPECT(!formats, "Failed to allocate memmory for formats")
   EXPECT(vkGetPhysicalDeviceSurfaceFormatsKHR(*(physical_device), *(surface),
                                               &format_count, formats),
@@ -88,6 +91,7 @@ VkSurfaceFormatKHR get_formats(VkPhysicalDevice *physical_device,
     }
   }
   VkSurfaceFormatKHR format = formats[format_index];
+  temp_free(formats);
   return format;
 }
 
@@ -104,7 +108,8 @@ VkPresentModeKHR select_present_mode(VkPhysicalDevice *physical_device,
 
   // Allocate and get supported present modes
   VkPresentModeKHR *present_modes =
-      malloc(present_mode_count * sizeof(VkPresentModeKHR));
+      temp_alloc(present_mode_count * sizeof(VkPresentModeKHR),
+                 _Alignof(VkPresentModeKHR));
   EXPECT(!present_modes, "Failed to allocate memmory for present modes")
   EXPECT(
       vkGetPhysicalDeviceSurfacePresentModesKHR(
@@ -125,6 +130,7 @@ VkPresentModeKHR select_present_mode(VkPhysicalDevice *physical_device,
     present_mode = present_modes[present_mode_index];
   }
 
+  temp_free(present_modes);
   return present_mode;
 }
 
@@ -154,7 +160,9 @@ void get_swapchain_images_and_create_image_views(VkSurfaceFormatKHR format,
                                  &state->swp_ch.image_count, NULL),
          "Failed to get swap chain images count")
   // Allocate based on the number of images in the new swapchain
-  state->swp_ch.images = malloc(state->swp_ch.image_count * sizeof(VkImage));
+  state->swp_ch.images =
+      kuta_malloc(KUTA_MEMORY_SWAPCHAIN,
+                  state->swp_ch.image_count * sizeof(VkImage));
   EXPECT(!state->swp_ch.images,
          "Failed to allocate memmory for swap chain images")
   EXPECT(vkGetSwapchainImagesKHR(state->vk_core.device, state->swp_ch.swapchain,
@@ -164,7 +172,8 @@ void get_swapchain_images_and_create_image_views(VkSurfaceFormatKHR format,
 
   // Allocate array for image views
   state->swp_ch.image_views =
-      malloc(state->swp_ch.image_count * sizeof(VkImageView));
+      kuta_malloc(KUTA_MEMORY_SWAPCHAIN,
+                  state->swp_ch.image_count * sizeof(VkImageView));
   EXPECT(!state->swp_ch.image_views,
          "Failed to allocate memmory for swap chain image views")
 
@@ -185,7 +194,8 @@ void get_swapchain_images_and_create_image_views(VkSurfaceFormatKHR format,
                        },
                    .viewType = VK_IMAGE_VIEW_TYPE_2D,
                },
-               state->vk_core.allocator, &state->swp_ch.image_views[i]),
+               kuta_vk_allocator(KUTA_MEMORY_SWAPCHAIN),
+               &state->swp_ch.image_views[i]),
            "Failed to create Image View %i", i)
   }
 }
@@ -232,7 +242,8 @@ void create_swapchain(State *state) {
                                             ? capabilities.maxImageCount
                                             : UINT32_MAX),
              },
-             state->vk_core.allocator, &state->swp_ch.swapchain),
+             kuta_vk_allocator(KUTA_MEMORY_SWAPCHAIN),
+             &state->swp_ch.swapchain),
          "Failed to create swap chain")
 
   get_swapchain_images_and_create_image_views(format, state);
@@ -252,6 +263,7 @@ void recreate_swapchain(State *state, World *world, uint32_t mipLevels) {
   create_swapchain(state);
   create_color_resources(state);
   create_depth_resources(state, mipLevels);
+  resize_gpu_culling(state);
   create_frame_buffers(state);
   camera_dirty(world);
 }
@@ -259,43 +271,43 @@ void recreate_swapchain(State *state, World *world, uint32_t mipLevels) {
 void cleanup_swapchain(State *state) {
   vkDestroyImageView(state->vk_core.device,
                      state->texture_data.color_image_view,
-                     state->vk_core.allocator);
+                     kuta_vk_allocator(KUTA_MEMORY_SWAPCHAIN));
 
   vkDestroyImage(state->vk_core.device, state->texture_data.color_image,
-                 state->vk_core.allocator);
+                 kuta_vk_allocator(KUTA_MEMORY_SWAPCHAIN));
 
-  vkFreeMemory(state->vk_core.device, state->texture_data.color_image_memory,
-               state->vk_core.allocator);
+  free_device_memory(state->vk_core.device,
+                     state->texture_data.color_image_memory);
 
   if (state->renderer.depth_image_view != VK_NULL_HANDLE) {
     vkDestroyImageView(state->vk_core.device, state->renderer.depth_image_view,
-                       state->vk_core.allocator);
+                       kuta_vk_allocator(KUTA_MEMORY_SWAPCHAIN));
     state->renderer.depth_image_view = VK_NULL_HANDLE;
   }
   if (state->renderer.depth_image != VK_NULL_HANDLE) {
     vkDestroyImage(state->vk_core.device, state->renderer.depth_image,
-                   state->vk_core.allocator);
+                   kuta_vk_allocator(KUTA_MEMORY_SWAPCHAIN));
     state->renderer.depth_image = VK_NULL_HANDLE;
   }
   if (state->renderer.depth_image_memory != VK_NULL_HANDLE) {
-    vkFreeMemory(state->vk_core.device, state->renderer.depth_image_memory,
-                 state->vk_core.allocator);
+    free_device_memory(state->vk_core.device,
+                       state->renderer.depth_image_memory);
     state->renderer.depth_image_memory = VK_NULL_HANDLE;
   }
   if (state->swp_ch.image_views) {
     for (uint32_t i = 0; i < state->swp_ch.image_count; i++) {
       vkDestroyImageView(state->vk_core.device, state->swp_ch.image_views[i],
-                         state->vk_core.allocator);
+                         kuta_vk_allocator(KUTA_MEMORY_SWAPCHAIN));
     }
-    free(state->swp_ch.image_views);
-    free(state->swp_ch.images);
+    kuta_free(state->swp_ch.image_views);
+    kuta_free(state->swp_ch.images);
     state->swp_ch.image_views = NULL;
     state->swp_ch.images = NULL;
   }
 
   if (state->swp_ch.swapchain) {
     vkDestroySwapchainKHR(state->vk_core.device, state->swp_ch.swapchain,
-                          state->vk_core.allocator);
+                          kuta_vk_allocator(KUTA_MEMORY_SWAPCHAIN));
     state->swp_ch.swapchain = VK_NULL_HANDLE;
   }
 }
@@ -1,3 +1,4 @@
+#include "allocator.h"
 #include "cglm/util.h"
 #include "utils.h"
 #include <math.h>
@@ -18,7 +19,8 @@ void create_image(uint32_t width, uint32_t height, VkFormat format,
                   VkImageTiling tiling, VkImageUsageFlags usage,
                   VkMemoryPropertyFlags properties, VkImage *image,
                   VkDeviceMemory *image_memory, uint32_t mipLevels,
-                  VkSampleCountFlagBits num_samples, State *state) {
+                  VkSampleCountFlagBits num_samples, KutaMemoryTag tag,
+                  State *state) {
 
   VkImageCreateInfo image_info = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
@@ -37,7 +39,7 @@ void create_image(uint32_t width, uint32_t height, VkFormat format,
   };
 
   EXPECT(vkCreateImage(state->vk_core.device, &image_info,
-                       state->vk_core.allocator, image),
+                       kuta_vk_allocator(tag), image),
          "Failed to create image")
 
   VkMemoryRequirements mem_requirements;
@@ -51,8 +53,8 @@ void create_image(uint32_t width, uint32_t height, VkFormat format,
           find_memory_type(mem_requirements.memoryTypeBits, properties, state),
   };
 
-  EXPECT(vkAllocateMemory(state->vk_core.device, &alloc_info,
-                          state->vk_core.allocator, image_memory),
+  EXPECT(allocate_device_memory(state->vk_core.device, &alloc_info, tag,
+                                image_memory),
          "Failed to allocate memmory for image")
   vkBindImageMemory(state->vk_core.device, *image, *image_memory, 0);
 }
@@ -157,7 +159,8 @@ create_texture_image(const char *filename, State *state,
   create_buffer(image_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                &staging_buffer, &staging_buffer_memmory, state);
+                &staging_buffer, &staging_buffer_memmory,
+                KUTA_MEMORY_RESOURCES, state);
 
   void *data;
   vkMapMemory(state->vk_core.device, staging_buffer_memmory, 0, image_size, 0,
@@ -172,7 +175,8 @@ create_texture_image(const char *filename, State *state,
                VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
                    VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture_image,
-               texture_image_memory, mipLevels, VK_SAMPLE_COUNT_1_BIT, state);
+               texture_image_memory, mipLevels, VK_SAMPLE_COUNT_1_BIT,
+               KUTA_MEMORY_RESOURCES, state);
 
   Texture_image__memory tx = {
       .texture_image = texture_image,
@@ -191,9 +195,8 @@ create_texture_image(const char *filename, State *state,
                    tex_height, mipLevels, state);
 
   vkDestroyBuffer(state->vk_core.device, staging_buffer,
-                  state->vk_core.allocator);
-  vkFreeMemory(state->vk_core.device, staging_buffer_memmory,
-               state->vk_core.allocator);
+                  kuta_vk_allocator(KUTA_MEMORY_RESOURCES));
+  free_device_memory(state->vk_core.device, staging_buffer_memmory);
 
   return tx;
 }
@@ -319,7 +322,8 @@ VkSampler create_texture_sampler(State *state) {
   };
   VkSampler texture_sampler;
   EXPECT(vkCreateSampler(state->vk_core.device, &sampler_info,
-                         state->vk_core.allocator, &texture_sampler),
+                         kuta_vk_allocator(KUTA_MEMORY_RESOURCES),
+                         &texture_sampler),
          "Failed to create texture sampler")
   return texture_sampler;
 }
@@ -363,7 +367,7 @@ void create_color_resources(State *state) {
                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
                &state->texture_data.color_image,
                &state->texture_data.color_image_memory, 1,
-               state->renderer.msaa_samples, state);
+               state->renderer.msaa_samples, KUTA_MEMORY_SWAPCHAIN, state);
 
   state->texture_data.color_image_view =
       create_image_view(state->texture_data.color_image, color_format,
@@ -32,7 +32,8 @@ void create_image(uint32_t width, uint32_t height, VkFormat format,
                   VkImageTiling tiling, VkImageUsageFlags usage,
                   VkMemoryPropertyFlags properties, VkImage *image,
                   VkDeviceMemory *image_memory, uint32_t mipLevels,
-                  VkSampleCountFlagBits num_samples, State *state);
+                  VkSampleCountFlagBits num_samples, KutaMemoryTag tag,
+                  State *state);
 
 VkSampleCountFlagBits get_max_usable_sample_count(State *state);
 
@@ -0,0 +1,63 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "jobs.h"
+#include "kuta.h"
+#include "threads.h"
+#include "types.h"
+
+typedef struct {
+  World *world;
+  Entity entity;
+  uint32_t worker;
+} CreateJob;
+
+static void create_job(void *data) {
+  CreateJob *job = data;
+  job->entity = defer_create_entity(job->world);
+  job->worker = kuta_job_worker_index();
+}
+
+// Defers a create on worker 1 and adds a component to the handle from worker
+// 0, whose buffer is flushed first. The add must not be dropped
+static bool test_create_on_other_worker(World *world) {
+  CreateJob job = {.world = world};
+  KutaJobCounter counter = {0};
+  kuta_job_submit(create_job, &job, &counter);
+
+  // Worker 0 only runs jobs while waiting, so spinning leaves it to worker 1
+  while (!kuta_job_done(&counter)) {
+    kuta_thread_yield();
+  }
+  if (job.entity == ENTITY_NULL || job.worker != 1) {
+    printf("Error: Create didn't run on worker 1!\n");
+    return false;
+  }
+
+  TransformComponent transform = {.scale = {1.0f, 1.0f, 1.0f}};
+  defer_add_component(world, job.entity, COMPONENT_TRANSFORM, &transform);
+  world_flush_commands(world);
+
+  if (!entity_exists(world, job.entity) ||
+      !get_component(world, job.entity, COMPONENT_TRANSFORM)) {
+    printf("Error: Component added on another worker was dropped!\n");
+    return false;
+  }
+  return true;
+}
+
+int main(void) {
+  if (!job_system_init(1) || kuta_job_worker_count() != 2) {
+    printf("Error: Failed to start the job system!\n");
+    return 1;
+  }
+
+  World world;
+  world_init(&world);
+  bool passed = test_create_on_other_worker(&world);
+  world_cleanup(&world);
+
+  job_system_shutdown();
+  return passed ? 0 : 1;
+}